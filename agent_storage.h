@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "simd.h"
+#include "simulation.h"
+
+// CPU agent containers, one per AgentLayout. Each one loads and stores blocks
+// of up to simd::LANES agents as three vectors so the kernels in
+// cpu_backend.h are written once and instantiated per layout. Partial blocks
+// repeat the last agent in the unused lanes. saveData and loadData convert
+// to and from the agentDataBytes format shared with the GPU backend.
+
+struct AosAgents {
+    static constexpr AgentLayout layout = AgentLayout::AOS;
+    std::vector<Agent> agents;
+
+    AosAgents(uint32_t width, uint32_t height) {
+        (void)width;
+        (void)height;
+    }
+
+    size_t size() const { return agents.size(); }
+    void resize(size_t count) { agents.resize(count); }
+    void reserve(size_t count) { agents.reserve(count); }
+    void swap(AosAgents &other) { agents.swap(other.agents); }
+
+    FPoint2D position(size_t i) const { return agents[i].Position; }
+    Agent get(size_t i) const { return agents[i]; }
+    void set(size_t i, float x, float y, float rotation) { agents[i] = { { x, y }, rotation }; }
+    void copy(size_t to, const AosAgents &from, size_t index) { agents[to] = from.agents[index]; }
+
+    void saveData(unsigned char *out) const { std::memcpy(out, agents.data(), agents.size() * sizeof(Agent)); }
+    void loadData(const unsigned char *in) { std::memcpy(agents.data(), in, agents.size() * sizeof(Agent)); }
+
+    void loadBlock(size_t first, size_t count, simd::VecF &x, simd::VecF &y, simd::VecF &rotation) const {
+        alignas(32) float xs[simd::LANES], ys[simd::LANES], rotations[simd::LANES];
+        for (int lane = 0; lane < simd::LANES; ++lane) {
+            const Agent &agent = agents[first + std::min<size_t>(lane, count - 1)];
+            xs[lane] = agent.Position.x;
+            ys[lane] = agent.Position.y;
+            rotations[lane] = agent.Rotation;
+        }
+        x = simd::load(xs);
+        y = simd::load(ys);
+        rotation = simd::load(rotations);
+    }
+
+    void storeBlock(size_t first, size_t count, simd::VecF x, simd::VecF y, simd::VecF rotation) {
+        alignas(32) float xs[simd::LANES], ys[simd::LANES], rotations[simd::LANES];
+        simd::store(xs, x);
+        simd::store(ys, y);
+        simd::store(rotations, rotation);
+        for (size_t lane = 0; lane < count; ++lane) {
+            agents[first + lane] = { { xs[lane], ys[lane] }, rotations[lane] };
+        }
+    }
+
+    // Where positions end up once stored.
+    void storedPositions(simd::VecF &x, simd::VecF &y) const {
+        (void)x;
+        (void)y;
+    }
+};
+
+struct SoaAgents {
+    static constexpr AgentLayout layout = AgentLayout::SOA;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> rotation;
+
+    SoaAgents(uint32_t width, uint32_t height) {
+        (void)width;
+        (void)height;
+    }
+
+    size_t size() const { return x.size(); }
+
+    void resize(size_t count) {
+        x.resize(count);
+        y.resize(count);
+        rotation.resize(count);
+    }
+
+    void reserve(size_t count) {
+        x.reserve(count);
+        y.reserve(count);
+        rotation.reserve(count);
+    }
+
+    void swap(SoaAgents &other) {
+        x.swap(other.x);
+        y.swap(other.y);
+        rotation.swap(other.rotation);
+    }
+
+    FPoint2D position(size_t i) const { return { x[i], y[i] }; }
+    Agent get(size_t i) const { return { { x[i], y[i] }, rotation[i] }; }
+
+    void set(size_t i, float agentX, float agentY, float agentRotation) {
+        x[i] = agentX;
+        y[i] = agentY;
+        rotation[i] = agentRotation;
+    }
+
+    void copy(size_t to, const SoaAgents &from, size_t index) {
+        x[to] = from.x[index];
+        y[to] = from.y[index];
+        rotation[to] = from.rotation[index];
+    }
+
+    void saveData(unsigned char *out) const {
+        const size_t bytes = x.size() * sizeof(float);
+        std::memcpy(out, x.data(), bytes);
+        std::memcpy(out + bytes, y.data(), bytes);
+        std::memcpy(out + 2 * bytes, rotation.data(), bytes);
+    }
+
+    void loadData(const unsigned char *in) {
+        const size_t bytes = x.size() * sizeof(float);
+        std::memcpy(x.data(), in, bytes);
+        std::memcpy(y.data(), in + bytes, bytes);
+        std::memcpy(rotation.data(), in + 2 * bytes, bytes);
+    }
+
+    void loadBlock(size_t first, size_t count, simd::VecF &outX, simd::VecF &outY, simd::VecF &outRotation) const {
+        if (count == size_t(simd::LANES)) {
+            outX = simd::load(&x[first]);
+            outY = simd::load(&y[first]);
+            outRotation = simd::load(&rotation[first]);
+            return;
+        }
+        alignas(32) float xs[simd::LANES], ys[simd::LANES], rotations[simd::LANES];
+        for (int lane = 0; lane < simd::LANES; ++lane) {
+            size_t i = first + std::min<size_t>(lane, count - 1);
+            xs[lane] = x[i];
+            ys[lane] = y[i];
+            rotations[lane] = rotation[i];
+        }
+        outX = simd::load(xs);
+        outY = simd::load(ys);
+        outRotation = simd::load(rotations);
+    }
+
+    void storeBlock(size_t first, size_t count, simd::VecF newX, simd::VecF newY, simd::VecF newRotation) {
+        if (count == size_t(simd::LANES)) {
+            simd::store(&x[first], newX);
+            simd::store(&y[first], newY);
+            simd::store(&rotation[first], newRotation);
+            return;
+        }
+        alignas(32) float xs[simd::LANES], ys[simd::LANES], rotations[simd::LANES];
+        simd::store(xs, newX);
+        simd::store(ys, newY);
+        simd::store(rotations, newRotation);
+        for (size_t lane = 0; lane < count; ++lane) {
+            x[first + lane] = xs[lane];
+            y[first + lane] = ys[lane];
+            rotation[first + lane] = rotations[lane];
+        }
+    }
+
+    void storedPositions(simd::VecF &outX, simd::VecF &outY) const {
+        (void)outX;
+        (void)outY;
+    }
+};
+
+// 16-bit fixed point positions (1/65536 of the grid size) and a 16-bit
+// heading (1/65536 of a turn): 6 bytes per agent instead of 12.
+struct CompactAgents {
+    static constexpr AgentLayout layout = AgentLayout::COMPACT;
+    std::vector<uint16_t> x;
+    std::vector<uint16_t> y;
+    std::vector<uint16_t> rotation;
+    float scaleX, scaleY;
+
+    CompactAgents(uint32_t width, uint32_t height)
+        : scaleX(width / 65536.0f), scaleY(height / 65536.0f) {}
+
+    size_t size() const { return x.size(); }
+
+    void resize(size_t count) {
+        x.resize(count);
+        y.resize(count);
+        rotation.resize(count);
+    }
+
+    void reserve(size_t count) {
+        x.reserve(count);
+        y.reserve(count);
+        rotation.reserve(count);
+    }
+
+    void swap(CompactAgents &other) {
+        x.swap(other.x);
+        y.swap(other.y);
+        rotation.swap(other.rotation);
+        std::swap(scaleX, other.scaleX);
+        std::swap(scaleY, other.scaleY);
+    }
+
+    static uint16_t encodePosition(float value, float scale) {
+        float q = value / scale + 0.5f;
+        return q <= 0.0f ? 0 : (q >= 65535.0f ? 65535 : static_cast<uint16_t>(q));
+    }
+
+    static uint16_t encodeRotation(float value) {
+        float turns = value * 0.15915494309f;
+        turns -= std::floor(turns);
+        return static_cast<uint16_t>(static_cast<uint32_t>(turns * 65536.0f + 0.5f));
+    }
+
+    static float decodeRotation(uint16_t value) { return value * 9.5873799242e-5f; }
+
+    FPoint2D position(size_t i) const { return { x[i] * scaleX, y[i] * scaleY }; }
+    Agent get(size_t i) const { return { position(i), decodeRotation(rotation[i]) }; }
+
+    void set(size_t i, float agentX, float agentY, float agentRotation) {
+        x[i] = encodePosition(agentX, scaleX);
+        y[i] = encodePosition(agentY, scaleY);
+        rotation[i] = encodeRotation(agentRotation);
+    }
+
+    void copy(size_t to, const CompactAgents &from, size_t index) {
+        x[to] = from.x[index];
+        y[to] = from.y[index];
+        rotation[to] = from.rotation[index];
+    }
+
+    void saveData(unsigned char *out) const {
+        const size_t count = x.size();
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t word = x[i] | (uint32_t(y[i]) << 16);
+            std::memcpy(out + i * 4, &word, 4);
+        }
+        for (size_t i = 0; i < count; i += 2) {
+            uint32_t word = rotation[i] | (i + 1 < count ? uint32_t(rotation[i + 1]) << 16 : 0);
+            std::memcpy(out + (count + i / 2) * 4, &word, 4);
+        }
+    }
+
+    void loadData(const unsigned char *in) {
+        const size_t count = x.size();
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t word;
+            std::memcpy(&word, in + i * 4, 4);
+            x[i] = word & 0xFFFF;
+            y[i] = word >> 16;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t word;
+            std::memcpy(&word, in + (count + i / 2) * 4, 4);
+            rotation[i] = (word >> ((i & 1) * 16)) & 0xFFFF;
+        }
+    }
+
+    void loadBlock(size_t first, size_t count, simd::VecF &outX, simd::VecF &outY, simd::VecF &outRotation) const {
+        alignas(32) float xs[simd::LANES], ys[simd::LANES], rotations[simd::LANES];
+        for (int lane = 0; lane < simd::LANES; ++lane) {
+            size_t i = first + std::min<size_t>(lane, count - 1);
+            xs[lane] = x[i] * scaleX;
+            ys[lane] = y[i] * scaleY;
+            rotations[lane] = decodeRotation(rotation[i]);
+        }
+        outX = simd::load(xs);
+        outY = simd::load(ys);
+        outRotation = simd::load(rotations);
+    }
+
+    void storeBlock(size_t first, size_t count, simd::VecF newX, simd::VecF newY, simd::VecF newRotation) {
+        alignas(32) float xs[simd::LANES], ys[simd::LANES], rotations[simd::LANES];
+        simd::store(xs, newX);
+        simd::store(ys, newY);
+        simd::store(rotations, newRotation);
+        for (size_t lane = 0; lane < count; ++lane) {
+            set(first + lane, xs[lane], ys[lane], rotations[lane]);
+        }
+    }
+
+    // Positions round to the nearest step, which may lie in the next pixel.
+    void storedPositions(simd::VecF &outX, simd::VecF &outY) const {
+        alignas(32) float xs[simd::LANES], ys[simd::LANES];
+        simd::store(xs, outX);
+        simd::store(ys, outY);
+        for (int lane = 0; lane < simd::LANES; ++lane) {
+            xs[lane] = encodePosition(xs[lane], scaleX) * scaleX;
+            ys[lane] = encodePosition(ys[lane], scaleY) * scaleY;
+        }
+        outX = simd::load(xs);
+        outY = simd::load(ys);
+    }
+};
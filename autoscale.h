@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+// Steers the number of active agents towards a target step rate. The loop
+// reports the steps it ran and the wall time they took; once per window the
+// controller compares the measured rate with the target and scales the
+// population by part of the difference. Agent cost is only part of a step,
+// so it approaches the sustainable count over a few windows rather than
+// overshooting it. Rates within the dead band of the target are left alone,
+// and the window after a change is discarded while the pipeline settles.
+class PopulationController {
+public:
+    PopulationController(double targetRate, uint32_t minimum) : targetRate(targetRate), minimum(std::max(minimum, 1u)) {}
+
+    // Where to start in a pool of poolSize agents: a fraction of it, so a
+    // slow machine does not spend its first window on the whole pool.
+    uint32_t initialPopulation(uint32_t poolSize) const {
+        return std::min(poolSize, std::max(minimum, poolSize / 16));
+    }
+
+    // Adds steps that took seconds at population agents. Returns the
+    // population to switch to, at most poolSize, or 0 to keep it.
+    uint32_t update(uint64_t steps, double seconds, uint32_t population, uint32_t poolSize) {
+        windowSteps += steps;
+        windowSeconds += seconds;
+        if (windowSeconds < WINDOW_SECONDS || windowSteps < WINDOW_STEPS) {
+            return 0;
+        }
+        rate = windowSteps / windowSeconds;
+        windowSteps = 0;
+        windowSeconds = 0.0;
+        if (settling) {
+            settling = false;
+            return 0;
+        }
+
+        double ratio = rate / targetRate;
+        if (ratio > 1.0 - DEAD_BAND && ratio < 1.0 + DEAD_BAND && population <= poolSize) {
+            return 0;
+        }
+        double scale = std::min(std::max(1.0 + GAIN * (ratio - 1.0), 0.5), 2.0);
+        double next = population * scale;
+        // Round to whole blocks of agents so the count does not creep
+        if (next > BLOCK) {
+            next = double(uint64_t(next / BLOCK + 0.5) * BLOCK);
+        }
+        uint32_t count = uint32_t(std::min(std::max(next, double(std::min(minimum, poolSize))), double(poolSize)));
+        if (count == population) {
+            return 0;
+        }
+        settling = true;
+        return count;
+    }
+
+    // Steps per second measured over the last full window.
+    double measuredRate() const { return rate; }
+
+private:
+    static constexpr double WINDOW_SECONDS = 0.5;
+    static constexpr uint64_t WINDOW_STEPS = 4;
+    static constexpr double DEAD_BAND = 0.05;
+    static constexpr double GAIN = 0.75;
+    static constexpr double BLOCK = 1024.0;
+
+    double targetRate;
+    uint32_t minimum;
+    uint64_t windowSteps = 0;
+    double windowSeconds = 0.0;
+    double rate = 0.0;
+    bool settling = false;
+};
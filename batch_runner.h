@@ -0,0 +1,96 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "simulation.h"
+
+// Runs the batches of the windowed loop, on a thread of its own when asked,
+// so the thread that owns the window presents one frame while the next is
+// computed. One batch is in flight at a time: start() hands it over and
+// wait() blocks until it is done, and in between only the thread running it
+// may touch the simulation. The CPU backend is threaded this way; the GPU
+// backend only queues commands, which the driver runs behind the present
+// anyway, so it runs its batches inline.
+class BatchRunner {
+public:
+    BatchRunner(Simulation &simulation, bool threaded) : simulation(simulation) {
+        if (threaded) {
+            worker = std::thread(&BatchRunner::workerLoop, this);
+        }
+    }
+
+    ~BatchRunner() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+    }
+
+    BatchRunner(const BatchRunner &) = delete;
+    BatchRunner &operator=(const BatchRunner &) = delete;
+
+    // Runs advance() with a copy of params and, in a batch that colorizes,
+    // renderTrailMap() after it.
+    void start(const SimulationParameters &params, uint64_t steps, bool colorize) {
+        batch = { params, steps, colorize };
+        if (!worker.joinable()) {
+            run();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = true;
+        }
+        wake.notify_one();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return !busy; });
+    }
+
+private:
+    struct Batch {
+        SimulationParameters params;
+        uint64_t steps;
+        bool colorize;
+    };
+
+    void run() {
+        simulation.advance(batch.params, batch.steps, batch.colorize);
+        if (batch.colorize) {
+            simulation.renderTrailMap();
+        }
+    }
+
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || busy; });
+            if (stopping) {
+                return;
+            }
+            lock.unlock();
+            run();
+            lock.lock();
+            busy = false;
+            done.notify_one();
+        }
+    }
+
+    Simulation &simulation;
+    Batch batch = {};
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool busy = false;
+    bool stopping = false;
+};
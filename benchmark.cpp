@@ -0,0 +1,523 @@
+#ifndef PHYSARUM_NO_GPU
+#include "gl_context.h"
+#endif
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "simulation.h"
+#include "options.h"
+#include "cpu_backend.h"
+#ifndef PHYSARUM_NO_GPU
+#include "gpu_backend.h"
+#endif
+
+#define ERROR_INIT_FAILED -1
+#define ERROR_INVALID_ARGUMENT -2
+#define ERROR_OUTPUT_FAILED -3
+#define ERROR_REGRESSION -5
+
+// Runs the pipeline headlessly over a matrix of resolutions, agent counts,
+// sensor sizes and diffusion radii. Every run starts from the same seed and
+// an empty trail map, so results only change when the code or the machine
+// does.
+
+struct Resolution {
+    uint32_t width;
+    uint32_t height;
+};
+
+struct BenchmarkOptions {
+#ifdef PHYSARUM_NO_GPU
+    Backend backend = Backend::CPU;
+#else
+    Backend backend = Backend::GPU;
+#endif
+    AgentLayout layout = AgentLayout::AOS;
+    TrailFormat trailFormat = TrailFormat::FP32;
+    uint64_t threads = 0;
+    uint64_t steps = 200;
+    uint64_t warmup = 20;
+    uint64_t seed = 1;
+    uint64_t sortEvery = 0;
+    uint64_t species = 1;
+
+    std::vector<Resolution> resolutions = { { 1920, 1080 } };
+    std::vector<uint64_t> agentCounts = { 1000000 };
+    std::vector<uint64_t> sensorSizes = { 0, 1, 2, 5, 10 };
+    std::vector<uint64_t> diffusionSizes = { 1, 2, 5, 10 };
+
+    std::string csvPath;
+    std::string jsonPath;
+    std::string baselinePath;
+    double tolerance = 10.0;
+};
+
+struct BenchmarkResult {
+    Resolution resolution;
+    uint64_t agents;
+    uint64_t sensorSize;
+    uint64_t diffusionSize;
+    // CPU backend worker threads, 0 on the GPU backend
+    unsigned threads;
+    double seconds;
+    double stepsPerSecond;
+    double agentUpdatesPerSecond;
+    double stageMilliseconds[STAGE_COUNT];
+};
+
+void printBenchmarkUsage(const char *program) {
+    std::cerr <<
+        "Usage: " << program << " [options]\n"
+        "  --backend gpu|cpu          simulation backend\n"
+        "  --agent-layout aos|soa|compact\n"
+        "  --trail-format fp32|fp16|unorm16|unorm8\n"
+        "                             GPU backend trail map storage (default fp32)\n"
+        "  --threads N                CPU backend worker threads (default: all cores)\n"
+        "  --steps N                  timed steps per run (default 200)\n"
+        "  --warmup N                 untimed steps before each run (default 20)\n"
+        "  --seed N                   agent initialization seed (default 1)\n"
+        "  --sort-every N             sort agents by screen tile every N steps (0 = never)\n"
+        "  --species N                species sharing the population, 1 to 4 (default 1)\n"
+        "  --resolutions LIST         e.g. 1920x1080,3840x2160 (default 1920x1080)\n"
+        "  --agents LIST              e.g. 100000,1000000,10000000 (default 1000000)\n"
+        "  --sensor-sizes LIST        e.g. 0-10 (default 0,1,2,5,10)\n"
+        "  --diffusion-sizes LIST     e.g. 1-10 (default 1,2,5,10)\n"
+        "  --csv FILE                 write the results as CSV\n"
+        "  --json FILE                write the results as JSON\n"
+        "  --baseline FILE            compare steps/s against a CSV from an earlier run\n"
+        "  --tolerance PERCENT        slowdown flagged as a regression (default 10)\n";
+}
+
+// Comma separated counts, where A-B stands for every count from A to B.
+bool parseCountList(const std::string &text, std::vector<uint64_t> &out) {
+    out.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        size_t dash = item.find('-', 1);
+        uint64_t first = 0, last = 0;
+        if (dash == std::string::npos) {
+            if (!parseCount(item.c_str(), first)) {
+                return false;
+            }
+            last = first;
+        } else if (!parseCount(item.substr(0, dash).c_str(), first) ||
+                   !parseCount(item.substr(dash + 1).c_str(), last) || last < first) {
+            return false;
+        }
+        for (uint64_t value = first; value <= last; ++value) {
+            out.push_back(value);
+        }
+    }
+    return !out.empty();
+}
+
+bool parseResolutionList(const std::string &text, std::vector<Resolution> &out) {
+    out.clear();
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        size_t separator = item.find('x');
+        uint64_t width = 0, height = 0;
+        if (separator == std::string::npos ||
+            !parseCount(item.substr(0, separator).c_str(), width) ||
+            !parseCount(item.substr(separator + 1).c_str(), height) ||
+            width < 1 || width > 32768 || height < 1 || height > 32768) {
+            return false;
+        }
+        out.push_back({ uint32_t(width), uint32_t(height) });
+    }
+    return !out.empty();
+}
+
+bool parseBenchmarkOptions(int argc, char **argv, BenchmarkOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+
+        bool valid = true;
+        double number = 0.0;
+        if (arg == "--backend") {
+            valid = parseBackend(value, options.backend);
+        } else if (arg == "--agent-layout") {
+            valid = parseAgentLayout(value, options.layout);
+        } else if (arg == "--trail-format") {
+            valid = parseTrailFormat(value, options.trailFormat);
+        } else if (arg == "--threads") {
+            valid = parseCount(value.c_str(), options.threads) && options.threads <= 0xFFFF;
+        } else if (arg == "--steps") {
+            valid = parseCount(value.c_str(), options.steps) && options.steps > 0;
+        } else if (arg == "--warmup") {
+            valid = parseCount(value.c_str(), options.warmup);
+        } else if (arg == "--seed") {
+            valid = parseCount(value.c_str(), options.seed) && options.seed <= 0xFFFFFFFF;
+        } else if (arg == "--sort-every") {
+            valid = parseCount(value.c_str(), options.sortEvery);
+        } else if (arg == "--species") {
+            valid = parseCount(value.c_str(), options.species) && options.species >= 1 && options.species <= MAX_SPECIES;
+        } else if (arg == "--resolutions") {
+            valid = parseResolutionList(value, options.resolutions);
+        } else if (arg == "--agents") {
+            valid = parseCountList(value, options.agentCounts);
+            for (uint64_t agents : options.agentCounts) {
+                valid = valid && agents >= 1 && agents <= 0xFFFFFFFF;
+            }
+        } else if (arg == "--sensor-sizes") {
+            valid = parseCountList(value, options.sensorSizes);
+        } else if (arg == "--diffusion-sizes") {
+            valid = parseCountList(value, options.diffusionSizes);
+        } else if (arg == "--csv") {
+            options.csvPath = value;
+        } else if (arg == "--json") {
+            options.jsonPath = value;
+        } else if (arg == "--baseline") {
+            options.baselinePath = value;
+        } else if (arg == "--tolerance") {
+            valid = parseNumber(value.c_str(), number) && number >= 0.0;
+            options.tolerance = number;
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+        if (!valid) {
+            std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string backendName(Backend backend) {
+    return backend == Backend::GPU ? "gpu" : "cpu";
+}
+
+// The settings shared by every run of one invocation. Only runs made with
+// the same settings are compared against each other.
+std::string settingsKey(const std::string &backend, const std::string &layout, const std::string &trailFormat,
+                        uint64_t species, uint64_t sortEvery, uint64_t threads) {
+    char key[256];
+    snprintf(key, sizeof(key), "%s/%s/%s/%llu species/sort %llu/%llu threads", backend.c_str(), layout.c_str(),
+        trailFormat.c_str(), static_cast<unsigned long long>(species), static_cast<unsigned long long>(sortEvery),
+        static_cast<unsigned long long>(threads));
+    return key;
+}
+
+// Identifies a run across benchmark invocations.
+std::string resultKey(const std::string &settings, uint32_t width, uint32_t height,
+                      uint64_t agents, uint64_t sensorSize, uint64_t diffusionSize) {
+    char key[384];
+    snprintf(key, sizeof(key), "%s/%ux%u/%llu/%llu/%llu", settings.c_str(), width, height,
+        static_cast<unsigned long long>(agents), static_cast<unsigned long long>(sensorSize),
+        static_cast<unsigned long long>(diffusionSize));
+    return key;
+}
+
+std::string settingsKey(const BenchmarkOptions &options, const BenchmarkResult &result) {
+    return settingsKey(backendName(options.backend), agentLayoutName(options.layout), trailFormatName(options.trailFormat),
+        options.species, options.sortEvery, result.threads);
+}
+
+BenchmarkResult runBenchmark(Simulation &simulation, const BenchmarkOptions &options, uint64_t sensorSize, uint64_t diffusionSize) {
+    SimulationParameters params;
+    params.agentSensorSize = float(sensorSize);
+    params.diffusionSize = float(diffusionSize);
+
+    const uint32_t width = simulation.gridWidth();
+    const uint32_t height = simulation.gridHeight();
+    simulation.enableStageTiming(false);
+    // Every run starts at step 0, so its random turns and sort phase do not
+    // depend on the runs before it in the matrix
+    simulation.setCurrentStep(0);
+    simulation.initAgents(static_cast<uint32_t>(options.seed));
+    simulation.writeTrailMap(std::vector<float>(size_t(width) * height * simulation.species(), 0.0f).data());
+
+    // Each step is the windowed frame without presenting: a colorizing step
+    // plus what colorizing is left
+    for (uint64_t step = 0; step < options.warmup; ++step) {
+        simulation.step(params, true);
+        simulation.renderTrailMap();
+    }
+    simulation.finish();
+    simulation.resetStageTimes();
+    simulation.enableStageTiming(true);
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (uint64_t step = 0; step < options.steps; ++step) {
+        simulation.step(params, true);
+        simulation.renderTrailMap();
+    }
+    simulation.finish();
+    std::chrono::duration<double> totalTime = std::chrono::high_resolution_clock::now() - startTime;
+
+    BenchmarkResult result = {};
+    result.resolution = { width, height };
+    result.agents = simulation.population();
+    result.sensorSize = sensorSize;
+    result.diffusionSize = diffusionSize;
+    result.seconds = totalTime.count();
+    result.stepsPerSecond = result.seconds > 0.0 ? options.steps / result.seconds : 0.0;
+    result.agentUpdatesPerSecond = result.stepsPerSecond * result.agents;
+    const StageTimes &times = simulation.stageTimes();
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        result.stageMilliseconds[stage] = times.average(stage);
+    }
+    return result;
+}
+
+bool writeCsv(const std::string &path, const BenchmarkOptions &options, const std::vector<BenchmarkResult> &results) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "backend,layout,trail_format,species,sort_every,threads,width,height,agents,sensor_size,diffusion_size,steps,"
+        "seconds,steps_per_second,agent_updates_per_second");
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        fprintf(file, ",%s_ms", stageName(stage));
+    }
+    fprintf(file, "\n");
+    for (const BenchmarkResult &result : results) {
+        fprintf(file, "%s,%s,%s,%llu,%llu,%u,%u,%u,%llu,%llu,%llu,%llu,%.6f,%.4f,%.6g", backendName(options.backend).c_str(),
+            agentLayoutName(options.layout), trailFormatName(options.trailFormat), static_cast<unsigned long long>(options.species),
+            static_cast<unsigned long long>(options.sortEvery), result.threads, result.resolution.width, result.resolution.height,
+            static_cast<unsigned long long>(result.agents), static_cast<unsigned long long>(result.sensorSize),
+            static_cast<unsigned long long>(result.diffusionSize), static_cast<unsigned long long>(options.steps),
+            result.seconds, result.stepsPerSecond, result.agentUpdatesPerSecond);
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            fprintf(file, ",%.4f", result.stageMilliseconds[stage]);
+        }
+        fprintf(file, "\n");
+    }
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+bool writeJson(const std::string &path, const BenchmarkOptions &options, const std::vector<BenchmarkResult> &results) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "{\n  \"backend\": \"%s\",\n  \"layout\": \"%s\",\n  \"trail_format\": \"%s\",\n  \"species\": %llu,\n"
+        "  \"sort_every\": %llu,\n  \"threads\": %u,\n  \"steps\": %llu,\n  \"warmup\": %llu,\n  \"seed\": %llu,\n  \"runs\": [",
+        backendName(options.backend).c_str(), agentLayoutName(options.layout), trailFormatName(options.trailFormat),
+        static_cast<unsigned long long>(options.species), static_cast<unsigned long long>(options.sortEvery),
+        results.empty() ? 0u : results[0].threads,
+        static_cast<unsigned long long>(options.steps), static_cast<unsigned long long>(options.warmup),
+        static_cast<unsigned long long>(options.seed));
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult &result = results[i];
+        fprintf(file, "%s\n    {\"width\": %u, \"height\": %u, \"agents\": %llu, \"sensor_size\": %llu, \"diffusion_size\": %llu, "
+            "\"seconds\": %.6f, \"steps_per_second\": %.4f, \"agent_updates_per_second\": %.6g, \"stage_ms\": {",
+            i ? "," : "", result.resolution.width, result.resolution.height,
+            static_cast<unsigned long long>(result.agents), static_cast<unsigned long long>(result.sensorSize),
+            static_cast<unsigned long long>(result.diffusionSize), result.seconds, result.stepsPerSecond,
+            result.agentUpdatesPerSecond);
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            fprintf(file, "%s\"%s\": %.4f", stage ? ", " : "", stageName(stage), result.stageMilliseconds[stage]);
+        }
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n  ]\n}\n");
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+// Reads steps/s per run key from a CSV written by writeCsv.
+bool readBaseline(const std::string &path, std::map<std::string, double> &out) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    std::map<std::string, size_t> columns;
+    if (std::getline(file, line)) {
+        std::stringstream header(line);
+        std::string name;
+        for (size_t column = 0; std::getline(header, name, ','); ++column) {
+            columns[name] = column;
+        }
+    }
+    const char *required[] = { "backend", "layout", "trail_format", "species", "sort_every", "threads", "width", "height",
+                               "agents", "sensor_size", "diffusion_size", "steps_per_second" };
+    for (const char *name : required) {
+        if (!columns.count(name)) {
+            std::cerr << "Baseline " << path << " has no " << name << " column" << std::endl;
+            return false;
+        }
+    }
+
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::stringstream row(line);
+        std::string field;
+        while (std::getline(row, field, ',')) {
+            fields.push_back(field);
+        }
+        if (fields.size() < columns.size()) {
+            continue;
+        }
+        auto get = [&](const char *name) { return fields[columns[name]]; };
+        std::string settings = settingsKey(get("backend"), get("layout"), get("trail_format"),
+            std::strtoull(get("species").c_str(), nullptr, 10), std::strtoull(get("sort_every").c_str(), nullptr, 10),
+            std::strtoull(get("threads").c_str(), nullptr, 10));
+        std::string key = resultKey(settings,
+            uint32_t(std::strtoul(get("width").c_str(), nullptr, 10)), uint32_t(std::strtoul(get("height").c_str(), nullptr, 10)),
+            std::strtoull(get("agents").c_str(), nullptr, 10), std::strtoull(get("sensor_size").c_str(), nullptr, 10),
+            std::strtoull(get("diffusion_size").c_str(), nullptr, 10));
+        out[key] = std::strtod(get("steps_per_second").c_str(), nullptr);
+    }
+    return true;
+}
+
+// Prints the change against the baseline for every run it covers and
+// returns the number of regressions. Baseline rows made with other settings
+// are skipped rather than compared.
+int compareBaseline(const BenchmarkOptions &options, const std::map<std::string, double> &baseline,
+                    const std::vector<BenchmarkResult> &results) {
+    int regressions = 0;
+    int compared = 0;
+    for (const BenchmarkResult &result : results) {
+        std::string key = resultKey(settingsKey(options, result),
+            result.resolution.width, result.resolution.height, result.agents, result.sensorSize, result.diffusionSize);
+        auto found = baseline.find(key);
+        if (found == baseline.end() || found->second <= 0.0) {
+            continue;
+        }
+        ++compared;
+        double change = (result.stepsPerSecond / found->second - 1.0) * 100.0;
+        bool regressed = change < -options.tolerance;
+        regressions += regressed;
+        printf("%-64s %10.2f -> %10.2f steps/s  %+6.1f%%%s\n", key.c_str(), found->second, result.stepsPerSecond,
+            change, regressed ? "  REGRESSION" : "");
+    }
+    if (!results.empty()) {
+        const std::string settings = settingsKey(options, results[0]) + "/";
+        size_t matching = 0;
+        for (const auto &row : baseline) {
+            matching += row.first.compare(0, settings.size(), settings) == 0;
+        }
+        if (matching < baseline.size()) {
+            printf("Skipped %zu baseline runs not made with %s\n", baseline.size() - matching,
+                settings.substr(0, settings.size() - 1).c_str());
+        }
+    }
+    printf("%d of %zu runs compared against the baseline, %d regressions beyond %.1f%%\n",
+        compared, results.size(), regressions, options.tolerance);
+    return regressions;
+}
+
+// threads is set to the CPU backend's worker count, or 0 on the GPU.
+std::unique_ptr<Simulation> createSimulation(const BenchmarkOptions &options, Resolution resolution, uint64_t agents,
+                                             unsigned &threads) {
+    threads = 0;
+#ifndef PHYSARUM_NO_GPU
+    if (options.backend == Backend::GPU) {
+        return std::make_unique<GpuSimulation>(resolution.width, resolution.height, uint32_t(agents), options.layout,
+            uint32_t(options.species), options.trailFormat, defaultTrailRange(SimulationParameters(), uint32_t(options.species)));
+    }
+#endif
+    std::unique_ptr<CpuSimulation> simulation = CpuSimulation::create(options.layout, resolution.width, resolution.height,
+        uint32_t(agents), static_cast<unsigned>(options.threads), uint32_t(options.species));
+    threads = simulation->threadCount();
+    return simulation;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    if (!parseBenchmarkOptions(argc, argv, options)) {
+        printBenchmarkUsage(argv[0]);
+        return ERROR_INVALID_ARGUMENT;
+    }
+
+    std::map<std::string, double> baseline;
+    if (!options.baselinePath.empty() && !readBaseline(options.baselinePath, baseline)) {
+        std::cerr << "Failed to read baseline " << options.baselinePath << std::endl;
+        return ERROR_INVALID_ARGUMENT;
+    }
+
+    if (options.backend == Backend::CPU && options.trailFormat != TrailFormat::FP32) {
+        std::cerr << "--trail-format " << trailFormatName(options.trailFormat) << " is for the GPU backend" << std::endl;
+        return ERROR_INVALID_ARGUMENT;
+    }
+
+#ifdef PHYSARUM_NO_GPU
+    if (options.backend == Backend::GPU) {
+        std::cerr << "Built without GPU support, only --backend cpu is available" << std::endl;
+        return ERROR_INVALID_ARGUMENT;
+    }
+#else
+    GLFWwindow *window = nullptr;
+    if (options.backend == Backend::GPU) {
+        window = createContextWindow(int(options.resolutions[0].width), int(options.resolutions[0].height), "Physarum benchmark", true);
+        if (!window) {
+            return ERROR_INIT_FAILED;
+        }
+    }
+#endif
+
+    printf("%s backend, %s layout, %s trail map, %llu species, %llu steps after %llu warmup, seed %llu\n", backendName(options.backend).c_str(),
+        agentLayoutName(options.layout), trailFormatName(options.trailFormat), static_cast<unsigned long long>(options.species), static_cast<unsigned long long>(options.steps),
+        static_cast<unsigned long long>(options.warmup), static_cast<unsigned long long>(options.seed));
+
+    std::vector<BenchmarkResult> results;
+    for (Resolution resolution : options.resolutions) {
+        for (uint64_t agents : options.agentCounts) {
+            unsigned threads = 0;
+            std::unique_ptr<Simulation> simulation = createSimulation(options, resolution, agents, threads);
+            simulation->setSortEvery(options.sortEvery);
+            for (uint64_t sensorSize : options.sensorSizes) {
+                for (uint64_t diffusionSize : options.diffusionSizes) {
+                    BenchmarkResult result = runBenchmark(*simulation, options, sensorSize, diffusionSize);
+                    result.threads = threads;
+                    printf("%ux%u %llu agents, sensor %llu, diffusion %llu: %.2f steps/s, %.3g agent updates/s\n  ",
+                        resolution.width, resolution.height, static_cast<unsigned long long>(agents),
+                        static_cast<unsigned long long>(sensorSize), static_cast<unsigned long long>(diffusionSize),
+                        result.stepsPerSecond, result.agentUpdatesPerSecond);
+                    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+                        if (result.stageMilliseconds[stage] > 0.0) {
+                            printf("%s %.3f ms  ", stageName(stage), result.stageMilliseconds[stage]);
+                        }
+                    }
+                    printf("\n");
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+#ifndef PHYSARUM_NO_GPU
+    if (window) {
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
+#endif
+
+    if (!options.csvPath.empty() && !writeCsv(options.csvPath, options, results)) {
+        std::cerr << "Failed to write " << options.csvPath << std::endl;
+        return ERROR_OUTPUT_FAILED;
+    }
+    if (!options.jsonPath.empty() && !writeJson(options.jsonPath, options, results)) {
+        std::cerr << "Failed to write " << options.jsonPath << std::endl;
+        return ERROR_OUTPUT_FAILED;
+    }
+    if (!options.baselinePath.empty() && compareBaseline(options, baseline, results) > 0) {
+        return ERROR_REGRESSION;
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 @echo off
 
-g++ -o main main.cpp -lglfw3 -lglew32 -lopengl32
+g++ -O2 -march=native -o main main.cpp -lglfw3 -lglew32 -lopengl32
+g++ -O2 -march=native -o benchmark benchmark.cpp -lglfw3 -lglew32 -lopengl32
 
 main
\ No newline at end of file
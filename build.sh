@@ -0,0 +1,10 @@
+#!/bin/sh
+
+# Pass --cpu-only to build without OpenGL, e.g. for headless render farms.
+if [ "$1" = "--cpu-only" ]; then
+    g++ -O2 -march=native -pthread -DPHYSARUM_NO_GPU -o main main.cpp
+    g++ -O2 -march=native -pthread -DPHYSARUM_NO_GPU -o benchmark benchmark.cpp
+else
+    g++ -O2 -march=native -pthread -o main main.cpp -lglfw -lGLEW -lGL
+    g++ -O2 -march=native -pthread -o benchmark benchmark.cpp -lglfw -lGLEW -lGL
+fi
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "simulation.h"
+
+#define CHECKPOINT_VERSION 3
+
+// A checkpoint is this header followed by the agents in the agentDataBytes
+// format of their layout and the trail map as width * height pixels of
+// speciesCount interleaved floats, all little endian. Both arrays start
+// 4-byte aligned, so a mapped file can be uploaded as is.
+struct CheckpointHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t width;
+    uint32_t height;
+    uint32_t agentCount;
+    uint32_t seed;
+    uint32_t speciesCount;
+    uint32_t reserved;      // zero, keeps step 8-byte aligned
+    uint64_t step;
+    SimulationParameters params;
+    uint64_t agentBytes;
+    uint64_t trailBytes;
+};
+
+static_assert(sizeof(CheckpointHeader) == 224, "CheckpointHeader must not contain padding");
+
+inline CheckpointHeader makeCheckpointHeader(const Simulation &simulation, uint32_t seed, const SimulationParameters &params) {
+    CheckpointHeader header = {};
+    std::memcpy(header.magic, "PHYSARUM", 8);
+    header.version = CHECKPOINT_VERSION;
+    header.layout = uint32_t(simulation.agentLayout());
+    header.width = simulation.gridWidth();
+    header.height = simulation.gridHeight();
+    header.agentCount = simulation.population();
+    header.seed = seed;
+    header.speciesCount = simulation.species();
+    header.step = simulation.currentStep();
+    header.params = params;
+    header.agentBytes = agentDataBytes(simulation.agentLayout(), simulation.population());
+    header.trailBytes = uint64_t(header.width) * header.height * header.speciesCount * sizeof(float);
+    return header;
+}
+
+// Writes one checkpoint at a time on a background thread. The file is
+// written next to the target and renamed over it when complete, so a crash
+// mid-write leaves the previous checkpoint intact.
+class CheckpointWriter {
+public:
+    ~CheckpointWriter() { wait(); }
+
+    bool busy() const { return running; }
+
+    // The buffer to fill with header and data; only touch it while not busy.
+    std::vector<unsigned char> &buffer() { return data; }
+
+    void start(const std::string &target) {
+        wait();
+        path = target;
+        running = true;
+        writer = std::thread([this] {
+            ok = writeFile();
+            running = false;
+        });
+    }
+
+    // Returns false when the last checkpoint failed to write.
+    bool wait() {
+        if (writer.joinable()) {
+            writer.join();
+        }
+        return ok;
+    }
+
+private:
+    bool writeFile() {
+        std::string temporary = path + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) {
+            std::cerr << "Failed to write checkpoint " << temporary << std::endl;
+            return false;
+        }
+        fwrite(data.data(), 1, data.size(), file);
+        bool written = ferror(file) == 0;
+        written = fclose(file) == 0 && written;
+#ifdef _WIN32
+        written = written && MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+        written = written && std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+        if (!written) {
+            std::cerr << "Failed to write checkpoint " << path << std::endl;
+        }
+        return written;
+    }
+
+    std::vector<unsigned char> data;
+    std::string path;
+    std::thread writer;
+    std::atomic<bool> running{ false };
+    bool ok = true;
+};
+
+// Takes checkpoints of a simulation. save() starts one and returns false
+// when the previous one is still in progress; poll() finishes it, waiting
+// for it when asked to.
+class CheckpointCapture {
+public:
+    virtual ~CheckpointCapture() = default;
+
+    virtual bool save(const std::string &path, uint32_t seed, const SimulationParameters &params) = 0;
+    virtual void poll(bool wait) { (void)wait; }
+
+    // Waits for everything in flight; false when a checkpoint failed.
+    bool finish() {
+        poll(true);
+        return writer.wait();
+    }
+
+protected:
+    CheckpointWriter writer;
+};
+
+// Backends whose data is already in host memory copy it synchronously and
+// only the file write runs in the background.
+class SimulationCheckpoint : public CheckpointCapture {
+public:
+    explicit SimulationCheckpoint(Simulation &simulation) : simulation(simulation) {}
+
+    bool save(const std::string &path, uint32_t seed, const SimulationParameters &params) override {
+        if (writer.busy()) {
+            return false;
+        }
+        CheckpointHeader header = makeCheckpointHeader(simulation, seed, params);
+        simulation.readAgentData(agents);
+        simulation.readTrailMap(trail);
+
+        std::vector<unsigned char> &data = writer.buffer();
+        data.resize(sizeof(header) + header.agentBytes + header.trailBytes);
+        std::memcpy(data.data(), &header, sizeof(header));
+        std::memcpy(data.data() + sizeof(header), agents.data(), header.agentBytes);
+        std::memcpy(data.data() + sizeof(header) + header.agentBytes, trail.data(), header.trailBytes);
+        writer.start(path);
+        return true;
+    }
+
+private:
+    Simulation &simulation;
+    std::vector<unsigned char> agents;
+    std::vector<float> trail;
+};
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &path) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        size = size_t(fileSize.QuadPart);
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping) {
+            bytes = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+#else
+        descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return false;
+        }
+        struct stat status;
+        if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+            size = size_t(status.st_size);
+            void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            bytes = mapped == MAP_FAILED ? nullptr : static_cast<const unsigned char *>(mapped);
+        }
+#endif
+        if (!bytes) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (bytes) {
+            UnmapViewOfFile(bytes);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes) {
+            munmap(const_cast<unsigned char *>(bytes), size);
+        }
+        if (descriptor >= 0) {
+            ::close(descriptor);
+        }
+        descriptor = -1;
+#endif
+        bytes = nullptr;
+        size = 0;
+    }
+
+    const unsigned char *data() const { return bytes; }
+    size_t length() const { return size; }
+
+private:
+    const unsigned char *bytes = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int descriptor = -1;
+#endif
+};
+
+// Maps a checkpoint and checks its header against the file. Prints the
+// reason and returns nullptr when it cannot be restored.
+// Whether every parameter is a finite number, as the command line and
+// --control require.
+inline bool finiteParameters(const SimulationParameters &params) {
+    bool finite = std::isfinite(params.agentSensorSize) && std::isfinite(params.decayRate) &&
+                  std::isfinite(params.diffusionRate) && std::isfinite(params.diffusionSize);
+    for (uint32_t species = 0; species < MAX_SPECIES; ++species) {
+        SpeciesParameters motion = speciesParameters(params, species);
+        finite = finite && std::isfinite(motion.agentVelocity) && std::isfinite(motion.agentTurnSpeed) &&
+                 std::isfinite(motion.agentSensorLength) && std::isfinite(motion.agentSensorAngle) &&
+                 std::isfinite(motion.depositAmount);
+        for (uint32_t channel = 0; channel < MAX_SPECIES; ++channel) {
+            finite = finite && std::isfinite(params.speciesWeights[species][channel]);
+        }
+    }
+    return finite;
+}
+
+inline const CheckpointHeader *openCheckpoint(const std::string &path, MappedFile &file) {
+    if (!file.open(path)) {
+        std::cerr << "Failed to open checkpoint " << path << std::endl;
+        return nullptr;
+    }
+    const CheckpointHeader *header = reinterpret_cast<const CheckpointHeader *>(file.data());
+    if (file.length() < sizeof(CheckpointHeader) || std::memcmp(header->magic, "PHYSARUM", 8) != 0) {
+        std::cerr << path << " is not a checkpoint" << std::endl;
+        return nullptr;
+    }
+    if (header->version != CHECKPOINT_VERSION) {
+        std::cerr << path << " has checkpoint version " << header->version << ", expected " << CHECKPOINT_VERSION << std::endl;
+        return nullptr;
+    }
+    bool valid = header->layout <= uint32_t(AgentLayout::COMPACT)
+        && header->width >= 1 && header->width <= 32768 && header->height >= 1 && header->height <= 32768
+        && header->agentCount >= 1
+        && header->speciesCount >= 1 && header->speciesCount <= MAX_SPECIES
+        && header->agentBytes == agentDataBytes(AgentLayout(header->layout), header->agentCount)
+        && header->trailBytes == uint64_t(header->width) * header->height * header->speciesCount * sizeof(float)
+        && file.length() == sizeof(CheckpointHeader) + header->agentBytes + header->trailBytes;
+    if (!valid) {
+        std::cerr << path << " is truncated or inconsistent" << std::endl;
+        return nullptr;
+    }
+    // The limits parseOptions applies to the same values; the CPU backend
+    // gathers trail values with 32-bit indices
+    if (uint64_t(header->width) * header->height * header->speciesCount > 0x7FFFFFFF) {
+        std::cerr << path << " has a grid too large for " << header->speciesCount << " species" << std::endl;
+        return nullptr;
+    }
+    if (!finiteParameters(header->params)) {
+        std::cerr << path << " holds parameters that are not finite numbers" << std::endl;
+        return nullptr;
+    }
+    return header;
+}
+
+// Loads a checkpoint opened with openCheckpoint into a simulation created
+// with its dimensions, agent count, layout and species count.
+inline void restoreCheckpoint(Simulation &simulation, const MappedFile &file) {
+    const CheckpointHeader *header = reinterpret_cast<const CheckpointHeader *>(file.data());
+    const unsigned char *agents = file.data() + sizeof(CheckpointHeader);
+    simulation.writeAgentData(agents);
+    simulation.writeTrailMap(reinterpret_cast<const float *>(agents + header->agentBytes));
+    simulation.setCurrentStep(header->step);
+    simulation.setRandomSeed(header->seed);
+}
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#ifndef _WIN32
+#include <cerrno>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "options.h"
+#include "simulation.h"
+
+// Hands parameter changes from control threads to the simulation loop. The
+// loop never waits: snapshots go through three slots, one being written,
+// one published and one being read, and consume() swaps the published one
+// out with a single atomic exchange. Writers edit the latest parameters
+// under a lock of their own, so several sources can share a channel.
+class ParameterChannel {
+public:
+    explicit ParameterChannel(const SimulationParameters &initial) : latest(initial) {
+        for (SimulationParameters &slot : slots) {
+            slot = initial;
+        }
+    }
+
+    // Calls edit(params) on a copy of the latest parameters and publishes
+    // it when edit returns true.
+    template <typename Fn>
+    bool update(Fn &&edit) {
+        std::lock_guard<std::mutex> lock(writers);
+        SimulationParameters edited = latest;
+        if (!edit(edited)) {
+            return false;
+        }
+        latest = edited;
+        slots[back] = edited;
+        back = published.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+        return true;
+    }
+
+    // For the simulation loop, once per batch of steps: replaces params with
+    // the newest snapshot when one was published since the last call.
+    bool consume(SimulationParameters &params) {
+        if (!(published.load(std::memory_order_acquire) & FRESH)) {
+            return false;
+        }
+        front = published.exchange(front, std::memory_order_acq_rel) & INDEX;
+        params = slots[front];
+        return true;
+    }
+
+private:
+    static constexpr uint32_t INDEX = 3;
+    static constexpr uint32_t FRESH = 4;
+
+    SimulationParameters slots[3];
+    std::atomic<uint32_t> published{ 1 };
+    uint32_t back = 0;
+    uint32_t front = 2;
+
+    std::mutex writers;
+    SimulationParameters latest;
+};
+
+// Applies one line of the control stream to params: a flat JSON object of
+// command line parameter names without the dashes, e.g.
+// {"agent-velocity": 1.5, "agent-sensor-angle": 30, "species-weight-0-1": 0.5}.
+// Names for a species or channel beyond speciesCount are invalid. Nothing is
+// applied when any entry is invalid; error then says why.
+inline bool applyControlCommand(const std::string &line, uint32_t speciesCount, SimulationParameters &params,
+                                std::string &error) {
+    SimulationParameters edited = params;
+    const char *next = line.c_str();
+    auto skipSpace = [&] {
+        while (std::isspace(static_cast<unsigned char>(*next))) {
+            ++next;
+        }
+    };
+    auto expect = [&](char c) {
+        skipSpace();
+        if (*next != c) {
+            return false;
+        }
+        ++next;
+        return true;
+    };
+
+    if (!expect('{')) {
+        error = "expected a JSON object";
+        return false;
+    }
+    skipSpace();
+    bool empty = *next == '}';
+    while (!empty) {
+        if (!expect('"')) {
+            error = "expected a parameter name";
+            return false;
+        }
+        const char *nameEnd = std::strchr(next, '"');
+        if (!nameEnd) {
+            error = "unterminated parameter name";
+            return false;
+        }
+        std::string name(next, nameEnd);
+        next = nameEnd + 1;
+        if (!expect(':')) {
+            error = "expected ':' after " + name;
+            return false;
+        }
+        skipSpace();
+        char *numberEnd = nullptr;
+        double value = std::strtod(next, &numberEnd);
+        float scale = 1.0f;
+        float *target = parameterOption(edited, "--" + name, scale);
+        if (!target) {
+            error = "unknown parameter " + name;
+            return false;
+        }
+        if (parameterOptionSpecies("--" + name) >= speciesCount) {
+            error = name + " is beyond the " + std::to_string(speciesCount) + " species of this run";
+            return false;
+        }
+        // strtod also reads nan and inf, which are not JSON and would fill
+        // the trail map with NaN
+        if (numberEnd == next || !std::isfinite(float(value) * scale)) {
+            error = "expected a finite number for " + name;
+            return false;
+        }
+        *target = float(value) * scale;
+        next = numberEnd;
+        skipSpace();
+        if (*next == '}') {
+            break;
+        }
+        if (!expect(',')) {
+            error = "expected ',' or '}'";
+            return false;
+        }
+    }
+    ++next;
+    skipSpace();
+    if (*next) {
+        error = "unexpected text after the object";
+        return false;
+    }
+    params = edited;
+    return true;
+}
+
+// One-line JSON reply to a control command.
+inline std::string controlReply(bool ok, const std::string &error) {
+    if (ok) {
+        return "{\"ok\": true}\n";
+    }
+    std::string reply = "{\"error\": \"";
+    for (char c : error) {
+        if (c == '"' || c == '\\') {
+            reply += '\\';
+        }
+        reply += c;
+    }
+    return reply + "\"}\n";
+}
+
+#ifdef _WIN32
+// The Win32 build is steered through its parameter window instead.
+class ControlServer {
+public:
+    static std::unique_ptr<ControlServer> open(const std::string &source, ParameterChannel &channel, uint32_t speciesCount) {
+        (void)source;
+        (void)channel;
+        (void)speciesCount;
+        std::cerr << "--control needs a POSIX system" << std::endl;
+        return nullptr;
+    }
+};
+#else
+// Reads control commands on a thread of its own and publishes them to a
+// channel, one JSON reply per command. The source is "-" for stdin or the
+// path of a Unix socket that takes one client at a time. The thread sleeps
+// in poll() until a command or the destructor wakes it.
+class ControlServer {
+public:
+    static std::unique_ptr<ControlServer> open(const std::string &source, ParameterChannel &channel, uint32_t speciesCount) {
+        std::unique_ptr<ControlServer> server(new ControlServer(channel, speciesCount));
+        if (pipe(server->wake) != 0) {
+            std::cerr << "Failed to create the control wake-up pipe" << std::endl;
+            return nullptr;
+        }
+        if (source != "-") {
+            sockaddr_un address = {};
+            address.sun_family = AF_UNIX;
+            if (source.size() >= sizeof(address.sun_path)) {
+                std::cerr << "Control socket path too long: " << source << std::endl;
+                return nullptr;
+            }
+            std::memcpy(address.sun_path, source.c_str(), source.size());
+            unlink(source.c_str());
+            server->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (server->listener < 0 || bind(server->listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+                listen(server->listener, 4) != 0) {
+                std::cerr << "Failed to listen for control commands on " << source << std::endl;
+                return nullptr;
+            }
+            server->socketPath = source;
+        }
+        server->reader = std::thread(&ControlServer::run, server.get());
+        return server;
+    }
+
+    ~ControlServer() {
+        if (reader.joinable()) {
+            char stop = 0;
+            ssize_t written = write(wake[1], &stop, 1);
+            (void)written;
+            reader.join();
+        }
+        for (int fd : { wake[0], wake[1], listener }) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (!socketPath.empty()) {
+            unlink(socketPath.c_str());
+        }
+    }
+
+    ControlServer(const ControlServer &) = delete;
+    ControlServer &operator=(const ControlServer &) = delete;
+
+private:
+    ControlServer(ParameterChannel &channel, uint32_t speciesCount) : channel(channel), speciesCount(speciesCount) {}
+
+    // Sleeps until fd has data; false once the server is stopping.
+    bool waitReadable(int fd) {
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { wake[0], POLLIN, 0 } };
+        while (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+        return !fds[1].revents && fds[0].revents;
+    }
+
+    void run() {
+        if (listener < 0) {
+            serve(STDIN_FILENO, -1);
+            return;
+        }
+        while (waitReadable(listener)) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client >= 0) {
+                serve(client, client);
+                close(client);
+            }
+        }
+    }
+
+    // Applies the commands of one stream until it ends; replies go to the
+    // socket, or to stdout for stdin.
+    void serve(int in, int out) {
+        std::string pending;
+        char buffer[4096];
+        while (waitReadable(in)) {
+            ssize_t count = read(in, buffer, sizeof(buffer));
+            if (count <= 0) {
+                return;
+            }
+            pending.append(buffer, size_t(count));
+            for (size_t newline; (newline = pending.find('\n')) != std::string::npos;) {
+                std::string line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+                std::string error;
+                bool ok = channel.update([&](SimulationParameters &params) {
+                    return applyControlCommand(line, speciesCount, params, error);
+                });
+                std::string reply = controlReply(ok, error);
+                if (out < 0) {
+                    fputs(reply.c_str(), stdout);
+                    fflush(stdout);
+                } else if (send(out, reply.data(), reply.size(), MSG_NOSIGNAL) != ssize_t(reply.size())) {
+                    return;
+                }
+            }
+        }
+    }
+
+    ParameterChannel &channel;
+    uint32_t speciesCount;
+    int wake[2] = { -1, -1 };
+    int listener = -1;
+    std::string socketPath;
+    std::thread reader;
+};
+#endif
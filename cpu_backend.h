@@ -0,0 +1,1009 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "agent_storage.h"
+#include "environment.h"
+#include "simd.h"
+#include "simulation.h"
+#include "thread_pool.h"
+
+// Native mirror of the compute shaders for machines without a GPU. This part
+// owns the trail maps; the agent stages live in CpuAgentSimulation, which is
+// instantiated per AgentLayout. Every stage is split across the pool.
+class CpuSimulation : public Simulation {
+public:
+    static std::unique_ptr<CpuSimulation> create(AgentLayout layout, uint32_t width, uint32_t height,
+                                                 uint32_t agentCount, unsigned threadCount, uint32_t speciesCount = 1);
+
+    unsigned threadCount() const { return pool.size(); }
+
+    // Colorizes into pixels instead of the internal buffer, e.g. straight
+    // into a mapped pixel buffer. nullptr switches back; the target must
+    // hold width * height pixels and is cleared by a resize. Targets are
+    // told apart by address and only redrawn where the trail map changed,
+    // so nothing else may write to them.
+    void setDisplayTarget(uint32_t *pixels) { displayTarget = pixels; }
+
+    // Each thread deposits into a fixed-point grid of its own. This sums them
+    // into the first one, adds that to the trail map and clears them; only
+    // the span each thread touched is read, which once agents are sorted is
+    // a band of rows per thread.
+    void renderAgents() override {
+        beginStage(STAGE_DEPOSIT);
+        DepositSpan touched = depositsTouched();
+        if (touched.first < touched.last) {
+            pool.parallelFor(touched.last - touched.first, [&](size_t begin, size_t end, unsigned thread) {
+                begin += touched.first;
+                end += touched.first;
+                sumDepositGrids(begin, end);
+                uint32_t *total = depositGrids.data();
+                uint8_t *marks = &tileMarks[thread * tileCount()];
+                const size_t length = rowLength();
+                const size_t tileLength = size_t(ACTIVE_TILE_SIZE) * speciesCount;
+                // One run per tile row segment, so the tile is looked up once
+                for (size_t idx = begin; idx < end;) {
+                    const size_t y = idx / length;
+                    const size_t tileX = (idx - y * length) / tileLength;
+                    const size_t stop = std::min(end, y * length + std::min(length, (tileX + 1) * tileLength));
+                    bool deposited = false;
+                    for (; idx < stop; ++idx) {
+                        if (total[idx]) {
+                            trailMap[idx] += float(total[idx]) * (1.0f / DEPOSIT_SCALE);
+                            total[idx] = 0;
+                            deposited = true;
+                        }
+                    }
+                    if (deposited) {
+                        marks[y / ACTIVE_TILE_SIZE * tilesX + tileX] = 1;
+                    }
+                }
+            });
+        }
+        depositSpans.assign(pool.size(), DepositSpan());
+        endStage(STAGE_DEPOSIT);
+    }
+
+    // Distributed runs exchange deposits between renderAgents() and the
+    // update: this sums the per-thread grids into the first one, whose rows
+    // can then be read and added to before renderAgents() applies them.
+    void sumDeposits() {
+        DepositSpan touched = depositsTouched();
+        if (touched.first < touched.last) {
+            pool.parallelFor(touched.last - touched.first, [&](size_t begin, size_t end, unsigned) {
+                sumDepositGrids(begin + touched.first, end + touched.first);
+            });
+        }
+        depositSpans.assign(pool.size(), DepositSpan());
+        depositSpans[0] = touched;
+    }
+
+    void readDepositRows(uint32_t first, uint32_t count, uint32_t *out) const {
+        const uint32_t *rows = &depositGrids[first * rowLength()];
+        std::copy(rows, rows + count * rowLength(), out);
+    }
+
+    void addDepositRows(uint32_t first, uint32_t count, const uint32_t *rows) {
+        const size_t begin = first * rowLength();
+        const size_t end = begin + count * rowLength();
+        for (size_t idx = begin; idx < end; ++idx) {
+            depositGrids[idx] += rows[idx - begin];
+        }
+        depositSpans[0].first = std::min(depositSpans[0].first, begin);
+        depositSpans[0].last = std::max(depositSpans[0].last, end);
+    }
+
+    // Row y of the trail map, rowLength() values; valid until the next
+    // processTrailMap().
+    const float *trailRow(uint32_t y) const { return &trailMap[y * rowLength()]; }
+    // Overwrites count rows from first on, which become active.
+    void writeTrailRows(uint32_t first, uint32_t count, const float *rows) {
+        std::copy(rows, rows + count * rowLength(), &trailMap[first * rowLength()]);
+        for (uint32_t tileY = first / ACTIVE_TILE_SIZE; tileY <= (first + count - 1) / ACTIVE_TILE_SIZE; ++tileY) {
+            for (uint32_t tileX = 0; tileX < tilesX; ++tileX) {
+                tileMarks[tileY * tilesX + tileX] = 1;
+                tileChanged[tileY * tilesX + tileX] = stepIndex + 1;
+            }
+        }
+    }
+    size_t rowLength() const { return size_t(width) * speciesCount; }
+
+    // Removes the agents whose y is outside [top, bottom) and appends them
+    // to out in slot order.
+    virtual void takeAgentsOutside(float top, float bottom, std::vector<Agent> &out) = 0;
+    // Appends agents to the population.
+    virtual void addAgents(const std::vector<Agent> &added) = 0;
+
+    // Agent idx of initAgents(seed) on a width x height grid. A position on
+    // an obstacle of fields is drawn again, see SEED_ATTEMPTS.
+    static Agent seedAgent(uint32_t seed, uint32_t idx, uint32_t width, uint32_t height,
+                           const EnvironmentFields *fields = nullptr) {
+        uint32_t state = seed + idx;
+        Agent agent;
+        for (int attempt = 0; attempt < SEED_ATTEMPTS; ++attempt) {
+            float randomRadius = random(state) * 300;
+            float randomAngle = (random(state) - 0.5f) * 2.0f * 3.14159265359f;
+            agent = { { width / 2.0f + randomRadius * std::cos(randomAngle), height / 2.0f + randomRadius * -std::sin(randomAngle) },
+                      randomAngle + 3.14159265359f };
+            if (!fields || !fields->onObstacle(agent.Position.x, agent.Position.y)) {
+                return agent;
+            }
+        }
+        fields->leaveObstacle(agent.Position.x, agent.Position.y);
+        return agent;
+    }
+
+    // Separable box blur with the same split as the shaders: a running sum
+    // along each row, then a running sum down each column of a tile that
+    // also mixes, decays and writes into the other trail map. Channels are
+    // blurred separately; the column pass treats every value of a row alike.
+    // Only the listed tiles are touched, see listActiveTiles(). In a step
+    // that colorizes, each tile is colorized into the display target right
+    // after its column pass, while it is still in cache.
+    void processTrailMap(const SimulationParameters &params) override {
+        beginStage(STAGE_DIFFUSE);
+        const int radius = clampDiffusionSize(params.diffusionSize);
+        uint32_t *pixels = displayPixels();
+        listActiveTiles();
+
+        pool.parallelFor(rowTiles.size() * ACTIVE_TILE_SIZE, [&](size_t begin, size_t end, unsigned) {
+            for (size_t item = begin; item < end; ++item) {
+                const uint32_t tile = rowTiles[item / ACTIVE_TILE_SIZE];
+                const size_t y = size_t(tile / tilesX) * ACTIVE_TILE_SIZE + item % ACTIVE_TILE_SIZE;
+                if (y >= height) {
+                    continue;
+                }
+                const uint32_t xStart = tile % tilesX * ACTIVE_TILE_SIZE;
+                const uint32_t xEnd = std::min(xStart + ACTIVE_TILE_SIZE, width);
+                for (uint32_t channel = 0; channel < speciesCount; ++channel) {
+                    blurRow(&trailMap[y * rowLength()], &trailMapBlur[y * rowLength()], radius, channel, xStart, xEnd);
+                }
+            }
+        });
+
+        pool.parallelFor(columnTiles.size(), [&](size_t begin, size_t end, unsigned) {
+            for (size_t item = begin; item < end; ++item) {
+                const uint32_t tile = columnTiles[item] & ~TILE_RETIRE;
+                if (columnTiles[item] & TILE_RETIRE) {
+                    clearTile(tile);
+                    tileMax[tile] = 0.0f;
+                } else {
+                    tileMax[tile] = blurColumns(params, tile, radius);
+                }
+                if (colorizing) {
+                    colorizeTile(trailMapNext.data(), pixels, tile);
+                }
+            }
+        });
+
+        if (colorizing) {
+            fusedPixels = pixels;
+            fusedStep = stepIndex + 1;
+        }
+        std::swap(trailMap, trailMapNext);
+        endStage(STAGE_DIFFUSE);
+    }
+
+    // Only the tiles changed since the target was last colorized are
+    // redone, less the ones the step just run colorized into it; a target
+    // seen for the first time is colorized whole.
+    void renderTrailMap() override {
+        beginStage(STAGE_COLORIZE);
+        uint32_t *pixels = displayPixels();
+        auto colorizedTarget = std::find_if(colorized.begin(), colorized.end(),
+            [&](const ColorizedTarget &target) { return target.pixels == pixels; });
+        const bool fused = fusedPixels == pixels && fusedStep == stepIndex;
+        colorTiles.clear();
+        for (uint32_t tile = 0; tile < tileCount(); ++tile) {
+            if (colorizedTarget == colorized.end() ||
+                (tileChanged[tile] > colorizedTarget->step && !(fused && tileChanged[tile] == fusedStep))) {
+                colorTiles.push_back(tile);
+            }
+        }
+        if (colorizedTarget == colorized.end()) {
+            // Only a few targets are ever alternated between
+            if (colorized.size() == 4) {
+                colorized.erase(colorized.begin());
+            }
+            colorizedTarget = colorized.insert(colorized.end(), { pixels, 0 });
+        }
+        colorizedTarget->step = stepIndex;
+
+        pool.parallelFor(colorTiles.size() * ACTIVE_TILE_SIZE, [&](size_t begin, size_t end, unsigned) {
+            for (size_t item = begin; item < end; ++item) {
+                const uint32_t tile = colorTiles[item / ACTIVE_TILE_SIZE];
+                colorizeRow(trailMap.data(), pixels, tile, size_t(tile / tilesX) * ACTIVE_TILE_SIZE + item % ACTIVE_TILE_SIZE);
+            }
+        });
+        endStage(STAGE_COLORIZE);
+    }
+
+    void readTrailMap(std::vector<float> &out) override { out = trailMap; }
+    void writeTrailMap(const float *trail) override {
+        std::copy(trail, trail + trailMap.size(), trailMap.begin());
+        activateAllTiles();
+    }
+    void readDisplay(std::vector<uint32_t> &out) override {
+        if (displayTarget) {
+            out.assign(displayTarget, displayTarget + display.size());
+        } else {
+            out = display;
+        }
+    }
+
+protected:
+    const char *backendName() const override { return "cpu"; }
+
+    void environmentChanged() override {
+        environmentFields = environment ? environment->fields(width, height) : nullptr;
+    }
+
+    CpuSimulation(uint32_t width, uint32_t height, uint32_t agentCount, unsigned threadCount, uint32_t speciesCount)
+        : Simulation(width, height, agentCount, speciesCount), pool(threadCount),
+          trailMap(size_t(width) * height * speciesCount, 0.0f), trailMapNext(size_t(width) * height * speciesCount, 0.0f),
+          trailMapBlur(size_t(width) * height * speciesCount, 0.0f), sensorSums(size_t(width) * height * speciesCount, 0.0f),
+          display(size_t(width) * height, 0),
+          depositGrids(size_t(width) * height * speciesCount * pool.size(), 0), depositSpans(pool.size()) {
+        activateAllTiles();
+    }
+
+    // Resamples the trail map and reallocates the per-pixel buffers.
+    void resizeGrid(uint32_t newWidth, uint32_t newHeight) {
+        if (newWidth == width && newHeight == height) {
+            return;
+        }
+        std::vector<float> resampled;
+        resampleTrailMap(trailMap, width, height, resampled, newWidth, newHeight, speciesCount);
+        trailMap.swap(resampled);
+
+        const size_t size = size_t(newWidth) * newHeight;
+        trailMapNext.assign(size * speciesCount, 0.0f);
+        trailMapBlur.assign(size * speciesCount, 0.0f);
+        sensorSums.assign(size * speciesCount, 0.0f);
+        display.assign(size, 0);
+        depositGrids.assign(size * speciesCount * pool.size(), 0);
+        depositSpans.assign(pool.size(), DepositSpan());
+        displayTarget = nullptr;
+        width = newWidth;
+        height = newHeight;
+        activateAllTiles();
+        environmentChanged();
+    }
+
+    // Trail map values a thread has deposited into, [first, last)
+    struct DepositSpan {
+        size_t first = SIZE_MAX;
+        size_t last = 0;
+    };
+
+    static float random(uint32_t &state) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return float(state) / 4294967295.0f;
+    }
+
+    DepositSpan depositsTouched() const {
+        DepositSpan touched;
+        for (const DepositSpan &span : depositSpans) {
+            touched.first = std::min(touched.first, span.first);
+            touched.last = std::max(touched.last, span.last);
+        }
+        return touched;
+    }
+
+    // Adds every thread's deposits in [begin, end) into the first grid and
+    // clears them.
+    void sumDepositGrids(size_t begin, size_t end) {
+        const size_t size = trailMap.size();
+        uint32_t *total = depositGrids.data();
+        for (unsigned thread = 1; thread < pool.size(); ++thread) {
+            uint32_t *grid = &depositGrids[thread * size];
+            size_t last = std::min(end, depositSpans[thread].last);
+            for (size_t idx = std::max(begin, depositSpans[thread].first); idx < last; ++idx) {
+                total[idx] += grid[idx];
+                grid[idx] = 0;
+            }
+        }
+    }
+
+    // What the sensors read this step: each value is the sum of its channel
+    // over the (2 * size + 1)^2 pixels around it, so sensing costs one read
+    // whatever the size. Built from the trail map with the running sums of
+    // the blur, through the blur's scratch map; size 0 reads the trail map.
+    const float *sumSensors(const SimulationParameters &params) {
+        const int radius = clampSensorSize(params.agentSensorSize);
+        if (radius == 0) {
+            return trailMap.data();
+        }
+        pool.parallelFor(height, [&](size_t begin, size_t end, unsigned) {
+            for (size_t y = begin; y < end; ++y) {
+                for (uint32_t channel = 0; channel < speciesCount; ++channel) {
+                    blurRow(&trailMap[y * rowLength()], &trailMapBlur[y * rowLength()], radius, channel, 0, width);
+                }
+            }
+        });
+        const size_t segments = (height + DIFFUSION_SEGMENT_HEIGHT - 1) / DIFFUSION_SEGMENT_HEIGHT;
+        pool.parallelFor(segments, [&](size_t begin, size_t end, unsigned) {
+            for (size_t segment = begin; segment < end; ++segment) {
+                sumColumns(segment, radius);
+            }
+        });
+        return sensorSums.data();
+    }
+
+    // Running sum along [xStart, xEnd) of one channel of a row.
+    void blurRow(const float *row, float *blur, int radius, uint32_t channel, uint32_t xStart, uint32_t xEnd) const {
+        const int w = static_cast<int>(width);
+        const size_t stride = speciesCount;
+        row += channel;
+        blur += channel;
+        double sum = 0.0;
+        for (int i = std::max(int(xStart) - radius, 0); i <= int(xStart) + radius && i < w; ++i) {
+            sum += row[i * stride];
+        }
+        for (int x = int(xStart); x < int(xEnd); ++x) {
+            blur[x * stride] = float(sum);
+            if (x + radius + 1 < w) {
+                sum += row[(x + radius + 1) * stride];
+            }
+            if (x - radius >= 0) {
+                sum -= row[(x - radius) * stride];
+            }
+        }
+    }
+
+    // Column pass over one tile. Returns the largest value written.
+    float blurColumns(const SimulationParameters &params, uint32_t tile, int radius) {
+        using namespace simd;
+        const int h = static_cast<int>(height);
+        const int yStart = static_cast<int>(tile / tilesX * ACTIVE_TILE_SIZE);
+        const int yEnd = std::min(yStart + ACTIVE_TILE_SIZE, h);
+        const size_t length = rowLength();
+        const size_t xStart = size_t(tile % tilesX) * ACTIVE_TILE_SIZE * speciesCount;
+        const size_t xEnd = std::min(xStart + size_t(ACTIVE_TILE_SIZE) * speciesCount, length);
+        const float inverseArea = 1.0f / float((radius * 2 + 1) * (radius * 2 + 1));
+        auto blurRowAt = [&](int y) -> const float * {
+            return y >= 0 && y < h ? &trailMapBlur[size_t(y) * length] : nullptr;
+        };
+
+        VecF peaks = set1(0.0f);
+        size_t x = xStart;
+        for (; x + LANES <= xEnd; x += LANES) {
+            VecF sum = set1(0.0f);
+            for (int j = -radius; j <= radius; ++j) {
+                if (const float *row = blurRowAt(yStart + j)) {
+                    sum = sum + load(row + x);
+                }
+            }
+            for (int y = yStart; y < yEnd; ++y) {
+                size_t idx = size_t(y) * length + x;
+                VecF current = load(&trailMap[idx]);
+                VecF diffused = (current + (sum * set1(inverseArea) - current) * set1(params.diffusionRate)) * set1(params.decayRate);
+                store(&trailMapNext[idx], diffused);
+                peaks = max(peaks, max(diffused, -diffused));
+                if (const float *row = blurRowAt(y + radius + 1)) {
+                    sum = sum + load(row + x);
+                }
+                if (const float *row = blurRowAt(y - radius)) {
+                    sum = sum - load(row + x);
+                }
+            }
+        }
+        float lanes[LANES];
+        store(lanes, peaks);
+        float peak = *std::max_element(lanes, lanes + LANES);
+        for (; x < xEnd; ++x) {
+            float sum = 0.0f;
+            for (int j = -radius; j <= radius; ++j) {
+                if (const float *row = blurRowAt(yStart + j)) {
+                    sum += row[x];
+                }
+            }
+            for (int y = yStart; y < yEnd; ++y) {
+                size_t idx = size_t(y) * length + x;
+                float diffused = trailMap[idx] + (sum * inverseArea - trailMap[idx]) * params.diffusionRate;
+                trailMapNext[idx] = diffused * params.decayRate;
+                peak = std::max(peak, std::fabs(trailMapNext[idx]));
+                if (const float *row = blurRowAt(y + radius + 1)) {
+                    sum += row[x];
+                }
+                if (const float *row = blurRowAt(y - radius)) {
+                    sum -= row[x];
+                }
+            }
+        }
+        return peak;
+    }
+
+    uint32_t *displayPixels() {
+        return displayTarget ? displayTarget : display.data();
+    }
+
+    // Colorizes row y of a tile from trail into pixels.
+    void colorizeRow(const float *trail, uint32_t *pixels, uint32_t tile, size_t y) {
+        if (y >= height) {
+            return;
+        }
+        const size_t xStart = tile % tilesX * ACTIVE_TILE_SIZE;
+        const size_t xEnd = std::min<size_t>(xStart + ACTIVE_TILE_SIZE, width);
+        for (size_t idx = y * width + xStart; idx < y * width + xEnd; ++idx) {
+            const float *pixel = &trail[idx * speciesCount];
+            float color[3] = {};
+            for (uint32_t channel = 0; channel < speciesCount; ++channel) {
+                float value = std::min(pixel[channel], 1.0f);
+                for (int component = 0; component < 3; ++component) {
+                    color[component] += value * SpeciesColors[channel][component];
+                }
+            }
+            pixels[idx] = (uint32_t(std::min(color[0], 1.0f) * 255) << 16) |
+                          (uint32_t(std::min(color[1], 1.0f) * 255) << 8) |
+                          uint32_t(std::min(color[2], 1.0f) * 255);
+        }
+    }
+
+    void colorizeTile(const float *trail, uint32_t *pixels, uint32_t tile) {
+        const size_t yStart = size_t(tile / tilesX) * ACTIVE_TILE_SIZE;
+        for (size_t y = yStart; y < yStart + ACTIVE_TILE_SIZE; ++y) {
+            colorizeRow(trail, pixels, tile, y);
+        }
+    }
+
+    // A tile dropped from the active ones is zeroed in both trail maps, so
+    // tiles that are skipped stay zero whichever map is current.
+    void clearTile(uint32_t tile) {
+        const size_t yStart = size_t(tile / tilesX) * ACTIVE_TILE_SIZE;
+        const size_t yEnd = std::min<size_t>(yStart + ACTIVE_TILE_SIZE, height);
+        const size_t xStart = size_t(tile % tilesX) * ACTIVE_TILE_SIZE * speciesCount;
+        const size_t xEnd = std::min(xStart + size_t(ACTIVE_TILE_SIZE) * speciesCount, rowLength());
+        for (size_t y = yStart; y < yEnd; ++y) {
+            std::fill(&trailMap[y * rowLength() + xStart], &trailMap[y * rowLength() + xEnd], 0.0f);
+            std::fill(&trailMapNext[y * rowLength() + xStart], &trailMapNext[y * rowLength() + xEnd], 0.0f);
+        }
+    }
+
+    uint32_t tileCount() const { return tilesX * tilesY; }
+
+    // Sizes the tile state for the grid and marks every tile, for when the
+    // whole trail map was replaced.
+    void activateAllTiles() {
+        tilesX = (width + ACTIVE_TILE_SIZE - 1) / ACTIVE_TILE_SIZE;
+        tilesY = (height + ACTIVE_TILE_SIZE - 1) / ACTIVE_TILE_SIZE;
+        tileMax.assign(tileCount(), 0.0f);
+        tileMarks.assign(size_t(tileCount()) * pool.size(), 0);
+        std::fill(tileMarks.begin(), tileMarks.begin() + tileCount(), 1);
+        tileLive.assign(tileCount(), 0);
+        tileProcessed.assign(tileCount(), 0);
+        tileChanged.assign(tileCount(), 0);
+        colorized.clear();
+    }
+
+    // A tile is live when it was deposited into or written since the last
+    // diffusion, or its largest value is still at least the epsilon. The
+    // column pass covers the live tiles and the ring around them, which the
+    // blur spreads into, plus the tiles leaving that set, to clear them. The
+    // row pass covers one more ring, so every row the column pass sums is
+    // fresh.
+    void listActiveTiles() {
+        const uint32_t count = tileCount();
+        for (uint32_t tile = 0; tile < count; ++tile) {
+            uint8_t marked = 0;
+            for (unsigned thread = 0; thread < pool.size(); ++thread) {
+                marked |= tileMarks[thread * count + tile];
+                tileMarks[thread * count + tile] = 0;
+            }
+            tileLive[tile] = marked || tileMax[tile] >= ACTIVE_TILE_EPSILON;
+        }
+
+        rowTiles.clear();
+        columnTiles.clear();
+        for (uint32_t tileY = 0; tileY < tilesY; ++tileY) {
+            for (uint32_t tileX = 0; tileX < tilesX; ++tileX) {
+                // Distance in tiles to the nearest live one, up to 2
+                int nearest = 3;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        int x = int(tileX) + dx;
+                        int y = int(tileY) + dy;
+                        if (x >= 0 && x < int(tilesX) && y >= 0 && y < int(tilesY) && tileLive[y * tilesX + x]) {
+                            nearest = std::min(nearest, std::max(std::abs(dx), std::abs(dy)));
+                        }
+                    }
+                }
+                const uint32_t tile = tileY * tilesX + tileX;
+                const bool processed = nearest <= 1;
+                if (nearest <= 2) {
+                    rowTiles.push_back(tile);
+                }
+                if (processed || tileProcessed[tile]) {
+                    columnTiles.push_back(processed ? tile : tile | TILE_RETIRE);
+                    tileChanged[tile] = stepIndex + 1;
+                }
+                tileProcessed[tile] = processed;
+            }
+        }
+    }
+
+    // Vertical half of sumSensors(): the running sums of blurColumns()
+    // without the mixing.
+    void sumColumns(size_t segment, int radius) {
+        using namespace simd;
+        const int h = static_cast<int>(height);
+        const int yStart = static_cast<int>(segment * DIFFUSION_SEGMENT_HEIGHT);
+        const int yEnd = std::min(yStart + DIFFUSION_SEGMENT_HEIGHT, h);
+        const size_t length = rowLength();
+        const int first = std::max(yStart - radius, 0);
+        const int last = std::min(yStart + radius, h - 1);
+        auto blurRowAt = [&](int y) -> const float * {
+            return y >= 0 && y < h ? &trailMapBlur[size_t(y) * length] : nullptr;
+        };
+
+        size_t x = 0;
+        for (; x + LANES <= length; x += LANES) {
+            VecF sum = set1(0.0f);
+            for (int j = first; j <= last; ++j) {
+                sum = sum + load(&trailMapBlur[size_t(j) * length + x]);
+            }
+            for (int y = yStart; y < yEnd; ++y) {
+                store(&sensorSums[size_t(y) * length + x], sum);
+                if (const float *row = blurRowAt(y + radius + 1)) {
+                    sum = sum + load(row + x);
+                }
+                if (const float *row = blurRowAt(y - radius)) {
+                    sum = sum - load(row + x);
+                }
+            }
+        }
+        for (; x < length; ++x) {
+            float sum = 0.0f;
+            for (int j = first; j <= last; ++j) {
+                sum += trailMapBlur[size_t(j) * length + x];
+            }
+            for (int y = yStart; y < yEnd; ++y) {
+                sensorSums[size_t(y) * length + x] = sum;
+                if (const float *row = blurRowAt(y + radius + 1)) {
+                    sum += row[x];
+                }
+                if (const float *row = blurRowAt(y - radius)) {
+                    sum -= row[x];
+                }
+            }
+        }
+    }
+
+    ThreadPool pool;
+
+    std::vector<float> trailMap;
+    std::vector<float> trailMapNext;
+    std::vector<float> trailMapBlur;
+    std::vector<float> sensorSums;
+    std::vector<uint32_t> display;
+    uint32_t *displayTarget = nullptr;
+    std::vector<uint32_t> depositGrids;
+    std::vector<DepositSpan> depositSpans;
+    // The environment at the grid size, shared with simulations of the same size
+    std::shared_ptr<const EnvironmentFields> environmentFields;
+
+    // Active tiles, see listActiveTiles(). Marks are per thread and tile.
+    static constexpr uint32_t TILE_RETIRE = 0x80000000u;
+    uint32_t tilesX = 0, tilesY = 0;
+    std::vector<float> tileMax;
+    std::vector<uint8_t> tileMarks;
+    std::vector<uint8_t> tileLive;
+    std::vector<uint8_t> tileProcessed;
+    // Step after which each tile last changed, and up to which each display
+    // target was colorized
+    std::vector<uint64_t> tileChanged;
+    struct ColorizedTarget {
+        const uint32_t *pixels;
+        uint64_t step;
+    };
+    std::vector<ColorizedTarget> colorized;
+    // The target and step after which the last colorizing step wrote it
+    const uint32_t *fusedPixels = nullptr;
+    uint64_t fusedStep = 0;
+    std::vector<uint32_t> rowTiles, columnTiles, colorTiles;
+};
+
+template <typename Agents>
+class CpuAgentSimulation : public CpuSimulation {
+public:
+    CpuAgentSimulation(uint32_t width, uint32_t height, uint32_t agentCount, unsigned threadCount, uint32_t speciesCount)
+        : CpuSimulation(width, height, agentCount, threadCount, speciesCount), agents(width, height), agentsScratch(width, height) {
+        agents.resize(agentCount);
+    }
+
+    void initAgents(uint32_t seed) override {
+        randomSeed = seed;
+        seedAgents(0, agentCount, seed);
+    }
+
+    void resize(uint32_t newWidth, uint32_t newHeight, uint32_t newAgentCount, uint32_t seed) override {
+        const float scaleX = float(newWidth) / width;
+        const float scaleY = float(newHeight) / height;
+        const size_t kept = std::min(agentCount, newAgentCount);
+
+        Agents resized(newWidth, newHeight);
+        resized.resize(newAgentCount);
+        pool.parallelFor(kept, [&](size_t begin, size_t end, unsigned) {
+            for (size_t idx = begin; idx < end; ++idx) {
+                Agent agent = agents.get(idx);
+                resized.set(idx, agent.Position.x * scaleX, agent.Position.y * scaleY, agent.Rotation);
+            }
+        });
+        agents.swap(resized);
+        agentsScratch = Agents(newWidth, newHeight);
+
+        resizeGrid(newWidth, newHeight);
+        agentCount = newAgentCount;
+        agentPool = newAgentCount;
+        seedAgents(kept, agentCount, seed);
+    }
+
+    // The vectors keep their capacity, so this only moves their ends.
+    void setPopulation(uint32_t count) override {
+        const size_t kept = std::min(agentCount, count);
+        agents.resize(count);
+        agentCount = count;
+        seedAgents(kept, agentCount, randomSeed);
+    }
+
+    // Each block is updated and then deposits, read back from storage so
+    // compact agents deposit at their quantized position like on the GPU.
+    void updateAgents(const SimulationParameters &params) override {
+        beginStage(STAGE_UPDATE);
+        uint32_t units[MAX_SPECIES];
+        for (uint32_t species = 0; species < speciesCount; ++species) {
+            units[species] = depositUnits(speciesParameters(params, species).depositAmount);
+        }
+        SpeciesTable table;
+        loadSpeciesTable(params, table);
+        const float *sums = sumSensors(params);
+        Surroundings surroundings = {};
+        if (environmentFields) {
+            surroundings.fields = environmentFields.get();
+            surroundings.sensed = environmentFields->sensed.empty() ? nullptr : environmentFields->sensed.data();
+            surroundings.obstacleDistance = environmentFields->obstacleDistance.empty() ? nullptr : environmentFields->obstacleDistance.data();
+            // Enough points along the fastest species' move to land on every pixel it crosses
+            float fastest = 1.0f;
+            for (uint32_t species = 0; species < speciesCount; ++species) {
+                fastest = std::max(fastest, std::fabs(speciesParameters(params, species).agentVelocity));
+            }
+            surroundings.pathSteps = int(std::ceil(fastest));
+        }
+        const uint32_t randomKey = stepRandomKey(randomSeed, stepIndex);
+        const size_t size = trailMap.size();
+        pool.parallelFor(agentCount, [&](size_t begin, size_t end, unsigned threadIndex) {
+            uint32_t *grid = &depositGrids[threadIndex * size];
+            DepositSpan span;
+            for (size_t first = begin; first < end; first += simd::LANES) {
+                const size_t last = std::min<size_t>(first + simd::LANES, end);
+                updateAgentBlock(table, sums, surroundings, randomKey, first, last - first);
+                for (size_t idx = first; idx < last; ++idx) {
+                    FPoint2D position = agents.position(idx);
+                    if (position.x >= 0 && position.x < width &&
+                        position.y >= 0 && position.y < height) {
+                        size_t pixel = uint32_t(position.y) * size_t(width) + uint32_t(position.x);
+                        uint32_t species = agentSpecies(uint32_t(idx), agentCount, speciesCount);
+                        size_t cell = pixel * speciesCount + species;
+                        grid[cell] += units[species];
+                        span.first = std::min(span.first, cell);
+                        span.last = std::max(span.last, cell + 1);
+                    }
+                }
+            }
+            depositSpans[threadIndex] = span;
+        });
+        endStage(STAGE_UPDATE);
+    }
+
+    // The leavers are found in parallel; their slots are then refilled from
+    // the end of the array, so only they and as many agents again move.
+    void takeAgentsOutside(float top, float bottom, std::vector<Agent> &out) override {
+        leaving.resize(pool.size());
+        pool.parallelFor(agentCount, [&](size_t begin, size_t end, unsigned threadIndex) {
+            std::vector<uint32_t> &found = leaving[threadIndex];
+            found.clear();
+            for (size_t idx = begin; idx < end; ++idx) {
+                float y = agents.position(idx).y;
+                if (y < top || y >= bottom) {
+                    found.push_back(uint32_t(idx));
+                }
+            }
+        });
+
+        // Chunks follow the thread index, so the slots come out ascending
+        std::vector<uint32_t> slots;
+        for (std::vector<uint32_t> &found : leaving) {
+            slots.insert(slots.end(), found.begin(), found.end());
+            found.clear();
+        }
+        for (uint32_t slot : slots) {
+            out.push_back(agents.get(slot));
+        }
+        const size_t kept = agentCount - slots.size();
+        size_t tail = agentCount;
+        size_t back = slots.size();
+        for (size_t i = 0; i < slots.size() && slots[i] < kept; ++i) {
+            --tail;
+            while (back > 0 && slots[back - 1] == tail) {
+                --back;
+                --tail;
+            }
+            agents.copy(slots[i], agents, tail);
+        }
+        agentCount = uint32_t(kept);
+        agents.resize(kept);
+    }
+
+    void addAgents(const std::vector<Agent> &added) override {
+        agents.resize(agentCount + added.size());
+        for (const Agent &agent : added) {
+            agents.set(agentCount++, agent.Position.x, agent.Position.y, agent.Rotation);
+        }
+        agentPool = std::max(agentPool, agentCount);
+    }
+
+    AgentLayout agentLayout() const override { return Agents::layout; }
+
+    void readAgentData(std::vector<unsigned char> &out) override {
+        out.resize(agentDataBytes(Agents::layout, agentCount));
+        agents.saveData(out.data());
+    }
+
+    void writeAgentData(const unsigned char *data) override { agents.loadData(data); }
+
+    // Parallel counting sort by tile key: per-thread histograms, an exclusive
+    // prefix over (bin, thread), then a stable scatter into the scratch array.
+    // Keys start with the species, so every species keeps its index range.
+    void sortAgents() override {
+        beginStage(STAGE_SORT);
+        const uint32_t tileBins = sortBinCount(width, height);
+        const uint32_t bins = tileBins * speciesCount;
+        auto key = [&](size_t idx) {
+            return agentSpecies(uint32_t(idx), agentCount, speciesCount) * tileBins + sortKey(agents.position(idx), width, height);
+        };
+        const unsigned threads = pool.size();
+        tileCounts.assign(size_t(bins) * threads, 0);
+        // Sized for the whole pool, so the swap below keeps its capacity
+        agentsScratch.reserve(agentPool);
+        agentsScratch.resize(agents.size());
+
+        pool.parallelFor(agentCount, [&](size_t begin, size_t end, unsigned threadIndex) {
+            uint32_t *counts = &tileCounts[size_t(threadIndex) * bins];
+            for (size_t idx = begin; idx < end; ++idx) {
+                ++counts[key(idx)];
+            }
+        });
+
+        uint32_t offset = 0;
+        for (uint32_t bin = 0; bin < bins; ++bin) {
+            for (unsigned thread = 0; thread < threads; ++thread) {
+                uint32_t &count = tileCounts[size_t(thread) * bins + bin];
+                uint32_t binCount = count;
+                count = offset;
+                offset += binCount;
+            }
+        }
+
+        pool.parallelFor(agentCount, [&](size_t begin, size_t end, unsigned threadIndex) {
+            uint32_t *offsets = &tileCounts[size_t(threadIndex) * bins];
+            for (size_t idx = begin; idx < end; ++idx) {
+                agentsScratch.copy(offsets[key(idx)]++, agents, idx);
+            }
+        });
+
+        agents.swap(agentsScratch);
+        endStage(STAGE_SORT);
+    }
+
+private:
+    // Seeds agents [first, last) exactly as the init shader would.
+    void seedAgents(size_t first, size_t last, uint32_t seed) {
+        pool.parallelFor(last - first, [&](size_t begin, size_t end, unsigned) {
+            for (size_t idx = first + begin; idx < first + end; ++idx) {
+                Agent agent = seedAgent(seed, static_cast<uint32_t>(idx), width, height, environmentFields.get());
+                agents.set(idx, agent.Position.x, agent.Position.y, agent.Rotation);
+            }
+        });
+    }
+
+    // Per-species values every block reads, worked out once per update: the
+    // species parameters, the cosine and sine of the sensor angle and the
+    // sense weights.
+    enum SpeciesValue { VELOCITY, TURN_SPEED, SENSOR_LENGTH, SENSOR_COS, SENSOR_SIN, WEIGHTS };
+    struct SpeciesTable {
+        alignas(32) float values[MAX_SPECIES][WEIGHTS + MAX_SPECIES];
+        float sensorSize;
+    };
+
+    // The environment fields of the grid, or nullptr where there are none,
+    // and the points a move near an obstacle is checked at.
+    struct Surroundings {
+        const EnvironmentFields *fields;
+        const float *sensed;
+        const float *obstacleDistance;
+        int pathSteps;
+    };
+
+    // Per-lane parameters of the species in a block of agents.
+    struct SpeciesLanes {
+        simd::VecF velocity, turnSpeed, sensorLength, sensorCos, sensorSin;
+        simd::VecF weights[MAX_SPECIES];
+    };
+
+    void loadSpeciesTable(const SimulationParameters &params, SpeciesTable &out) const {
+        for (uint32_t species = 0; species < speciesCount; ++species) {
+            SpeciesParameters motion = speciesParameters(params, species);
+            float *values = out.values[species];
+            values[VELOCITY] = motion.agentVelocity;
+            values[TURN_SPEED] = motion.agentTurnSpeed;
+            values[SENSOR_LENGTH] = motion.agentSensorLength;
+            values[SENSOR_COS] = std::cos(motion.agentSensorAngle);
+            values[SENSOR_SIN] = std::sin(motion.agentSensorAngle);
+            std::copy(params.speciesWeights[species], params.speciesWeights[species] + speciesCount, values + WEIGHTS);
+        }
+        out.sensorSize = float(clampSensorSize(params.agentSensorSize));
+    }
+
+    // Mirrors sense(): the sensor sum around the point sensorLength along
+    // (cosAngle, -sinAngle), weighted over the channels, plus the sensed
+    // environment at that point, or 0 if the square does not fit in the map.
+    simd::VecF sense(const float *sums, const float *sensed, const SpeciesTable &table, const SpeciesLanes &species,
+                     simd::VecF x, simd::VecF y, simd::VecF cosAngle, simd::VecF sinAngle) const {
+        using namespace simd;
+        const VecF size = set1(table.sensorSize);
+        VecF sensorX = x + species.sensorLength * cosAngle;
+        VecF sensorY = y - species.sensorLength * sinAngle;
+
+        Mask inside = (sensorX >= size) & (sensorX + size < set1(float(width))) &
+                      (sensorY >= size) & (sensorY + size < set1(float(height)));
+        VecI pixel = truncate(sensorY) * set1i(int32_t(width)) + truncate(sensorX);
+        VecI index = pixel * set1i(int32_t(speciesCount));
+        VecF sum = gather(sums, index, inside) * species.weights[0];
+        for (uint32_t channel = 1; channel < speciesCount; ++channel) {
+            sum = sum + gather(sums, index + set1i(int32_t(channel)), inside) * species.weights[channel];
+        }
+        if (sensed) {
+            sum = sum + gather(sensed, pixel, inside);
+        }
+        return sum;
+    }
+
+    void loadSpecies(const SpeciesTable &table, size_t first, size_t count, SpeciesLanes &out) const {
+        using namespace simd;
+        alignas(32) float lanes[WEIGHTS + MAX_SPECIES][LANES];
+        for (int lane = 0; lane < LANES; ++lane) {
+            uint32_t idx = uint32_t(first + std::min<size_t>(lane, count - 1));
+            const float *values = table.values[agentSpecies(idx, agentCount, speciesCount)];
+            for (uint32_t value = 0; value < WEIGHTS + speciesCount; ++value) {
+                lanes[value][lane] = values[value];
+            }
+        }
+        out.velocity = load(lanes[VELOCITY]);
+        out.turnSpeed = load(lanes[TURN_SPEED]);
+        out.sensorLength = load(lanes[SENSOR_LENGTH]);
+        out.sensorCos = load(lanes[SENSOR_COS]);
+        out.sensorSin = load(lanes[SENSOR_SIN]);
+        for (uint32_t channel = 0; channel < speciesCount; ++channel) {
+            out.weights[channel] = load(lanes[WEIGHTS + channel]);
+        }
+    }
+
+    // The three sensors share one sincos of the heading: the side ones turn
+    // it by the sensor angle with the angle addition formulas.
+    // Agents within reach of an obstacle check every pixel along their move
+    // and, if one is an obstacle, stay put and pick a random heading instead.
+    // One already on an obstacle, scaled there by a resize, or off the grid
+    // lands on the nearest free pixel.
+    void updateAgentBlock(const SpeciesTable &table, const float *sums, const Surroundings &surroundings,
+                          uint32_t randomKey, size_t first, size_t count) {
+        using namespace simd;
+        alignas(32) float randoms[LANES];
+        for (int lane = 0; lane < LANES; ++lane) {
+            randoms[lane] = unitFloat(pcgHash(uint32_t(first + lane) ^ randomKey));
+        }
+
+        VecF x, y, rotation;
+        agents.loadBlock(first, count, x, y, rotation);
+        SpeciesLanes species;
+        loadSpecies(table, first, count, species);
+        VecF turnSpeed = species.turnSpeed;
+
+        VecF sinHeading, cosHeading;
+        sincos(rotation, sinHeading, cosHeading);
+        VecF cosCos = cosHeading * species.sensorCos, sinSin = sinHeading * species.sensorSin;
+        VecF sinCos = sinHeading * species.sensorCos, cosSin = cosHeading * species.sensorSin;
+        VecF forwardSensor = sense(sums, surroundings.sensed, table, species, x, y, cosHeading, sinHeading);
+        VecF leftSensor = sense(sums, surroundings.sensed, table, species, x, y, cosCos - sinSin, sinCos + cosSin);
+        VecF rightSensor = sense(sums, surroundings.sensed, table, species, x, y, cosCos + sinSin, sinCos - cosSin);
+
+        VecF randomTurn = (load(randoms) - set1(0.5f)) * set1(2.0f) * turnSpeed;
+
+        Mask keep = (forwardSensor > leftSensor) & (forwardSensor > rightSensor);
+        Mask turnLeft = leftSensor > rightSensor;
+        Mask turnRight = rightSensor > leftSensor;
+        VecF turn = select(turnLeft, turnSpeed, select(turnRight, -turnSpeed, randomTurn));
+        rotation = rotation + select(keep, set1(0.0f), turn);
+
+        VecF sinRotation, cosRotation;
+        sincos(rotation, sinRotation, cosRotation);
+        VecF movedX = x + species.velocity * cosRotation;
+        VecF movedY = y - species.velocity * sinRotation;
+
+        // Handle boundary conditions
+        movedX = max(movedX, set1(0.0f));
+        movedX = select(movedX >= set1(float(width)), set1(float(width - 1)), movedX);
+        movedY = max(movedY, set1(0.0f));
+        movedY = select(movedY >= set1(float(height)), set1(float(height - 1)), movedY);
+
+        if (surroundings.obstacleDistance) {
+            // Obstacles are checked where the agent is stored
+            agents.storedPositions(movedX, movedY);
+            const VecI stride = set1i(int32_t(width));
+            const Mask inside = (x >= set1(0.0f)) & (x < set1(float(width))) & (y >= set1(0.0f)) & (y < set1(float(height)));
+            VecF clearance = gather(surroundings.obstacleDistance, truncate(y) * stride + truncate(x), inside);
+            VecF reach = max(species.velocity, -species.velocity) + set1(OBSTACLE_MARGIN);
+            Mask near = (clearance > set1(0.0f)) & (clearance <= reach);
+            if (any(near)) {
+                // Points at most a pixel apart, ending where the agent lands
+                const VecF fraction = set1(1.0f / float(surroundings.pathSteps));
+                const VecF stepX = (movedX - x) * fraction, stepY = (movedY - y) * fraction;
+                // Clamped against rounding past the last pixel, which they lie in
+                const VecF lastX = set1(float(width - 1)), lastY = set1(float(height - 1));
+                Mask clear = near;
+                for (int point = 1; point <= surroundings.pathSteps && any(clear); ++point) {
+                    const VecF along = set1(float(point));
+                    VecF pointX = min(x + stepX * along, lastX), pointY = min(y + stepY * along, lastY);
+                    VecF distance = gather(surroundings.obstacleDistance, truncate(pointY) * stride + truncate(pointX), clear);
+                    clear = clear & (distance > set1(0.0f));
+                }
+                Mask blocked = near & !clear;
+                movedX = select(blocked, x, movedX);
+                movedY = select(blocked, y, movedY);
+                rotation = select(blocked, load(randoms) * set1(6.28318531f), rotation);
+            }
+            // Agents on an obstacle or off the grid move without checking,
+            // and are moved off an obstacle they land on
+            Mask unchecked = clearance <= set1(0.0f);
+            if (any(unchecked)) {
+                VecF landing = gather(surroundings.obstacleDistance, truncate(movedY) * stride + truncate(movedX), unchecked);
+                Mask landed = unchecked & (landing <= set1(0.0f));
+                if (any(landed)) {
+                    alignas(32) float lanesX[LANES], lanesY[LANES];
+                    store(lanesX, movedX);
+                    store(lanesY, movedY);
+                    for (int lane = 0; lane < LANES; ++lane) {
+                        surroundings.fields->leaveObstacle(lanesX[lane], lanesY[lane]);
+                    }
+                    movedX = load(lanesX);
+                    movedY = load(lanesY);
+                }
+            }
+        }
+
+        agents.storeBlock(first, count, movedX, movedY, rotation);
+    }
+
+    Agents agents;
+    Agents agentsScratch;
+    // Agents per tile bin and thread, turned into offsets by sortAgents()
+    std::vector<uint32_t> tileCounts;
+    std::vector<std::vector<uint32_t>> leaving;
+};
+
+inline std::unique_ptr<CpuSimulation> CpuSimulation::create(AgentLayout layout, uint32_t width, uint32_t height,
+                                                            uint32_t agentCount, unsigned threadCount, uint32_t speciesCount) {
+    switch (layout) {
+        case AgentLayout::SOA:
+            return std::make_unique<CpuAgentSimulation<SoaAgents>>(width, height, agentCount, threadCount, speciesCount);
+        case AgentLayout::COMPACT:
+            return std::make_unique<CpuAgentSimulation<CompactAgents>>(width, height, agentCount, threadCount, speciesCount);
+        default:
+            return std::make_unique<CpuAgentSimulation<AosAgents>>(width, height, agentCount, threadCount, speciesCount);
+    }
+}
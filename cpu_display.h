@@ -0,0 +1,94 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <cstdint>
+
+#include "gl_context.h"
+
+// Presents frames colorized by the CPU backend. The frames are written
+// straight into a persistently mapped pixel buffer with two slots, so the
+// copy into the display texture happens on the GPU side while the CPU fills
+// the other slot, on the batch thread if there is one. A fence per slot
+// keeps the CPU from overwriting a frame that is still being uploaded.
+class CpuDisplay {
+public:
+    CpuDisplay(uint32_t width, uint32_t height) { create(width, height); }
+    ~CpuDisplay() { destroy(); }
+
+    CpuDisplay(const CpuDisplay &) = delete;
+    CpuDisplay &operator=(const CpuDisplay &) = delete;
+
+    // Where the next frame goes, width * height packed 0x00RRGGBB pixels.
+    uint32_t *frame() {
+        if (fences[slot]) {
+            glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(fences[slot]);
+            fences[slot] = nullptr;
+        }
+        return pixels + slot * frameSize();
+    }
+
+    // Uploads the frame returned by frame() once it is complete; present()
+    // shows it from then on, and frame() moves on to the other slot.
+    void finishFrame() {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE,
+            reinterpret_cast<const void *>(slot * frameSize() * sizeof(uint32_t)));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot ^= 1;
+    }
+
+    // Shows the last finished frame in the current window.
+    void present(int targetWidth, int targetHeight) {
+        blitToWindow(framebuffer, width, height, targetWidth, targetHeight);
+    }
+
+    void resize(uint32_t newWidth, uint32_t newHeight) {
+        if (newWidth != width || newHeight != height) {
+            destroy();
+            create(newWidth, newHeight);
+        }
+    }
+
+private:
+    size_t frameSize() const { return size_t(width) * height; }
+
+    void create(uint32_t newWidth, uint32_t newHeight) {
+        width = newWidth;
+        height = newHeight;
+        slot = 0;
+        fences[0] = fences[1] = nullptr;
+
+        // Readable too, so recording can copy the frame back out
+        const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        const GLsizeiptr bytes = 2 * frameSize() * sizeof(uint32_t);
+        glGenBuffers(1, &pixelBuffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, flags);
+        pixels = static_cast<uint32_t *>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, flags));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        createDisplayTexture(width, height, texture, framebuffer);
+    }
+
+    void destroy() {
+        for (GLsync &fence : fences) {
+            if (fence) {
+                glDeleteSync(fence);
+            }
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &pixelBuffer);
+        deleteDisplayTexture(texture, framebuffer);
+    }
+
+    uint32_t width, height;
+    GLuint pixelBuffer, texture, framebuffer;
+    uint32_t *pixels;
+    GLsync fences[2];
+    int slot;
+};
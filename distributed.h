@@ -0,0 +1,317 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "cpu_backend.h"
+#include "simulation.h"
+#include "transport.h"
+
+// Per-rank figures collected on rank 0 at the end of a distributed run.
+struct RankStatistics {
+    uint32_t bandFirst;
+    uint32_t bandLast;
+    uint32_t agents;
+    uint32_t reserved;
+    double exchangeMilliseconds;
+};
+
+// Splits the grid of a single-species run into horizontal bands, one per
+// rank. Each rank runs a CpuSimulation over its band plus halo rows that
+// mirror the neighbouring bands. The halo covers the blur radius, the sensor
+// reach and one step of movement, so a rank only talks to the ranks above
+// and below:
+//  - after the update, deposits that landed in a halo go to the rank owning
+//    those rows, and deposits on the rows a neighbour mirrors go to that
+//    neighbour, both in one exchange; every copy of a row then holds the same
+//    fixed-point total, so the blur sees the same values on both sides;
+//  - after the diffusion, the mirrored rows go to the neighbours along with
+//    the agents that moved into their band.
+// Everything sent between ranks is in global coordinates.
+class DistributedSimulation {
+public:
+    // Prints the reason and returns nullptr when the bands are too thin for
+    // the halo the parameters need.
+    static std::unique_ptr<DistributedSimulation> create(Transport &transport, AgentLayout layout, uint32_t width,
+                                                         uint32_t height, unsigned threadCount,
+                                                         const SimulationParameters &params) {
+        const uint32_t halo = haloRows(params);
+        const uint32_t thinnest = height / uint32_t(transport.size());
+        if (transport.size() > 1 && thinnest < 2 * halo) {
+            if (transport.rank() == 0) {
+                std::cerr << "Bands of " << thinnest << " rows are too thin for " << transport.size()
+                          << " ranks: the parameters need " << halo << " halo rows, and a band at least twice that" << std::endl;
+            }
+            return nullptr;
+        }
+        return std::unique_ptr<DistributedSimulation>(
+            new DistributedSimulation(transport, layout, width, height, threadCount, halo));
+    }
+
+    // Rows a band shares with each neighbour: the blur radius, and how far
+    // an agent senses or moves from inside its band in one step.
+    static uint32_t haloRows(const SimulationParameters &params) {
+        float sensorReach = std::fabs(params.agentSensorLength) + float(clampSensorSize(params.agentSensorSize));
+        float reach = std::max(sensorReach, std::fabs(params.agentVelocity));
+        return std::max(uint32_t(clampDiffusionSize(params.diffusionSize)), uint32_t(std::ceil(reach)) + 1);
+    }
+
+    // Band of a rank, [first, last) in global rows.
+    static uint32_t bandStart(uint32_t height, int ranks, int rank) {
+        return uint32_t(uint64_t(height) * uint32_t(rank) / uint32_t(ranks));
+    }
+
+    uint32_t bandFirst() const { return first; }
+    uint32_t bandLast() const { return last; }
+    uint32_t haloSize() const { return halo; }
+    uint32_t population() const { return simulation->population(); }
+    double exchangeMilliseconds() const { return exchangeTime; }
+    CpuSimulation &local() { return *simulation; }
+
+    // Every rank seeds the agents of the whole grid like initAgents would
+    // and keeps the ones that start in its band.
+    void initAgents(uint32_t seed, uint32_t agentCount) {
+        const unsigned threads = simulation->threadCount();
+        std::vector<std::vector<Agent>> found(threads);
+        std::vector<std::thread> workers;
+        for (unsigned thread = 0; thread < threads; ++thread) {
+            workers.emplace_back([&, thread] {
+                uint32_t begin = uint32_t(uint64_t(agentCount) * thread / threads);
+                uint32_t end = uint32_t(uint64_t(agentCount) * (thread + 1) / threads);
+                for (uint32_t idx = begin; idx < end; ++idx) {
+                    Agent agent = CpuSimulation::seedAgent(seed, idx, width, height);
+                    if (agent.Position.y >= top() && agent.Position.y < bottom()) {
+                        agent.Position.y -= float(origin);
+                        found[thread].push_back(agent);
+                    }
+                }
+            });
+        }
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+        simulation->setRandomSeed(seed);
+        for (const std::vector<Agent> &agents : found) {
+            simulation->addAgents(agents);
+        }
+    }
+
+    void setSortEvery(uint64_t steps) { sortEvery = steps; }
+
+    // One step of Simulation::step with the exchanges in between. Returns
+    // false when a neighbour is lost.
+    bool step(const SimulationParameters &params) {
+        if (sortEvery && simulation->currentStep() % sortEvery == 0) {
+            simulation->sortAgents();
+        }
+        simulation->updateAgents(params);
+        simulation->sumDeposits();
+        if (!exchangeDeposits()) {
+            return false;
+        }
+        simulation->renderAgents();
+        simulation->processTrailMap(params);
+        if (!exchangeBorders()) {
+            return false;
+        }
+        simulation->setCurrentStep(simulation->currentStep() + 1);
+        return true;
+    }
+
+    // Colorizes every band and assembles the display on rank 0, width *
+    // height pixels in out; the other ranks only send theirs.
+    bool gatherDisplay(std::vector<uint32_t> &out) {
+        simulation->renderTrailMap();
+        simulation->readDisplay(localDisplay);
+        const uint32_t *band = &localDisplay[size_t(first - origin) * width];
+        const size_t bandPixels = size_t(last - first) * width;
+        if (transport.rank() != 0) {
+            outgoing.assign(reinterpret_cast<const unsigned char *>(band),
+                            reinterpret_cast<const unsigned char *>(band + bandPixels));
+            return transport.sendMessage(0, outgoing);
+        }
+
+        out.resize(size_t(width) * height);
+        std::copy(band, band + bandPixels, out.begin() + size_t(first) * width);
+        for (int rank = 1; rank < transport.size(); ++rank) {
+            if (!transport.receiveMessage(rank, incoming)) {
+                return false;
+            }
+            std::memcpy(&out[size_t(bandStart(height, transport.size(), rank)) * width], incoming.data(), incoming.size());
+        }
+        return true;
+    }
+
+    // Collects every rank's RankStatistics on rank 0, in rank order.
+    bool gatherStatistics(std::vector<RankStatistics> &out) {
+        RankStatistics own = { first, last, simulation->population(), 0, exchangeTime };
+        if (transport.rank() != 0) {
+            return transport.send(0, &own, sizeof(own));
+        }
+        out.assign(size_t(transport.size()), own);
+        for (int rank = 1; rank < transport.size(); ++rank) {
+            if (!transport.receive(rank, &out[rank], sizeof(RankStatistics))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    DistributedSimulation(Transport &transport, AgentLayout layout, uint32_t width, uint32_t height,
+                          unsigned threadCount, uint32_t halo)
+        : transport(transport), width(width), height(height), halo(halo) {
+        const int rank = transport.rank();
+        first = bandStart(height, transport.size(), rank);
+        last = bandStart(height, transport.size(), rank + 1);
+        haloAbove = hasAbove() ? halo : 0;
+        haloBelow = hasBelow() ? halo : 0;
+        origin = first - haloAbove;
+        simulation = CpuSimulation::create(layout, width, last - first + haloAbove + haloBelow, 0, threadCount);
+    }
+
+    bool hasAbove() const { return transport.rank() > 0; }
+    bool hasBelow() const { return transport.rank() + 1 < transport.size(); }
+
+    // Global rows an agent of this band may have; the outer bands also own
+    // whatever lies beyond the grid edge.
+    float top() const { return hasAbove() ? float(first) : -std::numeric_limits<float>::infinity(); }
+    float bottom() const { return hasBelow() ? float(last) : std::numeric_limits<float>::infinity(); }
+
+    // Local rows of the halos and of the band rows the neighbours mirror.
+    uint32_t haloAboveRow() const { return 0; }
+    uint32_t edgeAboveRow() const { return haloAbove; }
+    uint32_t edgeBelowRow() const { return last - origin - haloBelow; }
+    uint32_t haloBelowRow() const { return last - origin; }
+
+    template <typename T>
+    static void append(std::vector<unsigned char> &message, const T *values, size_t count) {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(values);
+        message.insert(message.end(), bytes, bytes + count * sizeof(T));
+    }
+
+    // Swaps a message with each neighbour. Pairs whose upper rank is even go
+    // first and the others second, so every rank works with one neighbour at
+    // a time and the chain never waits on itself.
+    bool exchangeNeighbours() {
+        auto start = std::chrono::high_resolution_clock::now();
+        const int rank = transport.rank();
+        bool ok = true;
+        for (int phase = 0; phase < 2 && ok; ++phase) {
+            if (hasBelow() && rank % 2 == phase) {
+                ok = transport.exchange(rank + 1, toBelow, fromBelow);
+            } else if (hasAbove() && rank % 2 != phase) {
+                ok = transport.exchange(rank - 1, toAbove, fromAbove);
+            }
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+        exchangeTime += elapsed.count();
+        return ok;
+    }
+
+    // Each message is the deposits in the halo, for the owner's band, then
+    // the deposits on the mirrored band rows, for the neighbour's halo.
+    bool exchangeDeposits() {
+        const size_t values = halo * simulation->rowLength();
+        rows.resize(2 * values);
+        auto pack = [&](std::vector<unsigned char> &message, uint32_t haloRow, uint32_t edgeRow) {
+            simulation->readDepositRows(haloRow, halo, rows.data());
+            simulation->readDepositRows(edgeRow, halo, rows.data() + values);
+            message.clear();
+            append(message, rows.data(), rows.size());
+        };
+        auto unpack = [&](const std::vector<unsigned char> &message, uint32_t haloRow, uint32_t edgeRow) {
+            const uint32_t *received = reinterpret_cast<const uint32_t *>(message.data());
+            simulation->addDepositRows(edgeRow, halo, received);
+            simulation->addDepositRows(haloRow, halo, received + values);
+        };
+
+        if (hasAbove()) {
+            pack(toAbove, haloAboveRow(), edgeAboveRow());
+        }
+        if (hasBelow()) {
+            pack(toBelow, haloBelowRow(), edgeBelowRow());
+        }
+        if (!exchangeNeighbours()) {
+            return false;
+        }
+        if (hasAbove()) {
+            unpack(fromAbove, haloAboveRow(), edgeAboveRow());
+        }
+        if (hasBelow()) {
+            unpack(fromBelow, haloBelowRow(), edgeBelowRow());
+        }
+        return true;
+    }
+
+    // Each message is the mirrored band rows of the diffused trail map, then
+    // the agents that moved into the neighbour's band.
+    bool exchangeBorders() {
+        const size_t values = halo * simulation->rowLength();
+        leaving.clear();
+        simulation->takeAgentsOutside(top() - float(origin), bottom() - float(origin), leaving);
+        // Sides are told apart before the shift, which can round onto the border
+        auto pack = [&](std::vector<unsigned char> &message, uint32_t edgeRow, bool above) {
+            message.clear();
+            append(message, simulation->trailRow(edgeRow), values);
+            for (Agent agent : leaving) {
+                if ((agent.Position.y < float(edgeAboveRow())) == above) {
+                    agent.Position.y += float(origin);
+                    append(message, &agent, 1);
+                }
+            }
+        };
+        auto unpack = [&](const std::vector<unsigned char> &message, uint32_t haloRow) {
+            simulation->writeTrailRows(haloRow, halo, reinterpret_cast<const float *>(message.data()));
+            arriving.resize((message.size() - values * sizeof(float)) / sizeof(Agent));
+            std::memcpy(arriving.data(), message.data() + values * sizeof(float), arriving.size() * sizeof(Agent));
+            for (Agent &agent : arriving) {
+                agent.Position.y -= float(origin);
+            }
+            simulation->addAgents(arriving);
+        };
+
+        if (hasAbove()) {
+            pack(toAbove, edgeAboveRow(), true);
+        }
+        if (hasBelow()) {
+            pack(toBelow, edgeBelowRow(), false);
+        }
+        if (!exchangeNeighbours()) {
+            return false;
+        }
+        if (hasAbove()) {
+            unpack(fromAbove, haloAboveRow());
+        }
+        if (hasBelow()) {
+            unpack(fromBelow, haloBelowRow());
+        }
+        return true;
+    }
+
+    Transport &transport;
+    uint32_t width;
+    uint32_t height;
+    uint32_t halo;
+    uint32_t first, last;
+    uint32_t haloAbove, haloBelow;
+    // Global row of the first local row
+    uint32_t origin;
+    uint64_t sortEvery = 0;
+    double exchangeTime = 0.0;
+    std::unique_ptr<CpuSimulation> simulation;
+
+    std::vector<uint32_t> rows;
+    std::vector<Agent> leaving, arriving;
+    std::vector<unsigned char> toAbove, toBelow, fromAbove, fromBelow;
+    std::vector<unsigned char> outgoing, incoming;
+    std::vector<uint32_t> localDisplay;
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "image_io.h"
+#include "simulation.h"
+
+// What a sensor over an obstacle reads on top of the trail, low enough that
+// agents turn away before they walk into it.
+constexpr float OBSTACLE_READING = -1.0e6f;
+// An agent only looks at where it lands when it is within its velocity and
+// this many pixels of an obstacle: the pixels it moves between are at most
+// that far apart.
+constexpr float OBSTACLE_MARGIN = 1.5f;
+// Distance from a pixel when the map holds no obstacle at all
+constexpr float NO_OBSTACLE_DISTANCE = 1.0e9f;
+#define MAX_ATTRACTOR_LEVELS 16
+// Times a new agent's position is drawn again while it lands on an
+// obstacle, before it is moved to the nearest free pixel instead
+#define SEED_ATTEMPTS 16
+
+// The maps resampled to one grid, width * height values each with row 0 at
+// the bottom. sensed is added to every sensor's reading: the attractors
+// averaged over their mip levels, and OBSTACLE_READING over obstacles.
+// obstacleDistance is how far each pixel is from the nearest obstacle pixel,
+// 0 on one, and nearestFree the index of the nearest pixel that is not one,
+// which agents on an obstacle are moved to. Either is empty when the maps
+// have nothing for it.
+struct EnvironmentFields {
+    uint32_t width;
+    uint32_t height;
+    std::vector<float> sensed;
+    std::vector<float> obstacleDistance;
+    std::vector<uint32_t> nearestFree;
+
+    // Whether (x, y) lies on an obstacle; points off the grid never do.
+    bool onObstacle(float x, float y) const {
+        return !obstacleDistance.empty() && x >= 0 && x < width && y >= 0 && y < height &&
+               obstacleDistance[size_t(y) * width + size_t(x)] <= 0.0f;
+    }
+
+    // Moves (x, y) to the center of the nearest free pixel if it lies on an
+    // obstacle.
+    void leaveObstacle(float &x, float &y) const {
+        if (onObstacle(x, y)) {
+            const uint32_t free = nearestFree[size_t(y) * width + size_t(x)];
+            x = float(free % width) + 0.5f;
+            y = float(free / width) + 0.5f;
+        }
+    }
+};
+
+// Squared Euclidean distance transform of one line, after Felzenszwalb and
+// Huttenlocher: d[i] = min over j of f[j] + (i - j)^2, as the lower
+// envelope of the parabolas rooted at every j, and nearest[i] that j. The
+// scratch arrays hold n and n + 1 entries.
+inline void distanceTransformLine(const float *f, size_t n, float *d, int *nearest, int *vertices, float *bounds) {
+    const float infinity = std::numeric_limits<float>::infinity();
+    int k = 0;
+    vertices[0] = 0;
+    bounds[0] = -infinity;
+    bounds[1] = infinity;
+    for (int q = 1; q < int(n); ++q) {
+        float s;
+        while (true) {
+            const int v = vertices[k];
+            s = ((f[q] + float(q) * q) - (f[v] + float(v) * v)) / float(2 * (q - v));
+            if (s > bounds[k]) {
+                break;
+            }
+            --k;
+        }
+        ++k;
+        vertices[k] = q;
+        bounds[k] = s;
+        bounds[k + 1] = infinity;
+    }
+    k = 0;
+    for (int q = 0; q < int(n); ++q) {
+        while (bounds[k + 1] < float(q)) {
+            ++k;
+        }
+        const float offset = float(q - vertices[k]);
+        d[q] = offset * offset + f[vertices[k]];
+        nearest[q] = vertices[k];
+    }
+}
+
+// Squared distance from every pixel to the nearest one of sources, exact,
+// along columns and then rows, and the index of that pixel; unreached and
+// the pixel itself when there are no sources.
+inline void squaredDistanceField(const std::vector<uint8_t> &sources, uint32_t width, uint32_t height, float unreached,
+                                 std::vector<float> &out, std::vector<uint32_t> &nearest) {
+    out.resize(size_t(width) * height);
+    nearest.resize(size_t(width) * height);
+    const size_t longest = std::max(width, height);
+    std::vector<float> line(longest), distances(longest), bounds(longest + 1);
+    std::vector<int> lineNearest(longest), vertices(longest);
+    // nearest holds the row of the nearest source in its column after the
+    // first pass
+    for (uint32_t x = 0; x < width; ++x) {
+        for (uint32_t y = 0; y < height; ++y) {
+            line[y] = sources[size_t(y) * width + x] ? 0.0f : unreached;
+        }
+        distanceTransformLine(line.data(), height, distances.data(), lineNearest.data(), vertices.data(), bounds.data());
+        for (uint32_t y = 0; y < height; ++y) {
+            out[size_t(y) * width + x] = distances[y];
+            nearest[size_t(y) * width + x] = uint32_t(lineNearest[y]);
+        }
+    }
+    std::vector<uint32_t> rows(width);
+    for (uint32_t y = 0; y < height; ++y) {
+        float *row = &out[size_t(y) * width];
+        uint32_t *rowNearest = &nearest[size_t(y) * width];
+        std::copy(row, row + width, line.begin());
+        std::copy(rowNearest, rowNearest + width, rows.begin());
+        distanceTransformLine(line.data(), width, row, lineNearest.data(), vertices.data(), bounds.data());
+        for (uint32_t x = 0; x < width; ++x) {
+            const uint32_t column = uint32_t(lineNearest[x]);
+            if (row[x] >= unreached) {
+                row[x] = unreached;
+                rowNearest[x] = y * width + x;
+            } else {
+                rowNearest[x] = rows[column] * width + column;
+            }
+        }
+    }
+}
+
+// Distance in pixels from every pixel to the nearest one of blocked,
+// NO_OBSTACLE_DISTANCE when none is, and the nearest pixel of every one that
+// is not blocked.
+inline void obstacleDistanceField(const std::vector<uint8_t> &blocked, uint32_t width, uint32_t height,
+                                  std::vector<float> &out, std::vector<uint32_t> &nearestFree) {
+    // Far beyond any squared distance on a grid, and still far from overflowing
+    const float unreached = 1.0e20f;
+    std::vector<uint32_t> nearestBlocked;
+    squaredDistanceField(blocked, width, height, unreached, out, nearestBlocked);
+    for (float &distance : out) {
+        distance = distance >= unreached ? NO_OBSTACLE_DISTANCE : std::sqrt(distance);
+    }
+
+    std::vector<uint8_t> free(blocked.size());
+    for (size_t pixel = 0; pixel < blocked.size(); ++pixel) {
+        free[pixel] = !blocked[pixel];
+    }
+    std::vector<float> freeDistance;
+    squaredDistanceField(free, width, height, unreached, freeDistance, nearestFree);
+}
+
+// Bilinear sample of a mip level at grid pixel (x, y) of a grid scale
+// times its size, clamped at the edges.
+inline float sampleLevel(const std::vector<float> &level, uint32_t width, uint32_t height, float scale, uint32_t x, uint32_t y) {
+    const float u = std::min(std::max((x + 0.5f) / scale - 0.5f, 0.0f), float(width - 1));
+    const float v = std::min(std::max((y + 0.5f) / scale - 0.5f, 0.0f), float(height - 1));
+    const uint32_t x0 = uint32_t(u), y0 = uint32_t(v);
+    const uint32_t x1 = std::min(x0 + 1, width - 1), y1 = std::min(y0 + 1, height - 1);
+    const float fx = u - float(x0), fy = v - float(y0);
+    const float *row0 = &level[size_t(y0) * width];
+    const float *row1 = &level[size_t(y1) * width];
+    return (row0[x0] * (1.0f - fx) + row0[x1] * fx) * (1.0f - fy) + (row1[x0] * (1.0f - fx) + row1[x1] * fx) * fy;
+}
+
+// Obstacle and attractor maps, loaded once from images and resampled to
+// the grid of every simulation that uses them. Agents cannot move onto an
+// obstacle and their sensors shy away from one; attractors, such as food
+// sources, add to what the sensors read. A single attractor pixel would only
+// be sensed right on top of it, so the map is averaged over its mip levels:
+// level l reaches 2^l pixels, and the average pulls agents towards food
+// from as far as the coarsest level spans.
+class EnvironmentMaps {
+public:
+    // Pixels of at least half brightness are obstacles.
+    bool loadObstacles(const std::string &path) {
+        return readImagePNM(path, obstaclesWidth, obstaclesHeight, obstacles);
+    }
+
+    // Brightness times strength is added to the sensors, averaged over
+    // levels mip levels above the grid's own.
+    bool loadAttractors(const std::string &path, float strength, uint32_t levels) {
+        attractorStrength = strength;
+        attractorLevels = std::min(levels, uint32_t(MAX_ATTRACTOR_LEVELS));
+        return readImagePNM(path, attractorsWidth, attractorsHeight, attractors);
+    }
+
+    bool hasObstacles() const { return !obstacles.empty(); }
+    bool hasAttractors() const { return !attractors.empty(); }
+
+    // The maps at width * height. The last grid asked for is kept, so
+    // simulations of the same size share one copy.
+    std::shared_ptr<const EnvironmentFields> fields(uint32_t width, uint32_t height) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!cached || cached->width != width || cached->height != height) {
+            cached = build(width, height);
+        }
+        return cached;
+    }
+
+private:
+    std::shared_ptr<const EnvironmentFields> build(uint32_t width, uint32_t height) const {
+        std::shared_ptr<EnvironmentFields> out = std::make_shared<EnvironmentFields>();
+        out->width = width;
+        out->height = height;
+        if (!hasObstacles() && !hasAttractors()) {
+            return out;
+        }
+
+        const size_t pixels = size_t(width) * height;
+        out->sensed.assign(pixels, 0.0f);
+        if (hasAttractors()) {
+            // Level 0 is the grid, every level above averages 2x2 of the one below
+            std::vector<std::vector<float>> levels(1);
+            std::vector<uint32_t> widths(1, width), heights(1, height);
+            resampleTrailMap(attractors, attractorsWidth, attractorsHeight, levels[0], width, height, 1);
+            while (levels.size() <= attractorLevels && (widths.back() > 1 || heights.back() > 1)) {
+                const std::vector<float> &below = levels.back();
+                const uint32_t belowWidth = widths.back(), belowHeight = heights.back();
+                const uint32_t levelWidth = (belowWidth + 1) / 2, levelHeight = (belowHeight + 1) / 2;
+                std::vector<float> level(size_t(levelWidth) * levelHeight);
+                for (uint32_t y = 0; y < levelHeight; ++y) {
+                    const uint32_t y0 = 2 * y, y1 = std::min(2 * y + 1, belowHeight - 1);
+                    for (uint32_t x = 0; x < levelWidth; ++x) {
+                        const uint32_t x0 = 2 * x, x1 = std::min(2 * x + 1, belowWidth - 1);
+                        level[size_t(y) * levelWidth + x] = 0.25f *
+                            (below[size_t(y0) * belowWidth + x0] + below[size_t(y0) * belowWidth + x1] +
+                             below[size_t(y1) * belowWidth + x0] + below[size_t(y1) * belowWidth + x1]);
+                    }
+                }
+                levels.push_back(std::move(level));
+                widths.push_back(levelWidth);
+                heights.push_back(levelHeight);
+            }
+
+            const float weight = attractorStrength / float(levels.size());
+            for (uint32_t y = 0; y < height; ++y) {
+                for (uint32_t x = 0; x < width; ++x) {
+                    float sum = 0.0f;
+                    for (size_t l = 0; l < levels.size(); ++l) {
+                        sum += sampleLevel(levels[l], widths[l], heights[l], float(1u << l), x, y);
+                    }
+                    out->sensed[size_t(y) * width + x] = sum * weight;
+                }
+            }
+        }
+
+        if (hasObstacles()) {
+            std::vector<float> resampled;
+            resampleTrailMap(obstacles, obstaclesWidth, obstaclesHeight, resampled, width, height, 1);
+            std::vector<uint8_t> blocked(pixels);
+            for (size_t pixel = 0; pixel < pixels; ++pixel) {
+                blocked[pixel] = resampled[pixel] >= 0.5f;
+                if (blocked[pixel]) {
+                    out->sensed[pixel] = OBSTACLE_READING;
+                }
+            }
+            obstacleDistanceField(blocked, width, height, out->obstacleDistance, out->nearestFree);
+        }
+        return out;
+    }
+
+    std::vector<float> obstacles, attractors;
+    uint32_t obstaclesWidth = 0, obstaclesHeight = 0;
+    uint32_t attractorsWidth = 0, attractorsHeight = 0;
+    float attractorStrength = 1.0f;
+    uint32_t attractorLevels = 0;
+
+    mutable std::mutex mutex;
+    mutable std::shared_ptr<const EnvironmentFields> cached;
+};
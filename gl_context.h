@@ -0,0 +1,87 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+// Initializes GLFW, creates a window with a current OpenGL context (hidden
+// when headless) and loads GLEW. Returns nullptr and prints the reason on
+// failure; GLFW is terminated again in that case.
+inline GLFWwindow *createContextWindow(int width, int height, const char *title, bool headless) {
+#if defined(GLFW_PLATFORM_NULL) && !defined(_WIN32)
+    // Without a display server use GLFW's null platform with an OSMesa context
+    bool surfaceless = headless && !getenv("DISPLAY") && !getenv("WAYLAND_DISPLAY");
+    if (surfaceless) {
+        glfwInitHint(GLFW_PLATFORM, GLFW_PLATFORM_NULL);
+    }
+#endif
+
+    // Initialize GLFW
+    if (!glfwInit()) {
+        std::cerr << "Failed to initialize GLFW" << std::endl;
+        return nullptr;
+    }
+
+    // Create a windowed mode window and its OpenGL context, hidden when headless
+    if (headless) {
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    }
+#if defined(GLFW_PLATFORM_NULL) && !defined(_WIN32)
+    if (surfaceless) {
+        glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_OSMESA_CONTEXT_API);
+    }
+#endif
+    GLFWwindow* window = glfwCreateWindow(width, height, title, nullptr, nullptr);
+    if (!window) {
+        std::cerr << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return nullptr;
+    }
+
+    // Make the window's context current
+    glfwMakeContextCurrent(window);
+    glfwSwapInterval(0);
+
+    // Initialize GLEW
+    glewExperimental = GL_TRUE;
+    if (glewInit() != GLEW_OK) {
+        std::cerr << "Failed to initialize GLEW" << std::endl;
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return nullptr;
+    }
+    printf("OpenGL Version: %s\n", glGetString(GL_VERSION));
+    return window;
+}
+
+// An RGBA8 texture for the colorized frame, attached to a framebuffer so it
+// can be blitted to the window.
+inline void createDisplayTexture(uint32_t width, uint32_t height, GLuint &texture, GLuint &framebuffer) {
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+inline void deleteDisplayTexture(GLuint &texture, GLuint &framebuffer) {
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &texture);
+}
+
+// Copies the display texture to the window, scaled to the framebuffer size.
+// Row 0 ends up at the bottom, as it did with glDrawPixels.
+inline void blitToWindow(GLuint framebuffer, uint32_t width, uint32_t height, int targetWidth, int targetHeight) {
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, targetWidth, targetHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
@@ -0,0 +1,2019 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "environment.h"
+#include "gl_context.h"
+#include "simulation.h"
+
+// Compute shader sources
+// Sizes and simulation parameters shared by every program: a std140 block
+// mirrored by SimulationBlock below and uploaded only when it changes.
+// Programs are compiled as { "#version 430", simulationBlockSource, kernel }.
+const char* simulationBlockSource = R"(
+#define MAX_SPECIES 4
+
+layout (std140, binding = 0) uniform SimulationBlock {
+    // Per species: velocity, turn speed, sensor length, sensor angle
+    vec4 speciesMotion[MAX_SPECIES];
+    // Row s weighs the trail channels species s senses
+    vec4 speciesWeights[MAX_SPECIES];
+    // Per species: deposit in DEPOSIT_SCALE fixed point
+    uvec4 speciesDeposit;
+    // Per species: cosine and sine of the sensor angle
+    vec4 speciesSensorCos;
+    vec4 speciesSensorSin;
+    uvec2 dimensions;
+    // Active agents, and the agents the buffers hold
+    uint agentCount;
+    uint agentPool;
+    uint binCount;
+    uint speciesCount;
+    int agentSensorSize;
+    float decayRate;
+    float diffusionRate;
+    int diffusionSize;
+    // Values between trail map rows, see trailStorageSource
+    uint trailStride;
+    // Top of the values the unorm trail formats store
+    float trailRange;
+};
+)";
+
+// Active tiles, see ACTIVE_TILE_SIZE. tileState holds one block of values
+// per field, one value per tile. tileLists starts with an indirect dispatch
+// command per list, whose x and y spill the list over 65535 groups and
+// whose count is the list length; the lists follow, tileCount() entries
+// each. Compiled after simulationBlockSource.
+const char* activeTilesSource = R"(
+#define ACTIVE_TILE_SIZE 64
+#define ACTIVE_TILE_EPSILON (1.0 / 1024.0)
+#define TILE_MAX 0u
+#define TILE_DEPOSITED 1u
+#define TILE_LIVE 2u
+#define TILE_PROCESSED 3u
+#define TILE_CHANGED 4u
+#define LIST_ROWS 0u
+#define LIST_COLUMNS 1u
+#define LIST_COLORIZE 2u
+// Column list entries of tiles to clear rather than diffuse
+#define TILE_RETIRE 0x80000000u
+#define NO_TILE 0xFFFFFFFFu
+
+layout (std430, binding = 8) buffer TileStateBuffer {
+    uint tileState[];
+};
+
+struct TileCommand {
+    uint x;
+    uint y;
+    uint z;
+    uint count;
+};
+
+layout (std430, binding = 9) buffer TileListBuffer {
+    TileCommand tileCommands[3];
+    uint tileLists[];
+};
+
+uvec2 tileGrid() {
+    return (dimensions + uvec2(ACTIVE_TILE_SIZE - 1)) / uvec2(ACTIVE_TILE_SIZE);
+}
+
+uint tileCount() {
+    uvec2 grid = tileGrid();
+    return grid.x * grid.y;
+}
+
+uint tileField(uint field, uint tile) {
+    return field * tileCount() + tile;
+}
+
+void appendTile(uint list, uint entry) {
+    uint i = atomicAdd(tileCommands[list].count, 1u);
+    tileLists[list * tileCount() + i] = entry;
+    atomicMax(tileCommands[list].x, min(i + 1u, 65535u));
+    atomicMax(tileCommands[list].y, i / 65535u + 1u);
+}
+
+// The entry of list this work group handles, or NO_TILE.
+uint listedTile(uint list) {
+    uint i = gl_WorkGroupID.y * 65535u + gl_WorkGroupID.x;
+    return i < tileCommands[list].count ? tileLists[list * tileCount() + i] : NO_TILE;
+}
+)";
+
+// Trail map storage, in the TrailFormat picked by trailFormatDefine().
+// Rows are trailStride values apart, padded to whole quads of four pixels,
+// so a quad of four values from a multiple of 4 is whole words in every
+// format: four floats, two words of two halves or unorm16, or one word of
+// four unorm8. Kernels read values with loadTrail() and write whole quads;
+// dither is the rounding offset of each value, 0.5 to round to nearest.
+// Compiled after trailFormatDefine(), simulationBlockSource and randomSource.
+const char* trailStorageSource = R"(
+#if defined(TRAIL_FP32)
+#define TRAIL_WORD float
+#define TRAIL_QUAD vec4
+#define TRAIL_QUAD_WORDS 4u
+#elif defined(TRAIL_UNORM8)
+#define TRAIL_WORD uint
+#define TRAIL_QUAD uint
+#define TRAIL_QUAD_WORDS 1u
+#else
+#define TRAIL_WORD uint
+#define TRAIL_QUAD uvec2
+#define TRAIL_QUAD_WORDS 2u
+#endif
+#define TRAIL_VALUES_PER_WORD (4u / TRAIL_QUAD_WORDS)
+
+layout (std430, binding = 1) buffer TrailMapBuffer {
+    TRAIL_WORD trailMap[];
+};
+
+layout (std430, binding = 2) buffer TrailMapNextBuffer {
+    TRAIL_WORD trailMapNext[];
+};
+
+TRAIL_QUAD encodeTrailQuad(vec4 values, vec4 dither) {
+#if defined(TRAIL_FP32)
+    return values;
+#elif defined(TRAIL_FP16)
+    values = min(values, vec4(65504.0));
+    return uvec2(packHalf2x16(values.xy), packHalf2x16(values.zw));
+#elif defined(TRAIL_UNORM16)
+    uvec4 steps = uvec4(min(floor(clamp(values / trailRange, 0.0, 1.0) * 65535.0 + dither), vec4(65535.0)));
+    return uvec2(steps.x | (steps.y << 16), steps.z | (steps.w << 16));
+#else
+    uvec4 steps = uvec4(min(floor(clamp(values / trailRange, 0.0, 1.0) * 255.0 + dither), vec4(255.0)));
+    return steps.x | (steps.y << 8) | (steps.z << 16) | (steps.w << 24);
+#endif
+}
+
+vec4 decodeTrailQuad(TRAIL_QUAD quad) {
+#if defined(TRAIL_FP32)
+    return quad;
+#elif defined(TRAIL_FP16)
+    return vec4(unpackHalf2x16(quad.x), unpackHalf2x16(quad.y));
+#elif defined(TRAIL_UNORM16)
+    return vec4(unpackUnorm2x16(quad.x), unpackUnorm2x16(quad.y)) * trailRange;
+#else
+    return unpackUnorm4x8(quad) * trailRange;
+#endif
+}
+
+float loadTrail(uint idx) {
+#if defined(TRAIL_FP32)
+    return trailMap[idx];
+#elif defined(TRAIL_FP16)
+    return unpackHalf2x16(trailMap[idx >> 1u])[idx & 1u];
+#elif defined(TRAIL_UNORM16)
+    return unpackUnorm2x16(trailMap[idx >> 1u])[idx & 1u] * trailRange;
+#else
+    return unpackUnorm4x8(trailMap[idx >> 2u])[idx & 3u] * trailRange;
+#endif
+}
+
+vec4 loadTrailQuad(uint idx) {
+    uint word = idx / TRAIL_VALUES_PER_WORD;
+#if defined(TRAIL_FP32)
+    return vec4(trailMap[word], trailMap[word + 1u], trailMap[word + 2u], trailMap[word + 3u]);
+#elif defined(TRAIL_UNORM8)
+    return decodeTrailQuad(trailMap[word]);
+#else
+    return decodeTrailQuad(uvec2(trailMap[word], trailMap[word + 1u]));
+#endif
+}
+
+// Writes a quad into map, trailMap or trailMapNext.
+#if defined(TRAIL_FP32)
+#define STORE_TRAIL_QUAD(map, idx, quad) \
+    map[(idx)] = (quad).x; map[(idx) + 1u] = (quad).y; map[(idx) + 2u] = (quad).z; map[(idx) + 3u] = (quad).w
+#elif defined(TRAIL_UNORM8)
+#define STORE_TRAIL_QUAD(map, idx, quad) map[(idx) >> 2u] = (quad)
+#else
+#define STORE_TRAIL_QUAD(map, idx, quad) map[(idx) >> 1u] = (quad).x; map[((idx) >> 1u) + 1u] = (quad).y
+#endif
+
+// Stochastic rounding for the unorm formats, from a hash of the value's
+// index and a per-step key
+vec4 trailDither(uint idx, uint key) {
+#if defined(TRAIL_UNORM16) || defined(TRAIL_UNORM8)
+    return vec4(unitFloat(pcgHash(idx ^ key)), unitFloat(pcgHash((idx + 1u) ^ key)),
+                unitFloat(pcgHash((idx + 2u) ^ key)), unitFloat(pcgHash((idx + 3u) ^ key)));
+#else
+    return vec4(0.5);
+#endif
+}
+)";
+
+// Agent storage shared by every kernel that touches agents. Agent programs
+// are compiled as { "#version 430", agentLayoutDefine(layout),
+// simulationBlockSource, agentLayoutSource, kernel } so the layout is
+// resolved at compile time. AOS and SOA store three
+// floats per agent, interleaved or in three blocks of agentPool; COMPACT
+// packs 16-bit x and y into one word per agent followed by 16-bit headings,
+// two per word, matching CompactAgents on the CPU. Only the first agentCount
+// agents of the pool are active.
+const char* agentLayoutSource = R"(
+struct FPoint2D {
+    float x;
+    float y;
+};
+
+struct Agent {
+    FPoint2D Position;
+    float Rotation;
+};
+
+// Agent kernels run 1024 invocations per group and are dispatched in two
+// dimensions once there are more than 65535 groups.
+uint agentInvocation() {
+    return (gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x) * 1024u + gl_LocalInvocationID.x;
+}
+
+// Species own contiguous index ranges, as agentSpecies() on the CPU.
+uint agentSpecies(uint idx) {
+    uint rangeSize = (agentCount + speciesCount - 1u) / speciesCount;
+    return min(idx / rangeSize, speciesCount - 1u);
+}
+
+#if defined(AGENT_LAYOUT_COMPACT)
+#define AGENTS_PER_INVOCATION 2u
+#define AgentWord uint
+#else
+#define AGENTS_PER_INVOCATION 1u
+#define AgentWord float
+#endif
+
+layout (std430, binding = 0) buffer AgentsBuffer {
+    AgentWord agentData[];
+};
+
+#if defined(AGENT_LAYOUT_COMPACT)
+uint encodePosition(FPoint2D position) {
+    vec2 q = clamp(vec2(position.x, position.y) * 65536.0 / vec2(dimensions) + 0.5, 0.0, 65535.0);
+    return uint(q.x) | (uint(q.y) << 16);
+}
+
+uint encodeRotation(float rotation) {
+    return uint(fract(rotation * 0.15915494309) * 65536.0 + 0.5) & 0xFFFFu;
+}
+
+FPoint2D decodePosition(uint word) {
+    vec2 scale = vec2(dimensions) / 65536.0;
+    return FPoint2D(float(word & 0xFFFFu) * scale.x, float(word >> 16) * scale.y);
+}
+
+FPoint2D loadPosition(uint idx) {
+    return decodePosition(agentData[idx]);
+}
+
+// Where an agent stored at position ends up once quantized.
+FPoint2D storedPosition(FPoint2D position) {
+    return decodePosition(encodePosition(position));
+}
+
+Agent loadAgent(uint idx) {
+    uint heading = (agentData[agentPool + idx / 2u] >> ((idx & 1u) * 16u)) & 0xFFFFu;
+    return Agent(loadPosition(idx), float(heading) * 9.5873799242e-5);
+}
+
+// Both headings of a word are written together, so no atomics are needed.
+void storeAgents(uint first, Agent agents[AGENTS_PER_INVOCATION]) {
+    agentData[first] = encodePosition(agents[0].Position);
+    uint heading = encodeRotation(agents[0].Rotation);
+    if (first + 1u < agentCount) {
+        agentData[first + 1u] = encodePosition(agents[1].Position);
+        heading |= encodeRotation(agents[1].Rotation) << 16;
+    }
+    agentData[agentPool + first / 2u] = heading;
+}
+#else
+uint agentWordIndex(uint idx, uint component) {
+#if defined(AGENT_LAYOUT_SOA)
+    return component * agentPool + idx;
+#else
+    return idx * 3u + component;
+#endif
+}
+
+FPoint2D loadPosition(uint idx) {
+    return FPoint2D(agentData[agentWordIndex(idx, 0u)], agentData[agentWordIndex(idx, 1u)]);
+}
+
+FPoint2D storedPosition(FPoint2D position) {
+    return position;
+}
+
+Agent loadAgent(uint idx) {
+    return Agent(loadPosition(idx), agentData[agentWordIndex(idx, 2u)]);
+}
+
+void storeAgents(uint first, Agent agents[AGENTS_PER_INVOCATION]) {
+    agentData[agentWordIndex(first, 0u)] = agents[0].Position.x;
+    agentData[agentWordIndex(first, 1u)] = agents[0].Position.y;
+    agentData[agentWordIndex(first, 2u)] = agents[0].Rotation;
+}
+#endif
+)";
+
+// Counter-based random numbers, pcgHash(), stepRandomKey() and unitFloat()
+// on the CPU. Compiled before the kernels and the trail storage that draw
+// them.
+const char* randomSource = R"(
+uint pcgHash(uint value) {
+    uint state = value * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float unitFloat(uint hash) {
+    return float(hash >> 8u) * (1.0 / 16777216.0);
+}
+)";
+
+// The obstacle fields of the agent kernels, compiled after
+// agentLayoutSource. Mirrors EnvironmentFields; without OBSTACLES agents
+// are never on one.
+const char* obstaclesSource = R"(
+#ifdef OBSTACLES
+layout (binding = 2) uniform sampler2D obstacleDistance;
+layout (binding = 3) uniform usampler2D nearestFree;
+
+bool onGrid(FPoint2D position) {
+    return position.x >= 0 && position.x < dimensions.x && position.y >= 0 && position.y < dimensions.y;
+}
+
+bool onObstacle(FPoint2D position) {
+    return onGrid(position) && texelFetch(obstacleDistance, ivec2(position.x, position.y), 0).r <= 0.0;
+}
+
+FPoint2D leaveObstacle(FPoint2D position) {
+    if (!onObstacle(position)) {
+        return position;
+    }
+    uint free = texelFetch(nearestFree, ivec2(position.x, position.y), 0).r;
+    return FPoint2D(float(free % dimensions.x) + 0.5, float(free / dimensions.x) + 0.5);
+}
+#else
+#define SEED_ATTEMPTS 1
+
+bool onObstacle(FPoint2D position) {
+    return false;
+}
+
+FPoint2D leaveObstacle(FPoint2D position) {
+    return position;
+}
+#endif
+)";
+
+const char* initAgentsSource = R"(
+layout (local_size_x = 1024) in;
+
+uniform uint seed;
+// Agents below firstAgent survive a resize and only have their position scaled
+uniform uint firstAgent;
+uniform vec2 positionScale;
+
+float random(inout uint state) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return float(state) / 4294967295.0;
+}
+
+void main() {
+    uint first = agentInvocation() * AGENTS_PER_INVOCATION;
+    if (first >= agentCount) return;
+
+    Agent agents[AGENTS_PER_INVOCATION];
+    for (uint k = 0u; k < AGENTS_PER_INVOCATION; ++k) {
+        if (first + k < firstAgent) {
+            agents[k] = loadAgent(first + k);
+            agents[k].Position.x *= positionScale.x;
+            agents[k].Position.y *= positionScale.y;
+            continue;
+        }
+
+        // A position on an obstacle is drawn again, see SEED_ATTEMPTS
+        uint state = seed + first + k;
+        for (int attempt = 0; attempt < SEED_ATTEMPTS; ++attempt) {
+            float RandomRadius = random(state) * 300;
+            float RandomAngle = (random(state) - 0.5) * 2.0 * 3.14159265359;
+
+            agents[k].Position.x = dimensions.x / 2.0 + RandomRadius * cos(RandomAngle);
+            agents[k].Position.y = dimensions.y / 2.0 + RandomRadius * -sin(RandomAngle);
+
+            // agents[k].Rotation = RandomAngle;
+            agents[k].Rotation = RandomAngle + 3.14159265359;
+            if (!onObstacle(agents[k].Position)) {
+                break;
+            }
+        }
+        agents[k].Position = leaveObstacle(agents[k].Position);
+    }
+    storeAgents(first, agents);
+}
+)";
+
+// Senses, steers, moves and deposits in one pass over the agents. Deposits
+// go to a separate fixed-point buffer with integer atomics, so the sum is
+// the same in any order and no agent senses trail laid down in this step;
+// the blur passes fold it into the trail map. Sensors read the sensor sums,
+// or for size 0 the trail map itself. With an environment, see
+// environmentDefines(), sensors add the SENSED_FIELD texture and agents near
+// an obstacle check every pixel along their move.
+const char* updateAgentsSource = R"(
+#define DEPOSIT_SCALE 4096.0
+
+layout (local_size_x = 1024) in;
+
+#ifdef SENSED_FIELD
+layout (binding = 1) uniform sampler2D sensedField;
+#endif
+
+layout (std430, binding = 7) readonly buffer SensorSumsBuffer {
+    float sensorSums[];
+};
+
+layout (std430, binding = 3) buffer DepositsBuffer {
+    uint deposits[];
+};
+
+// stepRandomKey() of the step
+uniform uint randomKey;
+
+// The sensor sums of a pixel as seen by one species; size 0 reads the
+// trail map itself.
+float weightedTrail(uvec2 pixel, uint species) {
+    uint sums = (pixel.y * dimensions.x + pixel.x) * speciesCount;
+    uint trail = pixel.y * trailStride + pixel.x * speciesCount;
+    float value = 0.0;
+    for (uint channel = 0u; channel < speciesCount; ++channel) {
+        float sensed = agentSensorSize > 0 ? sensorSums[sums + channel] : loadTrail(trail + channel);
+        value += sensed * speciesWeights[species][channel];
+    }
+    return value;
+}
+
+// The sensor sitting sensorLength along direction, which is the cosine and
+// sine of its angle. Every pixel of its square must be on the map.
+float sense(FPoint2D position, vec2 direction, float sensorLength, uint species) {
+    FPoint2D sensorPosition = FPoint2D(
+        position.x + sensorLength * direction.x,
+        position.y + sensorLength * -direction.y
+    );
+
+    float size = float(agentSensorSize);
+    if (sensorPosition.x < size || sensorPosition.x + size >= float(dimensions.x) ||
+        sensorPosition.y < size || sensorPosition.y + size >= float(dimensions.y)) {
+        return 0.0;
+    }
+    uvec2 pixel = uvec2(sensorPosition.x, sensorPosition.y);
+    float value = weightedTrail(pixel, species);
+#ifdef SENSED_FIELD
+    value += texelFetch(sensedField, ivec2(pixel), 0).r;
+#endif
+    return value;
+}
+
+// All species in one pass; each agent picks up the parameters of its own.
+// The three sensors share one sincos of the heading: the side ones turn it
+// by the sensor angle with the angle addition formulas.
+Agent updateAgent(uint idx, Agent agent) {
+    FPoint2D position = agent.Position;
+    float rotation = agent.Rotation;
+    uint species = agentSpecies(idx);
+    float agentVelocity = speciesMotion[species].x;
+    float agentTurnSpeed = speciesMotion[species].y;
+    float agentSensorLength = speciesMotion[species].z;
+
+    vec2 heading = vec2(cos(rotation), sin(rotation));
+    vec2 turn = vec2(speciesSensorCos[species], speciesSensorSin[species]);
+    vec2 left = vec2(heading.x * turn.x - heading.y * turn.y, heading.y * turn.x + heading.x * turn.y);
+    vec2 right = vec2(heading.x * turn.x + heading.y * turn.y, heading.y * turn.x - heading.x * turn.y);
+
+    float forwardSensor = sense(position, heading, agentSensorLength, species);
+    float leftSensor = sense(position, left, agentSensorLength, species);
+    float rightSensor = sense(position, right, agentSensorLength, species);
+    
+    if (forwardSensor > leftSensor && forwardSensor > rightSensor) {
+        // keep going forward
+    } else if (leftSensor > rightSensor) {
+        rotation += agentTurnSpeed;
+    } else if (rightSensor > leftSensor) {
+        rotation -= agentTurnSpeed;
+    } else {
+        rotation += (unitFloat(pcgHash(idx ^ randomKey)) - 0.5) * 2.0 * agentTurnSpeed;
+    }
+    
+    FPoint2D moved = FPoint2D(
+        position.x + agentVelocity * cos(rotation),
+        position.y + agentVelocity * -sin(rotation)
+    );
+    
+    // Handle boundary conditions
+    if (moved.x < 0) moved.x = 0;
+    if (moved.x >= dimensions.x) moved.x = dimensions.x - 1;
+    if (moved.y < 0) moved.y = 0;
+    if (moved.y >= dimensions.y) moved.y = dimensions.y - 1;
+
+#ifdef OBSTACLES
+    // Obstacles are checked where the agent is stored
+    moved = storedPosition(moved);
+
+    // Mirrors updateAgentBlock(): only agents within reach of an obstacle
+    // check their path, and one on an obstacle or off the grid lands on the
+    // nearest free pixel
+    float clearance = onGrid(position) ? texelFetch(obstacleDistance, ivec2(position.x, position.y), 0).r : 0.0;
+    if (clearance > 0.0 && clearance <= abs(agentVelocity) + OBSTACLE_MARGIN) {
+        // Points at most a pixel apart along the fastest species' move
+        float fastest = 1.0;
+        for (uint s = 0u; s < speciesCount; ++s) {
+            fastest = max(fastest, abs(speciesMotion[s].x));
+        }
+        int pathSteps = int(ceil(fastest));
+        vec2 step = vec2(moved.x - position.x, moved.y - position.y) * (1.0 / float(pathSteps));
+        for (int point = 1; point <= pathSteps; ++point) {
+            vec2 along = min(vec2(position.x, position.y) + step * float(point), vec2(dimensions) - 1.0);
+            if (texelFetch(obstacleDistance, ivec2(along), 0).r <= 0.0) {
+                moved = position;
+                rotation = unitFloat(pcgHash(idx ^ randomKey)) * 6.28318531;
+                break;
+            }
+        }
+    } else if (clearance <= 0.0) {
+        moved = leaveObstacle(moved);
+    }
+#endif
+    
+    return Agent(moved, rotation);
+}
+
+void main() {
+    uint first = agentInvocation() * AGENTS_PER_INVOCATION;
+    if (first >= agentCount) return;
+
+    // A trailing odd agent is updated twice but only stored once
+    Agent agents[AGENTS_PER_INVOCATION];
+    for (uint k = 0u; k < AGENTS_PER_INVOCATION; ++k) {
+        uint idx = min(first + k, agentCount - 1u);
+        agents[k] = updateAgent(idx, loadAgent(idx));
+    }
+    storeAgents(first, agents);
+
+    for (uint k = 0u; k < AGENTS_PER_INVOCATION && first + k < agentCount; ++k) {
+        FPoint2D position = storedPosition(agents[k].Position);
+        if (position.x >= 0 && position.x < dimensions.x &&
+            position.y >= 0 && position.y < dimensions.y) {
+            uint species = agentSpecies(first + k);
+            uint trailIndex = uint(position.y) * dimensions.x + uint(position.x);
+            atomicAdd(deposits[trailIndex * speciesCount + species], speciesDeposit[species]);
+            uvec2 tile = uvec2(position.x, position.y) / uvec2(ACTIVE_TILE_SIZE);
+            tileState[tileField(TILE_DEPOSITED, tile.y * tileGrid().x + tile.x)] = 1u;
+        }
+    }
+}
+)";
+
+// Tiles are classified before each diffusion: a tile is live when it was
+// deposited into or its largest value is still at least the epsilon. The
+// largest value is collected again by the column pass.
+const char* classifyTilesSource = R"(
+layout (local_size_x = 64) in;
+
+void main() {
+    uint tile = gl_GlobalInvocationID.x;
+    if (tile >= tileCount()) return;
+
+    bool live = tileState[tileField(TILE_DEPOSITED, tile)] != 0u ||
+                uintBitsToFloat(tileState[tileField(TILE_MAX, tile)]) >= ACTIVE_TILE_EPSILON;
+    tileState[tileField(TILE_LIVE, tile)] = live ? 1u : 0u;
+    tileState[tileField(TILE_DEPOSITED, tile)] = 0u;
+    tileState[tileField(TILE_MAX, tile)] = 0u;
+}
+)";
+
+// Lists the tiles of the step. The column pass covers the live tiles and
+// the ring around them, which the blur spreads into, plus the tiles leaving
+// that set, to clear them. The row pass covers one more ring, so every row
+// the column pass sums is fresh.
+const char* listTilesSource = R"(
+layout (local_size_x = 64) in;
+
+// Stamped on the tiles the step changes
+uniform uint stepStamp;
+
+void main() {
+    uint tile = gl_GlobalInvocationID.x;
+    if (tile >= tileCount()) return;
+
+    ivec2 grid = ivec2(tileGrid());
+    ivec2 at = ivec2(tile % uint(grid.x), tile / uint(grid.x));
+    // Distance in tiles to the nearest live one, up to 2
+    int nearest = 3;
+    for (int dy = -2; dy <= 2; ++dy) {
+        for (int dx = -2; dx <= 2; ++dx) {
+            ivec2 other = at + ivec2(dx, dy);
+            if (all(greaterThanEqual(other, ivec2(0))) && all(lessThan(other, grid)) &&
+                tileState[tileField(TILE_LIVE, uint(other.y * grid.x + other.x))] != 0u) {
+                nearest = min(nearest, max(abs(dx), abs(dy)));
+            }
+        }
+    }
+
+    bool processed = nearest <= 1;
+    bool wasProcessed = tileState[tileField(TILE_PROCESSED, tile)] != 0u;
+    if (nearest <= 2) {
+        appendTile(LIST_ROWS, tile);
+    }
+    if (processed || wasProcessed) {
+        appendTile(LIST_COLUMNS, processed ? tile : tile | TILE_RETIRE);
+        tileState[tileField(TILE_CHANGED, tile)] = stepStamp;
+    }
+    tileState[tileField(TILE_PROCESSED, tile)] = processed ? 1u : 0u;
+}
+)";
+
+// Horizontal half of the separable box blur: each work group stages one row
+// of a listed tile plus its halo in shared memory, so every pixel costs 2r+1
+// shared loads instead of (2r+1)^2 global ones. Rows hold speciesCount
+// interleaved channels, so neighbours of a value are speciesCount apart.
+// Work group z is the row within the tile.
+const char* blurTrailMapSource = R"(
+#define DEPOSIT_SCALE 4096.0
+#define MAX_DIFFUSION_SIZE 64
+
+layout (local_size_x = ACTIVE_TILE_SIZE) in;
+
+layout (std430, binding = 3) buffer DepositsBuffer {
+    uint deposits[];
+};
+
+layout (std430, binding = 4) buffer TrailMapBlurBuffer {
+    float trailMapBlur[];
+};
+
+shared float tile[(ACTIVE_TILE_SIZE + 2 * MAX_DIFFUSION_SIZE) * MAX_SPECIES];
+
+void main() {
+    uint entry = listedTile(LIST_ROWS);
+    if (entry == NO_TILE) return;
+    uvec2 grid = tileGrid();
+    uint y = entry / grid.x * ACTIVE_TILE_SIZE + gl_WorkGroupID.z;
+    if (y >= dimensions.y) return;
+
+    int channels = int(speciesCount);
+    int rowLength = int(dimensions.x) * channels;
+    int halo = diffusionSize * channels;
+    uint rowStart = y * trailStride;
+    uint depositRowStart = y * uint(rowLength);
+    int tileStart = int(entry % grid.x * ACTIVE_TILE_SIZE) * channels - halo;
+    int span = ACTIVE_TILE_SIZE * channels + 2 * halo;
+
+    for (int i = int(gl_LocalInvocationID.x); i < span; i += ACTIVE_TILE_SIZE) {
+        int x = tileStart + i;
+        tile[i] = (x >= 0 && x < rowLength) ?
+            loadTrail(rowStart + uint(x)) + float(deposits[depositRowStart + uint(x)]) / DEPOSIT_SCALE : 0.0;
+    }
+    barrier();
+
+    for (int channel = 0; channel < channels; ++channel) {
+        int local = int(gl_LocalInvocationID.x) * channels + channel;
+        int x = tileStart + halo + local;
+        if (x >= rowLength) return;
+
+        float sum = 0.0;
+        for (int i = 0; i <= 2 * diffusionSize; ++i) {
+            sum += tile[local + i * channels];
+        }
+        trailMapBlur[rowStart + uint(x)] = sum;
+    }
+}
+)";
+
+// Vertical half: each invocation walks a column of whole quads and whole
+// pixels down part of a listed tile, 4 / gcd(speciesCount, 4) pixels wide,
+// with a running sum per value. It mixes, decays and writes into the other
+// trail map of the ping-pong pair, and inside a step asked to colorize also
+// writes the display colors of what it stored. The deposits of the step are
+// added here as in the row pass, then cleared. Retiring tiles are zeroed in
+// both maps instead, so skipped tiles stay zero whichever map is current.
+const char* processTrailMapSource = R"(
+#define DEPOSIT_SCALE 4096.0
+
+layout (local_size_x = ACTIVE_TILE_SIZE) in;
+
+layout (std430, binding = 3) buffer DepositsBuffer {
+    uint deposits[];
+};
+
+// The row pass output, read a quad at a time
+layout (std430, binding = 4) buffer TrailMapBlurBuffer {
+    vec4 trailMapBlur[];
+};
+
+uniform uint ditherKey;
+uniform bool colorize;
+
+vec4 blurAt(uint x, int y) {
+    return (y >= 0 && y < int(dimensions.y)) ? trailMapBlur[(uint(y) * trailStride + x) / 4u] : vec4(0.0);
+}
+
+void main() {
+    uint entry = listedTile(LIST_COLUMNS);
+    if (entry == NO_TILE) return;
+    uint tile = entry & ~TILE_RETIRE;
+    uvec2 grid = tileGrid();
+
+    uint pixels = speciesCount == 2u ? 2u : (speciesCount == 4u ? 1u : 4u);
+    uint quads = pixels * speciesCount / 4u;
+    uint columns = ACTIVE_TILE_SIZE / pixels;
+    uint firstPixel = tile % grid.x * ACTIVE_TILE_SIZE + gl_LocalInvocationID.x % columns * pixels;
+    if (firstPixel >= dimensions.x) return;
+
+    // The tile's rows are split into segments of columns rows
+    uint rowLength = dimensions.x * speciesCount;
+    uint x = firstPixel * speciesCount;
+    int yStart = int(tile / grid.x * ACTIVE_TILE_SIZE + gl_LocalInvocationID.x / columns * columns);
+    int yEnd = min(yStart + int(columns), int(tile / grid.x * ACTIVE_TILE_SIZE + ACTIVE_TILE_SIZE));
+    yEnd = min(yEnd, int(dimensions.y));
+    if ((entry & TILE_RETIRE) != 0u) {
+        TRAIL_QUAD zero = encodeTrailQuad(vec4(0.0), vec4(0.0));
+        for (int y = yStart; y < yEnd; ++y) {
+            for (uint quad = 0u; quad < quads; ++quad) {
+                uint idx = uint(y) * trailStride + x + quad * 4u;
+                STORE_TRAIL_QUAD(trailMap, idx, zero);
+                STORE_TRAIL_QUAD(trailMapNext, idx, zero);
+            }
+            for (uint pixel = 0u; colorize && pixel < pixels && firstPixel + pixel < dimensions.x; ++pixel) {
+                imageStore(displayImage, ivec2(firstPixel + pixel, y), encodeColor(vec3(0.0)));
+            }
+        }
+        return;
+    }
+
+    vec4 sums[3];
+    for (uint quad = 0u; quad < quads; ++quad) {
+        sums[quad] = vec4(0.0);
+        for (int j = -diffusionSize; j <= diffusionSize; ++j) {
+            sums[quad] += blurAt(x + quad * 4u, yStart + j);
+        }
+    }
+
+    float area = float((diffusionSize * 2 + 1) * (diffusionSize * 2 + 1));
+    float peak = 0.0;
+    for (int y = yStart; y < yEnd; ++y) {
+        float stored[12];
+        for (uint quad = 0u; quad < quads; ++quad) {
+            uint idx = uint(y) * trailStride + x + quad * 4u;
+            vec4 current = loadTrailQuad(idx);
+            for (uint k = 0u; k < 4u; ++k) {
+                uint value = x + quad * 4u + k;
+                if (value < rowLength) {
+                    uint depositIdx = uint(y) * rowLength + value;
+                    current[k] += float(deposits[depositIdx]) / DEPOSIT_SCALE;
+                    deposits[depositIdx] = 0u;
+                }
+            }
+            vec4 next = mix(current, sums[quad] / area, diffusionRate) * decayRate;
+            // Padding past the row stays zero
+            for (uint k = 0u; k < 4u; ++k) {
+                if (x + quad * 4u + k >= rowLength) {
+                    next[k] = 0.0;
+                }
+            }
+            TRAIL_QUAD encoded = encodeTrailQuad(next, trailDither(idx, ditherKey));
+            STORE_TRAIL_QUAD(trailMapNext, idx, encoded);
+            vec4 decoded = decodeTrailQuad(encoded);
+            peak = max(peak, max(max(abs(decoded.x), abs(decoded.y)), max(abs(decoded.z), abs(decoded.w))));
+            for (uint k = 0u; k < 4u; ++k) {
+                stored[quad * 4u + k] = decoded[k];
+            }
+            sums[quad] += blurAt(x + quad * 4u, y + diffusionSize + 1) - blurAt(x + quad * 4u, y - diffusionSize);
+        }
+        if (colorize) {
+            for (uint pixel = 0u; pixel < pixels && firstPixel + pixel < dimensions.x; ++pixel) {
+                vec3 color = vec3(0.0);
+                for (uint channel = 0u; channel < speciesCount; ++channel) {
+                    color += min(stored[pixel * speciesCount + channel], 1.0) * speciesColors[channel];
+                }
+                imageStore(displayImage, ivec2(firstPixel + pixel, y), encodeColor(color));
+            }
+        }
+    }
+    atomicMax(tileState[tileField(TILE_MAX, tile)], floatBitsToUint(peak));
+}
+)";
+
+// Sensor sums, built before the update when the sensor size is above 0:
+// every value becomes the sum of its channel over the (2s+1)^2 pixels
+// around it. Running sums keep the cost per pixel flat whatever the size.
+// The row pass walks one channel of a row segment per invocation into the
+// blur scratch map, which is free between steps.
+const char* sumSensorRowsSource = R"(
+#define SEGMENT_WIDTH 64
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 4) buffer TrailMapBlurBuffer {
+    float trailMapBlur[];
+};
+
+void main() {
+    uint segment = gl_GlobalInvocationID.x / speciesCount;
+    uint channel = gl_GlobalInvocationID.x % speciesCount;
+    int xStart = int(segment * SEGMENT_WIDTH);
+    if (xStart >= int(dimensions.x)) return;
+
+    int xEnd = min(xStart + SEGMENT_WIDTH, int(dimensions.x));
+    uint trailStart = gl_WorkGroupID.y * trailStride + channel;
+    uint rowStart = gl_WorkGroupID.y * dimensions.x * speciesCount + channel;
+    int first = max(xStart - agentSensorSize, 0);
+    int last = min(xStart + agentSensorSize, int(dimensions.x) - 1);
+
+    float sum = 0.0;
+    for (int x = first; x <= last; ++x) {
+        sum += loadTrail(trailStart + uint(x) * speciesCount);
+    }
+    for (int x = xStart; x < xEnd; ++x) {
+        trailMapBlur[rowStart + uint(x) * speciesCount] = sum;
+        int next = x + agentSensorSize + 1;
+        int previous = x - agentSensorSize;
+        if (next < int(dimensions.x)) {
+            sum += loadTrail(trailStart + uint(next) * speciesCount);
+        }
+        if (previous >= 0) {
+            sum -= loadTrail(trailStart + uint(previous) * speciesCount);
+        }
+    }
+}
+)";
+
+// Column pass of the sensor sums, segments of the blur's column pass.
+const char* sumSensorColumnsSource = R"(
+#define SEGMENT_HEIGHT 64
+
+layout (local_size_x = 256) in;
+
+layout (std430, binding = 4) buffer TrailMapBlurBuffer {
+    float trailMapBlur[];
+};
+
+layout (std430, binding = 7) writeonly buffer SensorSumsBuffer {
+    float sensorSums[];
+};
+
+void main() {
+    uint x = gl_GlobalInvocationID.x;
+    uint rowLength = dimensions.x * speciesCount;
+    if (x >= rowLength) return;
+
+    int yStart = int(gl_WorkGroupID.y * SEGMENT_HEIGHT);
+    int yEnd = min(yStart + SEGMENT_HEIGHT, int(dimensions.y));
+    int first = max(yStart - agentSensorSize, 0);
+    int last = min(yStart + agentSensorSize, int(dimensions.y) - 1);
+
+    float sum = 0.0;
+    for (int y = first; y <= last; ++y) {
+        sum += trailMapBlur[uint(y) * rowLength + x];
+    }
+    for (int y = yStart; y < yEnd; ++y) {
+        sensorSums[uint(y) * rowLength + x] = sum;
+        int next = y + agentSensorSize + 1;
+        int previous = y - agentSensorSize;
+        if (next < int(dimensions.y)) {
+            sum += trailMapBlur[uint(next) * rowLength + x];
+        }
+        if (previous >= 0) {
+            sum -= trailMapBlur[uint(previous) * rowLength + x];
+        }
+    }
+}
+)";
+
+// Colorizing, shared by the whole-frame, the per-tile and the column
+// kernels, which are compiled as { ..., trailStorageSource,
+// trailColorSource, kernel }.
+const char* trailColorSource = R"(
+layout (rgba8, binding = 0) writeonly uniform image2D displayImage;
+
+// SpeciesColors on the CPU
+const vec3 speciesColors[MAX_SPECIES] = vec3[](
+    vec3(0.0, 1.0, 0.0), vec3(1.0, 0.0, 1.0), vec3(0.0, 0.5, 1.0), vec3(1.0, 0.8, 0.0)
+);
+
+// Truncated to 8 bits like the CPU backend. Alpha stays 0 so a BGRA
+// readback packs into 0x00RRGGBB.
+vec4 encodeColor(vec3 color) {
+    return vec4(floor(min(color, vec3(1.0)) * 255.0) / 255.0, 0.0);
+}
+
+void colorizePixel(uvec2 pixel) {
+    uint idx = pixel.y * trailStride + pixel.x * speciesCount;
+    vec3 color = vec3(0.0);
+    for (uint channel = 0u; channel < speciesCount; ++channel) {
+        color += min(loadTrail(idx + channel), 1.0) * speciesColors[channel];
+    }
+    imageStore(displayImage, ivec2(pixel), encodeColor(color));
+}
+)";
+
+const char* renderTrailMapSource = R"(
+layout (local_size_x = 1024) in;
+
+void main() {
+    uint idx = gl_GlobalInvocationID.x;
+    if (idx >= dimensions.x * dimensions.y) return;
+    colorizePixel(uvec2(idx % dimensions.x, idx / dimensions.x));
+}
+)";
+
+// Lists the tiles changed since the display was last colorized, apart from
+// the ones the column pass of the last step colorized already.
+const char* listChangedTilesSource = R"(
+layout (local_size_x = 64) in;
+
+uniform uint colorizedStamp;
+// The stamp of the last step when it colorized, otherwise 0
+uniform uint fusedStamp;
+
+void main() {
+    uint tile = gl_GlobalInvocationID.x;
+    if (tile >= tileCount()) return;
+    uint changed = tileState[tileField(TILE_CHANGED, tile)];
+    if (int(changed - colorizedStamp) > 0 && changed != fusedStamp) {
+        appendTile(LIST_COLORIZE, tile);
+    }
+}
+)";
+
+// One pixel column of a listed tile per invocation.
+const char* renderTilesSource = R"(
+layout (local_size_x = ACTIVE_TILE_SIZE) in;
+
+void main() {
+    uint tile = listedTile(LIST_COLORIZE);
+    if (tile == NO_TILE) return;
+    uvec2 grid = tileGrid();
+    uvec2 start = uvec2(tile % grid.x, tile / grid.x) * ACTIVE_TILE_SIZE;
+    uint x = start.x + gl_LocalInvocationID.x;
+    if (x >= dimensions.x) return;
+    for (uint y = start.y; y < min(start.y + ACTIVE_TILE_SIZE, dimensions.y); ++y) {
+        colorizePixel(uvec2(x, y));
+    }
+}
+)";
+
+// Conversions between the trail map storage and plain floats without row
+// padding, the format the host reads and writes, staged in the blur scratch
+// map. Pack writes one quad per invocation, rounding to nearest.
+const char* packTrailMapSource = R"(
+layout (local_size_x = 1024) in;
+
+layout (std430, binding = 4) buffer TrailMapBlurBuffer {
+    float trailMapBlur[];
+};
+
+void main() {
+    uint idx = gl_GlobalInvocationID.x * 4u;
+    if (idx >= dimensions.y * trailStride) return;
+    uint rowLength = dimensions.x * speciesCount;
+    uint y = idx / trailStride;
+    uint x = idx % trailStride;
+    vec4 values = vec4(0.0);
+    for (uint k = 0u; k < 4u && x + k < rowLength; ++k) {
+        values[k] = trailMapBlur[y * rowLength + x + k];
+    }
+    STORE_TRAIL_QUAD(trailMap, idx, encodeTrailQuad(values, vec4(0.5)));
+}
+)";
+
+const char* unpackTrailMapSource = R"(
+layout (local_size_x = 1024) in;
+
+layout (std430, binding = 4) buffer TrailMapBlurBuffer {
+    float trailMapBlur[];
+};
+
+void main() {
+    uint idx = gl_GlobalInvocationID.x;
+    uint rowLength = dimensions.x * speciesCount;
+    if (idx >= dimensions.y * rowLength) return;
+    trailMapBlur[idx] = loadTrail(idx / rowLength * trailStride + idx % rowLength);
+}
+)";
+
+// Spatial sort: count agents per tile, turn the counts into offsets, then
+// scatter every agent into the spare agents buffer. Each species has its own
+// binCount bins, in species order, so the species ranges survive the sort.
+// Shared by the count and scatter kernels, which are compiled after the
+// agent layout as { ..., agentLayoutSource, sortKeySource, kernel }.
+const char* sortKeySource = R"(
+#define SORT_TILE_SIZE 32
+
+uint spreadBits(uint v) {
+    v &= 0xFFFFu;
+    v = (v | (v << 8)) & 0x00FF00FFu;
+    v = (v | (v << 4)) & 0x0F0F0F0Fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+uint sortKey(FPoint2D position) {
+    float x = clamp(position.x, 0.0, float(dimensions.x - 1));
+    float y = clamp(position.y, 0.0, float(dimensions.y - 1));
+    return spreadBits(uint(x) / SORT_TILE_SIZE) | (spreadBits(uint(y) / SORT_TILE_SIZE) << 1);
+}
+
+uint agentSortKey(uint idx) {
+    return agentSpecies(idx) * binCount + sortKey(loadPosition(idx));
+}
+)";
+
+const char* countTilesSource = R"(
+layout (local_size_x = 1024) in;
+
+layout (std430, binding = 5) buffer TileOffsetsBuffer {
+    uint tileOffsets[];
+};
+
+void main() {
+    uint idx = agentInvocation();
+    if (idx >= agentCount) return;
+
+    atomicAdd(tileOffsets[agentSortKey(idx)], 1u);
+}
+)";
+
+const char* scanTilesSource = R"(
+layout (local_size_x = 1024) in;
+
+layout (std430, binding = 5) buffer TileOffsetsBuffer {
+    uint tileOffsets[];
+};
+
+shared uint runTotals[1024];
+
+void main() {
+    uint lid = gl_LocalInvocationID.x;
+    uint bins = binCount * speciesCount;
+    uint runLength = (bins + 1023u) / 1024u;
+    uint runStart = min(lid * runLength, bins);
+    uint runEnd = min(runStart + runLength, bins);
+
+    uint total = 0u;
+    for (uint i = runStart; i < runEnd; ++i) {
+        total += tileOffsets[i];
+    }
+    runTotals[lid] = total;
+    barrier();
+
+    for (uint stride = 1u; stride < 1024u; stride <<= 1) {
+        uint value = lid >= stride ? runTotals[lid - stride] : 0u;
+        barrier();
+        runTotals[lid] += value;
+        barrier();
+    }
+
+    uint offset = runTotals[lid] - total;
+    for (uint i = runStart; i < runEnd; ++i) {
+        uint count = tileOffsets[i];
+        tileOffsets[i] = offset;
+        offset += count;
+    }
+}
+)";
+
+// Copies the stored words as they are, so sorting never requantizes. Compact
+// headings land in arbitrary halves of the destination words; those are
+// cleared beforehand and filled with atomicOr.
+const char* scatterAgentsSource = R"(
+layout (local_size_x = 1024) in;
+
+layout (std430, binding = 5) buffer TileOffsetsBuffer {
+    uint tileOffsets[];
+};
+
+layout (std430, binding = 6) buffer SortedAgentsBuffer {
+    AgentWord sortedAgentData[];
+};
+
+void main() {
+    uint idx = agentInvocation();
+    if (idx >= agentCount) return;
+
+    uint dst = atomicAdd(tileOffsets[agentSortKey(idx)], 1u);
+#if defined(AGENT_LAYOUT_COMPACT)
+    sortedAgentData[dst] = agentData[idx];
+    uint heading = (agentData[agentPool + idx / 2u] >> ((idx & 1u) * 16u)) & 0xFFFFu;
+    atomicOr(sortedAgentData[agentPool + dst / 2u], heading << ((dst & 1u) * 16u));
+#else
+    for (uint component = 0u; component < 3u; ++component) {
+        sortedAgentData[agentWordIndex(dst, component)] = agentData[agentWordIndex(idx, component)];
+    }
+#endif
+}
+)";
+
+GLuint compileShader(std::initializer_list<const char*> sources, GLenum type) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, static_cast<GLsizei>(sources.size()), sources.begin(), nullptr);
+    glCompileShader(shader);
+    
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status != GL_TRUE) {
+        char buffer[512];
+        glGetShaderInfoLog(shader, 512, nullptr, buffer);
+        std::cerr << "Shader compile error: " << buffer << std::endl;
+        exit(-1);
+    }
+    return shader;
+}
+
+GLuint createComputeProgram(std::initializer_list<const char*> sources) {
+    GLuint program = glCreateProgram();
+    GLuint shader = compileShader(sources, GL_COMPUTE_SHADER);
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        char buffer[512];
+        glGetProgramInfoLog(program, 512, nullptr, buffer);
+        std::cerr << "Program link error: " << buffer << std::endl;
+        exit(-1);
+    }
+    return program;
+}
+
+// Host copy of SimulationBlock. The vec4 members come first and every member
+// after them is 4 bytes, so the std140 offsets match the declaration order.
+struct SimulationBlock {
+    float speciesMotion[MAX_SPECIES][4];
+    float speciesWeights[MAX_SPECIES][4];
+    uint32_t speciesDeposit[4];
+    float speciesSensorCos[4];
+    float speciesSensorSin[4];
+    uint32_t dimensions[2];
+    uint32_t agentCount;
+    uint32_t agentPool;
+    uint32_t binCount;
+    uint32_t speciesCount;
+    int32_t agentSensorSize;
+    float decayRate;
+    float diffusionRate;
+    int32_t diffusionSize;
+    uint32_t trailStride;
+    float trailRange;
+};
+
+static_assert(MAX_SPECIES <= 4, "species weights and deposits are stored as one vec4 per species");
+static_assert(DEPOSIT_SCALE == 4096, "the shaders define DEPOSIT_SCALE as 4096.0");
+static_assert(SENSOR_SEGMENT_WIDTH == 64 && DIFFUSION_SEGMENT_HEIGHT == 64, "the shaders define their segments as 64");
+static_assert(ACTIVE_TILE_SIZE == 64 && ACTIVE_TILE_EPSILON == 1.0f / 1024.0f, "the shaders define the active tiles alike");
+
+inline const char* agentLayoutDefine(AgentLayout layout) {
+    switch (layout) {
+        case AgentLayout::SOA: return "#define AGENT_LAYOUT_SOA\n";
+        case AgentLayout::COMPACT: return "#define AGENT_LAYOUT_COMPACT\n";
+        default: return "#define AGENT_LAYOUT_AOS\n";
+    }
+}
+
+inline const char* trailFormatDefine(TrailFormat format) {
+    switch (format) {
+        case TrailFormat::FP16: return "#define TRAIL_FP16\n";
+        case TrailFormat::UNORM16: return "#define TRAIL_UNORM16\n";
+        case TrailFormat::UNORM8: return "#define TRAIL_UNORM8\n";
+        default: return "#define TRAIL_FP32\n";
+    }
+}
+
+class GpuSimulation : public Simulation {
+public:
+    GpuSimulation(uint32_t width, uint32_t height, uint32_t agentCount, AgentLayout layout = AgentLayout::AOS,
+                  uint32_t speciesCount = 1, TrailFormat trailFormat = TrailFormat::FP32,
+                  float trailRange = TRAIL_RANGE_HEADROOM)
+        : Simulation(width, height, agentCount, speciesCount), layout(layout), format(trailFormat), trailRange(trailRange) {
+        createAgentBuffers();
+        createGridBuffers();
+
+        glGenBuffers(1, &simulationBlockBuffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, simulationBlockBuffer);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(SimulationBlock), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, 0, simulationBlockBuffer);
+        updateSimulationBlock(SimulationParameters());
+
+        // Group counts for every dispatch, rewritten only when sizes change
+        glGenBuffers(1, &dispatchBuffer);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatchBuffer);
+        glBufferData(GL_DISPATCH_INDIRECT_BUFFER, DISPATCH_COMMAND_COUNT * 3 * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        writeDispatchCommands();
+
+        // Create compute programs, the agent kernels specialized for the
+        // layout and everything touching the trail map for its format
+        const char* layoutDefine = agentLayoutDefine(layout);
+        const char* formatDefine = trailFormatDefine(format);
+        createAgentPrograms();
+        classifyTilesProgram = createComputeProgram({ "#version 430\n", simulationBlockSource, activeTilesSource, classifyTilesSource });
+        listTilesProgram = createComputeProgram({ "#version 430\n", simulationBlockSource, activeTilesSource, listTilesSource });
+        blurTrailMapProgram = createComputeProgram({ "#version 430\n", formatDefine, simulationBlockSource, activeTilesSource, randomSource, trailStorageSource, blurTrailMapSource });
+        processTrailMapProgram = createComputeProgram({ "#version 430\n", formatDefine, simulationBlockSource, activeTilesSource, randomSource, trailStorageSource, trailColorSource, processTrailMapSource });
+        sumSensorRowsProgram = createComputeProgram({ "#version 430\n", formatDefine, simulationBlockSource, randomSource, trailStorageSource, sumSensorRowsSource });
+        sumSensorColumnsProgram = createComputeProgram({ "#version 430\n", simulationBlockSource, sumSensorColumnsSource });
+        renderTrailMapProgram = createComputeProgram({ "#version 430\n", formatDefine, simulationBlockSource, activeTilesSource, randomSource, trailStorageSource, trailColorSource, renderTrailMapSource });
+        listChangedTilesProgram = createComputeProgram({ "#version 430\n", simulationBlockSource, activeTilesSource, listChangedTilesSource });
+        renderTilesProgram = createComputeProgram({ "#version 430\n", formatDefine, simulationBlockSource, activeTilesSource, randomSource, trailStorageSource, trailColorSource, renderTilesSource });
+        packTrailMapProgram = createComputeProgram({ "#version 430\n", formatDefine, simulationBlockSource, randomSource, trailStorageSource, packTrailMapSource });
+        unpackTrailMapProgram = createComputeProgram({ "#version 430\n", formatDefine, simulationBlockSource, randomSource, trailStorageSource, unpackTrailMapSource });
+        countTilesProgram = createComputeProgram({ "#version 430\n", layoutDefine, simulationBlockSource, agentLayoutSource, sortKeySource, countTilesSource });
+        scanTilesProgram = createComputeProgram({ "#version 430\n", simulationBlockSource, scanTilesSource });
+        scatterAgentsProgram = createComputeProgram({ "#version 430\n", layoutDefine, simulationBlockSource, agentLayoutSource, sortKeySource, scatterAgentsSource });
+
+        // The few plain uniforms left, resolved once
+        stepStampLocation = glGetUniformLocation(listTilesProgram, "stepStamp");
+        colorizedStampLocation = glGetUniformLocation(listChangedTilesProgram, "colorizedStamp");
+        fusedStampLocation = glGetUniformLocation(listChangedTilesProgram, "fusedStamp");
+        ditherKeyLocation = glGetUniformLocation(processTrailMapProgram, "ditherKey");
+        colorizeLocation = glGetUniformLocation(processTrailMapProgram, "colorize");
+
+        glGenQueries(2 * STAGE_COUNT, &stageQueries[0][0]);
+    }
+
+    ~GpuSimulation() override {
+        glDeleteBuffers(1, &agentsBuffer);
+        glDeleteBuffers(1, &sortedAgentsBuffer);
+        deleteGridBuffers();
+        glDeleteBuffers(1, &simulationBlockBuffer);
+        glDeleteBuffers(1, &dispatchBuffer);
+        glDeleteProgram(initAgentsProgram);
+        glDeleteProgram(updateAgentsProgram);
+        glDeleteProgram(classifyTilesProgram);
+        glDeleteProgram(listTilesProgram);
+        glDeleteProgram(blurTrailMapProgram);
+        glDeleteProgram(processTrailMapProgram);
+        glDeleteProgram(sumSensorRowsProgram);
+        glDeleteProgram(sumSensorColumnsProgram);
+        glDeleteProgram(renderTrailMapProgram);
+        glDeleteProgram(listChangedTilesProgram);
+        glDeleteProgram(renderTilesProgram);
+        glDeleteProgram(packTrailMapProgram);
+        glDeleteProgram(unpackTrailMapProgram);
+        glDeleteProgram(countTilesProgram);
+        glDeleteProgram(scanTilesProgram);
+        glDeleteProgram(scatterAgentsProgram);
+        glDeleteQueries(2 * STAGE_COUNT, &stageQueries[0][0]);
+        glDeleteTextures(3, environmentTextures);
+        if (batchFence) {
+            glDeleteSync(batchFence);
+        }
+        if (presentFence) {
+            glDeleteSync(presentFence);
+        }
+    }
+
+    // The framebuffer of the texture being colorized into
+    GLuint displayFramebufferId() const { return displays[displaySlot].framebuffer; }
+    TrailFormat trailFormat() const { return format; }
+    size_t trailMapBytes() const { return size_t(height) * trailStride() * trailFormatBytes(format); }
+
+    // A buffer holding the current trail map as plain floats, valid until
+    // the next step: the trail map itself when it is stored that way,
+    // otherwise a copy unpacked into scratch.
+    GLuint trailMapBufferId() {
+        if (!packedTrailMap()) {
+            return trailMapBuffers[currentTrailMap];
+        }
+        unpackTrailMap();
+        return trailMapBlurBuffer;
+    }
+
+    // Shows the frame handed over by the last finishFrame() in the current
+    // window, while the next one is colorized into the other texture. At
+    // most one present is queued behind the one executing, so the frame on
+    // screen is never more than a batch behind the simulation.
+    void present(int targetWidth, int targetHeight) {
+        glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT);
+        blitToWindow(displays[displaySlot ^ 1].framebuffer, width, height, targetWidth, targetHeight);
+        GLsync previous = presentFence;
+        presentFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        if (previous) {
+            glClientWaitSync(previous, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(previous);
+        }
+    }
+
+    // Hands the frame colorized last to present() and colorizes the next
+    // one into the other display texture, which present() no longer reads.
+    void finishFrame() {
+        displaySlot ^= 1;
+        fusedStamp = 0;
+        glBindImageTexture(0, displays[displaySlot].texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    }
+
+    void initAgents(uint32_t seed) override {
+        randomSeed = seed;
+        seedAgents(0, 1.0f, 1.0f, seed);
+    }
+
+    void resize(uint32_t newWidth, uint32_t newHeight, uint32_t newAgentCount, uint32_t seed) override {
+        // Compact positions are stored relative to the grid and need no scaling
+        const bool relative = layout == AgentLayout::COMPACT;
+        const float scaleX = relative ? 1.0f : float(newWidth) / width;
+        const float scaleY = relative ? 1.0f : float(newHeight) / height;
+
+        if (newWidth != width || newHeight != height) {
+            std::vector<float> trail, resampled;
+            readTrailMap(trail);
+            resampleTrailMap(trail, width, height, resampled, newWidth, newHeight, speciesCount);
+            deleteGridBuffers();
+            width = newWidth;
+            height = newHeight;
+            createGridBuffers();
+            // Packing the trail map dispatches over the new grid
+            updateSimulationBlock(lastParams);
+            writeDispatchCommands();
+            writeTrailMap(resampled.data());
+            if (environment) {
+                environmentChanged();
+            }
+        }
+
+        // Copy the surviving agents into buffers sized for the new population
+        const uint32_t kept = std::min(agentCount, newAgentCount);
+        AgentSection oldSections[3], newSections[3];
+        const size_t sections = agentSections(kept, agentPool, oldSections);
+        GLuint oldAgentsBuffer = agentsBuffer;
+        glDeleteBuffers(1, &sortedAgentsBuffer);
+        agentCount = newAgentCount;
+        agentPool = newAgentCount;
+        createAgentBuffers();
+        agentSections(kept, agentPool, newSections);
+
+        glBindBuffer(GL_COPY_READ_BUFFER, oldAgentsBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, agentsBuffer);
+        for (size_t i = 0; i < sections; ++i) {
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, oldSections[i].offset, newSections[i].offset,
+                oldSections[i].bytes);
+        }
+        glDeleteBuffers(1, &oldAgentsBuffer);
+
+        updateSimulationBlock(lastParams);
+        writeDispatchCommands();
+        seedAgents(kept, scaleX, scaleY, seed);
+    }
+
+    void setPopulation(uint32_t count) override {
+        const uint32_t kept = std::min(agentCount, count);
+        agentCount = count;
+        updateSimulationBlock(lastParams);
+        writeDispatchCommands();
+        if (count > kept) {
+            seedAgents(kept, 1.0f, 1.0f, randomSeed);
+        }
+    }
+
+    void updateAgents(const SimulationParameters &params) override {
+        beginStage(STAGE_UPDATE);
+        updateSimulationBlock(params);
+        if (simulationBlock.agentSensorSize > 0) {
+            glUseProgram(sumSensorRowsProgram);
+            dispatch(DISPATCH_SENSOR_ROWS);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            glUseProgram(sumSensorColumnsProgram);
+            dispatch(DISPATCH_SEGMENTS);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+        glUseProgram(updateAgentsProgram);
+        glUniform1ui(randomKeyLocation, stepRandomKey(randomSeed, stepIndex));
+        dispatch(DISPATCH_AGENT_INVOCATIONS);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        endStage(STAGE_UPDATE);
+    }
+
+    // The update kernel deposits and the blur passes add the deposits to
+    // the trail map, so there is no pass of its own.
+    void renderAgents() override {}
+
+    // Only the active tiles are diffused: they are classified and listed
+    // on the GPU, and the blur passes are dispatched from the lists. In a
+    // step that colorizes, the column pass writes the display colors of
+    // its tiles as it stores them.
+    void processTrailMap(const SimulationParameters &params) override {
+        beginStage(STAGE_DIFFUSE);
+        updateSimulationBlock(params);
+
+        glUseProgram(classifyTilesProgram);
+        dispatch(DISPATCH_TILES);
+        clearTileList(LIST_ROWS);
+        clearTileList(LIST_COLUMNS);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glUseProgram(listTilesProgram);
+        glUniform1ui(stepStampLocation, uint32_t(stepIndex + 1));
+        dispatch(DISPATCH_TILES);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+        glUseProgram(blurTrailMapProgram);
+        dispatchTiles(LIST_ROWS);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glUseProgram(processTrailMapProgram);
+        glUniform1ui(ditherKeyLocation, stepRandomKey(~randomSeed, stepIndex));
+        glUniform1i(colorizeLocation, colorizing);
+        dispatchTiles(LIST_COLUMNS);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        if (colorizing) {
+            fusedStamp = uint32_t(stepIndex + 1);
+        }
+
+        // The freshly written map becomes the current one
+        currentTrailMap ^= 1;
+        bindTrailMaps();
+        endStage(STAGE_DIFFUSE);
+    }
+
+    // Redoes the tiles changed since the display texture was last
+    // colorized and not colorized by the step just run, or the whole frame
+    // after the trail map was replaced. Nothing waits on the colors here:
+    // present(), readDisplay() and the readback issue the barrier for
+    // their own access, so the next batch is not held up behind it.
+    void renderTrailMap() override {
+        beginStage(STAGE_COLORIZE);
+        DisplayTexture &display = displays[displaySlot];
+        if (display.colorized) {
+            clearTileList(LIST_COLORIZE);
+            glUseProgram(listChangedTilesProgram);
+            glUniform1ui(colorizedStampLocation, display.colorizedStep);
+            glUniform1ui(fusedStampLocation, fusedStamp == uint32_t(stepIndex) ? fusedStamp : 0u);
+            dispatch(DISPATCH_TILES);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+            glUseProgram(renderTilesProgram);
+            dispatchTiles(LIST_COLORIZE);
+        } else {
+            glUseProgram(renderTrailMapProgram);
+            dispatch(DISPATCH_PIXELS);
+            display.colorized = true;
+        }
+        display.colorizedStep = uint32_t(stepIndex);
+        endStage(STAGE_COLORIZE);
+    }
+
+    void readTrailMap(std::vector<float> &out) override {
+        out.resize(trailMapValues());
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, trailMapBufferId());
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, out.size() * sizeof(float), out.data());
+    }
+
+    void writeTrailMap(const float *trail) override {
+        if (packedTrailMap()) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, trailMapBlurBuffer);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, trailMapValues() * sizeof(float), trail);
+            glUseProgram(packTrailMapProgram);
+            dispatch(DISPATCH_TRAIL_QUADS);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+        } else {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, trailMapBuffers[currentTrailMap]);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, trailMapValues() * sizeof(float), trail);
+        }
+        // Every tile counts as deposited into, and change stamps start over
+        // so a step index set afterwards, even an earlier one, compares
+        // against them correctly
+        const uint32_t one = 1, zero = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileStateBuffer);
+        glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, TILE_DEPOSITED * tileCount() * sizeof(uint32_t),
+            tileCount() * sizeof(uint32_t), GL_RED_INTEGER, GL_UNSIGNED_INT, &one);
+        glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, TILE_CHANGED * tileCount() * sizeof(uint32_t),
+            tileCount() * sizeof(uint32_t), GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+        displays[0].colorized = displays[1].colorized = false;
+        fusedStamp = 0;
+    }
+
+    AgentLayout agentLayout() const override { return layout; }
+
+    void readAgentData(std::vector<unsigned char> &out) override {
+        out.resize(agentDataBytes(layout, agentCount));
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, agentsBuffer);
+        AgentSection sections[3];
+        for (size_t i = 0, count = agentSections(agentCount, agentPool, sections); i < count; ++i) {
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, sections[i].offset, sections[i].bytes, out.data() + sections[i].dataOffset);
+        }
+    }
+
+    void writeAgentData(const unsigned char *data) override {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, agentsBuffer);
+        AgentSection sections[3];
+        for (size_t i = 0, count = agentSections(agentCount, agentPool, sections); i < count; ++i) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, sections[i].offset, sections[i].bytes, data + sections[i].dataOffset);
+        }
+    }
+
+    // Copies the agents in the agentDataBytes format into the buffer bound
+    // to GL_COPY_WRITE_BUFFER, from offset on.
+    void copyAgentData(size_t offset) {
+        glBindBuffer(GL_COPY_READ_BUFFER, agentsBuffer);
+        AgentSection sections[3];
+        for (size_t i = 0, count = agentSections(agentCount, agentPool, sections); i < count; ++i) {
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, sections[i].offset,
+                offset + sections[i].dataOffset, sections[i].bytes);
+        }
+    }
+
+    void readDisplay(std::vector<uint32_t> &out) override {
+        out.resize(size_t(width) * height);
+        glMemoryBarrier(GL_TEXTURE_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, displays[displaySlot].texture);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_BGRA, GL_UNSIGNED_BYTE, out.data());
+    }
+
+    void sortAgents() override {
+        beginStage(STAGE_SORT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileOffsetsBuffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+        glUseProgram(countTilesProgram);
+        dispatch(DISPATCH_AGENTS);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        glUseProgram(scanTilesProgram);
+        glDispatchCompute(1, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        // Compact headings are OR-ed into the scatter target
+        if (layout == AgentLayout::COMPACT) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortedAgentsBuffer);
+            glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, size_t(agentPool) * sizeof(uint32_t),
+                agentBufferBytes() - size_t(agentPool) * sizeof(uint32_t), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        }
+
+        glUseProgram(scatterAgentsProgram);
+        dispatch(DISPATCH_AGENTS);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        std::swap(agentsBuffer, sortedAgentsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, agentsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, sortedAgentsBuffer);
+        endStage(STAGE_SORT);
+    }
+
+    // Keeps at most one batch queued behind the one executing, so a loop
+    // that rarely presents cannot run arbitrarily far ahead of the GPU.
+    void advance(const SimulationParameters &params, uint64_t steps, bool colorize = false) override {
+        Simulation::advance(params, steps, colorize);
+        GLsync previous = batchFence;
+        batchFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
+        if (previous) {
+            glClientWaitSync(previous, 0, GL_TIMEOUT_IGNORED);
+            glDeleteSync(previous);
+        }
+    }
+
+    void finish() override {
+        glFinish();
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            for (int slot = 0; slot < 2; ++slot) {
+                collectStageQuery(SimulationStage(stage), slot);
+            }
+        }
+    }
+
+    // Each stage alternates between two queries. The one about to be reused
+    // was issued a whole stage earlier, so reading it rarely has to wait.
+    // Trace events start at the CPU submit time and last as long as the GPU
+    // took.
+    void beginStage(SimulationStage stage) override {
+        if (timingEnabled) {
+            int slot = stageQuerySlot[stage];
+            collectStageQuery(stage, slot);
+            stageQueryStart[slot][stage] = std::chrono::high_resolution_clock::now();
+            glBeginQuery(GL_TIME_ELAPSED, stageQueries[slot][stage]);
+        }
+    }
+
+    void endStage(SimulationStage stage) override {
+        if (timingEnabled) {
+            glEndQuery(GL_TIME_ELAPSED);
+            stageQueryPending[stageQuerySlot[stage]][stage] = true;
+            stageQuerySlot[stage] ^= 1;
+        }
+    }
+
+protected:
+    const char *backendName() const override { return "gpu"; }
+
+private:
+    enum DispatchCommand {
+        DISPATCH_AGENT_INVOCATIONS,
+        DISPATCH_AGENTS,
+        DISPATCH_SEGMENTS,
+        DISPATCH_SENSOR_ROWS,
+        DISPATCH_PIXELS,
+        DISPATCH_TILES,
+        DISPATCH_TRAIL_QUADS,
+        DISPATCH_TRAIL_VALUES,
+        DISPATCH_COMMAND_COUNT
+    };
+
+    // Lists in tileListBuffer, see activeTilesSource
+    enum TileList {
+        LIST_ROWS,
+        LIST_COLUMNS,
+        LIST_COLORIZE,
+        TILE_LIST_COUNT
+    };
+
+    // Fields of tileStateBuffer
+    enum TileField {
+        TILE_MAX,
+        TILE_DEPOSITED,
+        TILE_LIVE,
+        TILE_PROCESSED,
+        TILE_CHANGED,
+        TILE_FIELD_COUNT
+    };
+
+    // Uploads the environment at the grid size as read-only textures, and
+    // recompiles the agent kernels when the fields they sample change.
+    void environmentChanged() override {
+        glDeleteTextures(3, environmentTextures);
+        environmentTextures[0] = environmentTextures[1] = environmentTextures[2] = 0;
+        std::shared_ptr<const EnvironmentFields> fields = environment ? environment->fields(width, height) : nullptr;
+        if (fields && !fields->sensed.empty()) {
+            environmentTextures[0] = createFieldTexture(1, GL_R32F, GL_RED, GL_FLOAT, fields->sensed.data());
+        }
+        if (fields && !fields->obstacleDistance.empty()) {
+            environmentTextures[1] = createFieldTexture(2, GL_R32F, GL_RED, GL_FLOAT, fields->obstacleDistance.data());
+            environmentTextures[2] = createFieldTexture(3, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, fields->nearestFree.data());
+        }
+
+        std::string defines = environmentDefines();
+        if (defines != agentProgramDefines) {
+            agentProgramDefines = defines;
+            glDeleteProgram(initAgentsProgram);
+            glDeleteProgram(updateAgentsProgram);
+            createAgentPrograms();
+        }
+    }
+
+    // A width * height texture of one value per pixel on texture unit unit,
+    // read with texelFetch.
+    GLuint createFieldTexture(GLuint unit, GLenum internalFormat, GLenum format, GLenum type, const void *values) {
+        GLuint texture;
+        glGenTextures(1, &texture);
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, values);
+        glActiveTexture(GL_TEXTURE0);
+        return texture;
+    }
+
+    // The agent kernels' defines for the environment fields in use.
+    std::string environmentDefines() const {
+        std::string defines;
+        if (environmentTextures[0]) {
+            defines += "#define SENSED_FIELD\n";
+        }
+        if (environmentTextures[1]) {
+            char obstacles[128];
+            snprintf(obstacles, sizeof(obstacles), "#define OBSTACLES\n#define OBSTACLE_MARGIN %.9g\n#define SEED_ATTEMPTS %d\n",
+                OBSTACLE_MARGIN, SEED_ATTEMPTS);
+            defines += obstacles;
+        }
+        return defines;
+    }
+
+    // The init and update kernels, specialized for the layout, the trail
+    // format and the environment, and their plain uniforms.
+    void createAgentPrograms() {
+        const char* layoutDefine = agentLayoutDefine(layout);
+        initAgentsProgram = createComputeProgram({ "#version 430\n", layoutDefine, agentProgramDefines.c_str(),
+            simulationBlockSource, agentLayoutSource, obstaclesSource, initAgentsSource });
+        updateAgentsProgram = createComputeProgram({ "#version 430\n", layoutDefine, trailFormatDefine(format), agentProgramDefines.c_str(),
+            simulationBlockSource, agentLayoutSource, obstaclesSource, randomSource, activeTilesSource, trailStorageSource, updateAgentsSource });
+        seedLocation = glGetUniformLocation(initAgentsProgram, "seed");
+        firstAgentLocation = glGetUniformLocation(initAgentsProgram, "firstAgent");
+        positionScaleLocation = glGetUniformLocation(initAgentsProgram, "positionScale");
+        randomKeyLocation = glGetUniformLocation(updateAgentsProgram, "randomKey");
+    }
+
+    void collectStageQuery(SimulationStage stage, int slot) {
+        if (!stageQueryPending[slot][stage]) {
+            return;
+        }
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(stageQueries[slot][stage], GL_QUERY_RESULT, &nanoseconds);
+        stageQueryPending[slot][stage] = false;
+        addStageTime(stage, stageQueryStart[slot][stage], nanoseconds / 1e6);
+    }
+
+    // Seeds agents from firstAgent on and scales the positions of the ones
+    // before it.
+    void seedAgents(uint32_t firstAgent, float scaleX, float scaleY, uint32_t seed) {
+        glUseProgram(initAgentsProgram);
+        glUniform1ui(seedLocation, seed);
+        glUniform1ui(firstAgentLocation, firstAgent);
+        glUniform2f(positionScaleLocation, scaleX, scaleY);
+        dispatch(DISPATCH_AGENT_INVOCATIONS);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    void createAgentBuffers() {
+        glGenBuffers(1, &agentsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, agentsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, agentBufferBytes(), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, agentsBuffer);
+
+        // Sort scratch: the scatter target that is swapped in as agentsBuffer
+        glGenBuffers(1, &sortedAgentsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortedAgentsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, agentBufferBytes(), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, sortedAgentsBuffer);
+    }
+
+    void createGridBuffers() {
+        binCount = sortBinCount(width, height);
+        glGenBuffers(1, &tileOffsetsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileOffsetsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size_t(binCount) * speciesCount * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, tileOffsetsBuffer);
+
+        // Two trail maps swapped every step plus the horizontal blur pass,
+        // which has the same padded rows. Zero is 0 in every format.
+        glGenBuffers(2, trailMapBuffers);
+        for (GLuint buffer : trailMapBuffers) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, trailMapBytes(), nullptr, GL_DYNAMIC_DRAW);
+            glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        }
+        currentTrailMap = 0;
+        bindTrailMaps();
+
+        glGenBuffers(1, &depositsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, depositsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, trailMapValues() * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, depositsBuffer);
+
+        glGenBuffers(1, &trailMapBlurBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, trailMapBlurBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, size_t(height) * trailStride() * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, nullptr);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, trailMapBlurBuffer);
+
+        glGenBuffers(1, &sensorSumsBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, sensorSumsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, trailMapValues() * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, sensorSumsBuffer);
+
+        // Nothing is active on a blank map
+        glGenBuffers(1, &tileStateBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileStateBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, TILE_FIELD_COUNT * tileCount() * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, tileStateBuffer);
+
+        glGenBuffers(1, &tileListBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileListBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (TILE_LIST_COUNT * 4 + TILE_LIST_COUNT * tileCount()) * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, tileListBuffer);
+        for (int list = 0; list < TILE_LIST_COUNT; ++list) {
+            clearTileList(TileList(list));
+        }
+
+        for (DisplayTexture &display : displays) {
+            createDisplayTexture(width, height, display.texture, display.framebuffer);
+            display.colorized = false;
+        }
+        glBindImageTexture(0, displays[displaySlot].texture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    }
+
+    void deleteGridBuffers() {
+        glDeleteBuffers(1, &tileOffsetsBuffer);
+        glDeleteBuffers(1, &depositsBuffer);
+        glDeleteBuffers(2, trailMapBuffers);
+        glDeleteBuffers(1, &trailMapBlurBuffer);
+        glDeleteBuffers(1, &sensorSumsBuffer);
+        glDeleteBuffers(1, &tileStateBuffer);
+        glDeleteBuffers(1, &tileListBuffer);
+        for (DisplayTexture &display : displays) {
+            deleteDisplayTexture(display.texture, display.framebuffer);
+        }
+    }
+
+    size_t agentBufferBytes() const {
+        return agentDataBytes(layout, agentPool);
+    }
+
+    // Where the agentDataBytes format of count agents lies in buffers that
+    // hold pool agents: one run per array of the layout. Returns the number
+    // of runs.
+    struct AgentSection {
+        size_t offset;
+        size_t dataOffset;
+        size_t bytes;
+    };
+
+    size_t agentSections(uint32_t count, uint32_t pool, AgentSection *out) const {
+        const size_t word = sizeof(uint32_t);
+        switch (layout) {
+            case AgentLayout::SOA:
+                for (size_t component = 0; component < 3; ++component) {
+                    out[component] = { component * pool * word, component * count * word, count * word };
+                }
+                return 3;
+            case AgentLayout::COMPACT:
+                out[0] = { 0, 0, count * word };
+                out[1] = { pool * word, count * word, (size_t(count) + 1) / 2 * word };
+                return 2;
+            default:
+                out[0] = { 0, 0, count * 3 * word };
+                return 1;
+        }
+    }
+
+    size_t trailMapValues() const {
+        return size_t(width) * height * speciesCount;
+    }
+
+    // Values between trail map rows: whole quads of four pixels, see
+    // trailStorageSource
+    uint32_t trailStride() const {
+        return (width + 3) / 4 * 4 * speciesCount;
+    }
+
+    // Whether the trail map is stored other than as plain rows of floats
+    bool packedTrailMap() const {
+        return format != TrailFormat::FP32 || trailStride() != width * speciesCount;
+    }
+
+    // Unpacks the current trail map into the blur scratch map.
+    void unpackTrailMap() {
+        glUseProgram(unpackTrailMapProgram);
+        dispatch(DISPATCH_TRAIL_VALUES);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    }
+
+    uint32_t tileCount() const {
+        return ((width + ACTIVE_TILE_SIZE - 1) / ACTIVE_TILE_SIZE) * ((height + ACTIVE_TILE_SIZE - 1) / ACTIVE_TILE_SIZE);
+    }
+
+    // Init and update handle two compact agents per invocation so heading
+    // words are written whole.
+    uint32_t agentInvocationCount() const {
+        return layout == AgentLayout::COMPACT ? (agentCount + 1) / 2 : agentCount;
+    }
+
+    // Work groups per dimension are capped at 65535, so large populations
+    // spill into a second dimension; agentInvocation() in the shaders
+    // flattens it again.
+    static void agentDispatchSize(uint32_t invocations, uint32_t *command) {
+        uint32_t groups = (invocations + 1023) / 1024;
+        uint32_t rows = (groups + 65534) / 65535;
+        command[0] = rows > 1 ? 65535 : groups;
+        command[1] = rows;
+        command[2] = 1;
+    }
+
+    void writeDispatchCommands() {
+        uint32_t commands[DISPATCH_COMMAND_COUNT][3] = {
+            {},
+            {},
+            { (width * speciesCount + 255) / 256, (height + DIFFUSION_SEGMENT_HEIGHT - 1) / DIFFUSION_SEGMENT_HEIGHT, 1 },
+            { ((width + SENSOR_SEGMENT_WIDTH - 1) / SENSOR_SEGMENT_WIDTH * speciesCount + 255) / 256, height, 1 },
+            { (width * height + 1023) / 1024, 1, 1 },
+            { (tileCount() + 63) / 64, 1, 1 },
+            { uint32_t((size_t(height) * trailStride() / 4 + 1023) / 1024), 1, 1 },
+            { uint32_t((trailMapValues() + 1023) / 1024), 1, 1 }
+        };
+        agentDispatchSize(agentInvocationCount(), commands[DISPATCH_AGENT_INVOCATIONS]);
+        agentDispatchSize(agentCount, commands[DISPATCH_AGENTS]);
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatchBuffer);
+        glBufferSubData(GL_DISPATCH_INDIRECT_BUFFER, 0, sizeof(commands), commands);
+    }
+
+    void dispatch(DispatchCommand command) {
+        glDispatchComputeIndirect(GLintptr(command) * 3 * sizeof(uint32_t));
+    }
+
+    // One work group per entry of a list the GPU built
+    void dispatchTiles(TileList list) {
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, tileListBuffer);
+        glDispatchComputeIndirect(GLintptr(list) * 4 * sizeof(uint32_t));
+        glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatchBuffer);
+    }
+
+    // Empties a list; the row pass has a work group per row of a tile.
+    void clearTileList(TileList list) {
+        const uint32_t command[4] = { 0, 0, list == LIST_ROWS ? ACTIVE_TILE_SIZE : 1u, 0 };
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileListBuffer);
+        glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_RGBA32UI, GLintptr(list) * sizeof(command), sizeof(command),
+            GL_RGBA_INTEGER, GL_UNSIGNED_INT, command);
+    }
+
+    // Uploads the parameter block, but only when a value in it changed.
+    void updateSimulationBlock(const SimulationParameters &params) {
+        SimulationBlock next = {
+            {}, {}, {}, {}, {}, { width, height }, agentCount, agentPool, binCount, speciesCount,
+            clampSensorSize(params.agentSensorSize), params.decayRate, params.diffusionRate,
+            clampDiffusionSize(params.diffusionSize), trailStride(), trailRange
+        };
+        for (uint32_t species = 0; species < speciesCount; ++species) {
+            SpeciesParameters motion = speciesParameters(params, species);
+            next.speciesMotion[species][0] = motion.agentVelocity;
+            next.speciesMotion[species][1] = motion.agentTurnSpeed;
+            next.speciesMotion[species][2] = motion.agentSensorLength;
+            next.speciesMotion[species][3] = motion.agentSensorAngle;
+            next.speciesDeposit[species] = depositUnits(motion.depositAmount);
+            next.speciesSensorCos[species] = std::cos(motion.agentSensorAngle);
+            next.speciesSensorSin[species] = std::sin(motion.agentSensorAngle);
+            std::copy(params.speciesWeights[species], params.speciesWeights[species] + speciesCount, next.speciesWeights[species]);
+        }
+        // The range is fixed with the stored values, so parameters changed
+        // later can only be warned about
+        const bool unorm = format == TrailFormat::UNORM16 || format == TrailFormat::UNORM8;
+        if (unorm && !trailRangeWarned && trailEquilibrium(params, speciesCount) > trailRange) {
+            trailRangeWarned = true;
+            std::cerr << "Trail values above " << trailRange << " are clipped in " << trailFormatName(format) << ", below "
+                      << trailEquilibrium(params, speciesCount) << ", the value one agent's trail now settles at" << std::endl;
+        }
+        lastParams = params;
+        if (std::memcmp(&next, &simulationBlock, sizeof(next)) != 0) {
+            simulationBlock = next;
+            glBindBuffer(GL_UNIFORM_BUFFER, simulationBlockBuffer);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(next), &next);
+        }
+    }
+
+    void bindTrailMaps() {
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, trailMapBuffers[currentTrailMap]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, trailMapBuffers[currentTrailMap ^ 1]);
+    }
+
+    AgentLayout layout;
+    TrailFormat format;
+    float trailRange;
+    bool trailRangeWarned = false;
+
+    SimulationBlock simulationBlock = {};
+    SimulationParameters lastParams;
+    GLuint simulationBlockBuffer, dispatchBuffer;
+    GLint seedLocation, firstAgentLocation, positionScaleLocation, randomKeyLocation;
+    GLint stepStampLocation, colorizedStampLocation, fusedStampLocation, ditherKeyLocation, colorizeLocation;
+    GLsync batchFence = nullptr;
+    GLsync presentFence = nullptr;
+
+    GLuint agentsBuffer, sortedAgentsBuffer, tileOffsetsBuffer, depositsBuffer, trailMapBlurBuffer, sensorSumsBuffer;
+    GLuint tileStateBuffer, tileListBuffer;
+    // Frames are colorized into one display texture while present() shows
+    // the other. Each knows whether it holds a whole frame, and the step it
+    // is from.
+    struct DisplayTexture {
+        GLuint texture, framebuffer;
+        bool colorized;
+        uint32_t colorizedStep;
+    };
+    DisplayTexture displays[2] = {};
+    int displaySlot = 0;
+    // Stamp of the last step whose column pass colorized
+    uint32_t fusedStamp = 0;
+    uint32_t binCount;
+    GLuint stageQueries[2][STAGE_COUNT];
+    bool stageQueryPending[2][STAGE_COUNT] = {};
+    std::chrono::high_resolution_clock::time_point stageQueryStart[2][STAGE_COUNT];
+    int stageQuerySlot[STAGE_COUNT] = {};
+    GLuint trailMapBuffers[2];
+    int currentTrailMap = 0;
+    GLuint initAgentsProgram, updateAgentsProgram, blurTrailMapProgram, processTrailMapProgram, renderTrailMapProgram;
+    GLuint countTilesProgram, scanTilesProgram, scatterAgentsProgram, sumSensorRowsProgram, sumSensorColumnsProgram;
+    GLuint classifyTilesProgram, listTilesProgram, listChangedTilesProgram, renderTilesProgram;
+    GLuint packTrailMapProgram, unpackTrailMapProgram;
+    // The sensed field, obstacle distances and nearest free pixels of the
+    // environment, 0 when absent, and the defines the agent kernels were
+    // compiled with for them
+    GLuint environmentTextures[3] = {};
+    std::string agentProgramDefines;
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "checkpoint.h"
+#include "gpu_backend.h"
+#include "recorder.h"
+
+// Asynchronous readback for recording from the GPU backend. Each capture
+// copies the display texture (or the trail map) into the next pixel buffer
+// of a ring and fences it; poll() maps the buffers whose fence has signalled
+// and queues their contents. A capture that finds every buffer still in
+// flight is dropped, so the loop never waits on the GPU.
+class GpuFrameReadback : public FrameCapture {
+public:
+    GpuFrameReadback(FrameRecorder &recorder, GpuSimulation &simulation, size_t slotCount = 3)
+        : FrameCapture(recorder), simulation(simulation), slots(slotCount) {
+        for (Slot &slot : slots) {
+            glGenBuffers(1, &slot.buffer);
+        }
+    }
+
+    ~GpuFrameReadback() override {
+        for (Slot &slot : slots) {
+            if (slot.fence) {
+                glDeleteSync(slot.fence);
+            }
+            glDeleteBuffers(1, &slot.buffer);
+        }
+    }
+
+    void capture(uint64_t index) override {
+        poll(false);
+        if (pending == slots.size()) {
+            recorder.drop();
+            return;
+        }
+
+        Slot &slot = slots[(first + pending) % slots.size()];
+        slot.index = index;
+        slot.width = simulation.gridWidth();
+        slot.height = simulation.gridHeight();
+        slot.channels = recorder.wantsTrailMap() ? simulation.species() : 1;
+        size_t bytes = size_t(slot.width) * slot.height * slot.channels * 4;
+
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+        if (slot.bytes != bytes) {
+            glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+            slot.bytes = bytes;
+        }
+        if (recorder.wantsTrailMap()) {
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+            glBindBuffer(GL_COPY_READ_BUFFER, simulation.trailMapBufferId());
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_PIXEL_PACK_BUFFER, 0, 0, bytes);
+        } else {
+            glMemoryBarrier(GL_FRAMEBUFFER_BARRIER_BIT);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, simulation.displayFramebufferId());
+            glReadPixels(0, 0, slot.width, slot.height, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        ++pending;
+    }
+
+    void poll(bool wait) override {
+        while (pending) {
+            Slot &slot = slots[first];
+            GLenum status = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_TIMEOUT_IGNORED : 0);
+            if (status == GL_TIMEOUT_EXPIRED) {
+                return;
+            }
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+            first = (first + 1) % slots.size();
+            --pending;
+
+            RecordedFrame *frame = recorder.acquire();
+            if (!frame) {
+                continue;
+            }
+            frame->index = slot.index;
+            frame->width = slot.width;
+            frame->height = slot.height;
+            frame->channels = slot.channels;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+            const void *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.bytes, GL_MAP_READ_BIT);
+            if (!data) {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                recorder.release(frame);
+                recorder.drop();
+                continue;
+            }
+            if (recorder.wantsTrailMap()) {
+                frame->trail.resize(slot.bytes / sizeof(float));
+                std::memcpy(frame->trail.data(), data, slot.bytes);
+            } else {
+                frame->display.resize(slot.bytes / sizeof(uint32_t));
+                std::memcpy(frame->display.data(), data, slot.bytes);
+            }
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            recorder.submit(frame);
+        }
+    }
+
+private:
+    struct Slot {
+        GLuint buffer = 0;
+        size_t bytes = 0;
+        GLsync fence = nullptr;
+        uint64_t index = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t channels = 1;
+    };
+
+    GpuSimulation &simulation;
+    std::vector<Slot> slots;
+    size_t first = 0;
+    size_t pending = 0;
+};
+
+// Checkpoints from the GPU backend. save() copies the agents and the trail
+// map into a staging buffer on the GPU and fences it; poll() maps it once the
+// fence has signalled and hands the data to the writer thread.
+class GpuCheckpoint : public CheckpointCapture {
+public:
+    explicit GpuCheckpoint(GpuSimulation &simulation) : simulation(simulation) {
+        glGenBuffers(1, &stagingBuffer);
+    }
+
+    ~GpuCheckpoint() override {
+        if (fence) {
+            glDeleteSync(fence);
+        }
+        glDeleteBuffers(1, &stagingBuffer);
+    }
+
+    bool save(const std::string &path, uint32_t seed, const SimulationParameters &params) override {
+        if (fence || writer.busy()) {
+            return false;
+        }
+        target = path;
+        header = makeCheckpointHeader(simulation, seed, params);
+        size_t bytes = size_t(header.agentBytes + header.trailBytes);
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stagingBuffer);
+        if (stagingBytes != bytes) {
+            glBufferData(GL_COPY_WRITE_BUFFER, bytes, nullptr, GL_STREAM_READ);
+            stagingBytes = bytes;
+        }
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        simulation.copyAgentData(0);
+        glBindBuffer(GL_COPY_READ_BUFFER, simulation.trailMapBufferId());
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, header.agentBytes, header.trailBytes);
+        fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        return true;
+    }
+
+    void poll(bool wait) override {
+        if (!fence) {
+            return;
+        }
+        GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_TIMEOUT_IGNORED : 0);
+        if (status == GL_TIMEOUT_EXPIRED) {
+            return;
+        }
+        glDeleteSync(fence);
+        fence = nullptr;
+
+        std::vector<unsigned char> &data = writer.buffer();
+        data.resize(sizeof(header) + stagingBytes);
+        std::memcpy(data.data(), &header, sizeof(header));
+        glBindBuffer(GL_COPY_WRITE_BUFFER, stagingBuffer);
+        const void *staged = glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, stagingBytes, GL_MAP_READ_BIT);
+        if (!staged) {
+            std::cerr << "Failed to map the checkpoint staging buffer" << std::endl;
+            return;
+        }
+        std::memcpy(data.data() + sizeof(header), staged, stagingBytes);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        writer.start(target);
+    }
+
+private:
+    GpuSimulation &simulation;
+    GLuint stagingBuffer;
+    size_t stagingBytes = 0;
+    GLsync fence = nullptr;
+    CheckpointHeader header;
+    std::string target;
+};
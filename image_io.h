@@ -0,0 +1,404 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Writes the packed 0x00RRGGBB display buffer as a binary PPM. Rows are
+// flipped so the image matches what the window shows.
+inline bool writeDisplayPPM(const std::string &path, uint32_t width, uint32_t height, const uint32_t *display) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    std::vector<unsigned char> row(size_t(width) * 3);
+    for (uint32_t y = height; y-- > 0;) {
+        const uint32_t *pixels = display + size_t(y) * width;
+        for (uint32_t x = 0; x < width; ++x) {
+            row[x * 3 + 0] = (pixels[x] >> 16) & 0xFF;
+            row[x * 3 + 1] = (pixels[x] >> 8) & 0xFF;
+            row[x * 3 + 2] = pixels[x] & 0xFF;
+        }
+        fwrite(row.data(), 1, row.size(), file);
+    }
+
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+// The next number of a PNM header, skipping whitespace and # comments.
+inline bool readPNMNumber(FILE *file, uint32_t &out) {
+    int c = fgetc(file);
+    while (c == '#' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+        if (c == '#') {
+            while (c != '\n' && c != EOF) {
+                c = fgetc(file);
+            }
+        }
+        c = fgetc(file);
+    }
+    if (c < '0' || c > '9') {
+        return false;
+    }
+    uint64_t value = 0;
+    for (; c >= '0' && c <= '9' && value <= 0xFFFFFFFF; c = fgetc(file)) {
+        value = value * 10 + uint32_t(c - '0');
+    }
+    out = uint32_t(value);
+    // The single whitespace character after the number is consumed with it
+    return value <= 0xFFFFFFFF && (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+// Reads a binary PGM or PPM (P5 or P6, up to 16 bits per sample) as
+// luminance from 0 to 1, colors weighed as in BT.601. Rows are flipped, so
+// row 0 is the bottom like in the display and the trail map.
+inline bool readImagePNM(const std::string &path, uint32_t &width, uint32_t &height, std::vector<float> &luminance) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+
+    char magic[2] = {};
+    uint32_t maxValue = 0;
+    bool ok = fread(magic, 1, 2, file) == 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6') &&
+              readPNMNumber(file, width) && readPNMNumber(file, height) && readPNMNumber(file, maxValue) &&
+              width > 0 && height > 0 && width <= 65536 && height <= 65536 && maxValue > 0 && maxValue <= 65535;
+    if (ok) {
+        const uint32_t channels = magic[1] == '6' ? 3 : 1;
+        const uint32_t sampleBytes = maxValue > 255 ? 2 : 1;
+        std::vector<unsigned char> row(size_t(width) * channels * sampleBytes);
+        luminance.resize(size_t(width) * height);
+        for (uint32_t y = height; ok && y-- > 0;) {
+            ok = fread(row.data(), 1, row.size(), file) == row.size();
+            for (uint32_t x = 0; ok && x < width; ++x) {
+                float samples[3];
+                for (uint32_t channel = 0; channel < channels; ++channel) {
+                    const unsigned char *sample = &row[(size_t(x) * channels + channel) * sampleBytes];
+                    // 16-bit samples are big endian
+                    uint32_t value = sampleBytes == 2 ? uint32_t(sample[0]) << 8 | sample[1] : sample[0];
+                    samples[channel] = std::min(float(value) / float(maxValue), 1.0f);
+                }
+                luminance[size_t(y) * width + x] = channels == 3
+                    ? 0.299f * samples[0] + 0.587f * samples[1] + 0.114f * samples[2]
+                    : samples[0];
+            }
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Every writer below takes the display or trail map as stored, row 0 at the
+// bottom, and flips it so row 0 of the file is the top of the window.
+
+inline void unpackRGB(const uint32_t *pixels, uint32_t width, unsigned char *rgb) {
+    for (uint32_t x = 0; x < width; ++x) {
+        rgb[x * 3 + 0] = (pixels[x] >> 16) & 0xFF;
+        rgb[x * 3 + 1] = (pixels[x] >> 8) & 0xFF;
+        rgb[x * 3 + 2] = pixels[x] & 0xFF;
+    }
+}
+
+// One 4:4:4 YUV4MPEG2 frame, BT.601 studio range. The stream header is
+// written once by writeY4MHeader.
+inline bool writeY4MHeader(FILE *file, uint32_t width, uint32_t height, uint32_t frameRate) {
+    return fprintf(file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", width, height, frameRate) > 0;
+}
+
+inline bool writeY4MFrame(FILE *file, uint32_t width, uint32_t height, const uint32_t *display) {
+    std::vector<unsigned char> planes(size_t(width) * height * 3);
+    unsigned char *yPlane = planes.data();
+    unsigned char *uPlane = yPlane + size_t(width) * height;
+    unsigned char *vPlane = uPlane + size_t(width) * height;
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint32_t *pixels = display + size_t(height - 1 - row) * width;
+        for (uint32_t x = 0; x < width; ++x) {
+            int r = (pixels[x] >> 16) & 0xFF, g = (pixels[x] >> 8) & 0xFF, b = pixels[x] & 0xFF;
+            size_t i = size_t(row) * width + x;
+            yPlane[i] = static_cast<unsigned char>(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+            uPlane[i] = static_cast<unsigned char>(128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8));
+            vPlane[i] = static_cast<unsigned char>(128 + ((112 * r - 94 * g - 18 * b + 128) >> 8));
+        }
+    }
+    fputs("FRAME\n", file);
+    fwrite(planes.data(), 1, planes.size(), file);
+    return ferror(file) == 0;
+}
+
+inline uint32_t crc32(const unsigned char *data, size_t size, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static bool initialized = false;
+    if (!initialized) {
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        initialized = true;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+inline void putBigEndian(std::vector<unsigned char> &out, uint32_t value) {
+    out.push_back(value >> 24);
+    out.push_back((value >> 16) & 0xFF);
+    out.push_back((value >> 8) & 0xFF);
+    out.push_back(value & 0xFF);
+}
+
+inline void writePNGChunk(FILE *file, const char *type, const std::vector<unsigned char> &data) {
+    std::vector<unsigned char> chunk;
+    putBigEndian(chunk, uint32_t(data.size()));
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    putBigEndian(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+    fwrite(chunk.data(), 1, chunk.size(), file);
+}
+
+// 8-bit RGB PNG. The zlib stream uses stored blocks: no compression, but no
+// dependency either, and the writer thread never becomes the bottleneck.
+inline bool writeDisplayPNG(const std::string &path, uint32_t width, uint32_t height, const uint32_t *display) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    fwrite(signature, 1, sizeof(signature), file);
+
+    std::vector<unsigned char> header;
+    putBigEndian(header, width);
+    putBigEndian(header, height);
+    header.insert(header.end(), { 8, 2, 0, 0, 0 });
+    writePNGChunk(file, "IHDR", header);
+
+    // Filter byte 0 in front of every row
+    const size_t stride = size_t(width) * 3 + 1;
+    std::vector<unsigned char> raw(stride * height);
+    for (uint32_t row = 0; row < height; ++row) {
+        raw[row * stride] = 0;
+        unpackRGB(display + size_t(height - 1 - row) * width, width, &raw[row * stride + 1]);
+    }
+
+    std::vector<unsigned char> deflate = { 0x78, 0x01 };
+    uint32_t a = 1, b = 0;
+    for (size_t offset = 0; offset < raw.size();) {
+        size_t length = std::min<size_t>(raw.size() - offset, 65535);
+        bool last = offset + length == raw.size();
+        deflate.push_back(last ? 1 : 0);
+        deflate.push_back(length & 0xFF);
+        deflate.push_back(length >> 8);
+        deflate.push_back(~length & 0xFF);
+        deflate.push_back((~length >> 8) & 0xFF);
+        deflate.insert(deflate.end(), raw.begin() + offset, raw.begin() + offset + length);
+        for (size_t i = offset; i < offset + length; ++i) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        offset += length;
+    }
+    putBigEndian(deflate, (b << 16) | a);
+    writePNGChunk(file, "IDAT", deflate);
+    writePNGChunk(file, "IEND", {});
+
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+// The Quite OK Image format, RGB.
+inline bool writeDisplayQOI(const std::string &path, uint32_t width, uint32_t height, const uint32_t *display) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    std::vector<unsigned char> out = { 'q', 'o', 'i', 'f' };
+    putBigEndian(out, width);
+    putBigEndian(out, height);
+    out.insert(out.end(), { 3, 0 });
+
+    uint32_t index[64] = {};
+    uint32_t previous = 0xFF000000;
+    int run = 0;
+    for (uint32_t row = 0; row < height; ++row) {
+        const uint32_t *pixels = display + size_t(height - 1 - row) * width;
+        for (uint32_t x = 0; x < width; ++x) {
+            uint32_t pixel = (pixels[x] & 0xFFFFFF) | 0xFF000000;
+            if (pixel == previous) {
+                if (++run == 62) {
+                    out.push_back(0xC0 | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run) {
+                out.push_back(0xC0 | (run - 1));
+                run = 0;
+            }
+
+            int r = (pixel >> 16) & 0xFF, g = (pixel >> 8) & 0xFF, b = pixel & 0xFF;
+            int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+            if (index[hash] == pixel) {
+                out.push_back(hash);
+            } else {
+                index[hash] = pixel;
+                int dr = int8_t(r - ((previous >> 16) & 0xFF));
+                int dg = int8_t(g - ((previous >> 8) & 0xFF));
+                int db = int8_t(b - (previous & 0xFF));
+                int drg = dr - dg, dbg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out.push_back(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+                } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                    out.push_back(0x80 | (dg + 32));
+                    out.push_back(((drg + 8) << 4) | (dbg + 8));
+                } else {
+                    out.insert(out.end(), { 0xFE, (unsigned char)r, (unsigned char)g, (unsigned char)b });
+                }
+            }
+            previous = pixel;
+        }
+    }
+    if (run) {
+        out.push_back(0xC0 | (run - 1));
+    }
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+
+    fwrite(out.data(), 1, out.size(), file);
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
+
+// Round to nearest even; values beyond the half range become infinity.
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7FFFFFFF;
+    if (magnitude >= 0x7F800000) {
+        return uint16_t(sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0));
+    }
+    if (magnitude >= 0x477FF000) {
+        return uint16_t(sign | 0x7C00);
+    }
+    if (magnitude < 0x38800000) {
+        // Subnormal half, or zero
+        if (magnitude < 0x33000000) {
+            return uint16_t(sign);
+        }
+        uint32_t exponent = magnitude >> 23;
+        uint32_t mantissa = (magnitude & 0x7FFFFF) | 0x800000;
+        uint32_t shift = 126 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (remainder > midpoint || (remainder == midpoint && (half & 1))) {
+            ++half;
+        }
+        return uint16_t(sign | half);
+    }
+    uint32_t half = ((magnitude - 0x38000000) >> 13);
+    uint32_t remainder = magnitude & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) {
+        ++half;
+    }
+    return uint16_t(sign | half);
+}
+
+inline void putLittleEndian(std::vector<unsigned char> &out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        out.push_back((value >> (8 * i)) & 0xFF);
+    }
+}
+
+inline void putEXRAttribute(std::vector<unsigned char> &out, const char *name, const char *type, const std::vector<unsigned char> &value) {
+    out.insert(out.end(), name, name + strlen(name) + 1);
+    out.insert(out.end(), type, type + strlen(type) + 1);
+    putLittleEndian(out, value.size(), 4);
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// The raw trail map as half floats in an uncompressed scanline OpenEXR file,
+// one scanline per block. A single channel is written as "Y", several
+// interleaved channels as "S0", "S1", ... one per species.
+inline bool writeTrailMapEXR(const std::string &path, uint32_t width, uint32_t height, uint32_t channels, const float *trail) {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+
+    std::vector<unsigned char> header = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+    std::vector<unsigned char> value;
+    for (uint32_t channel = 0; channel < channels; ++channel) {
+        if (channels == 1) {
+            value.push_back('Y');
+        } else {
+            value.push_back('S');
+            value.push_back(char('0' + channel));
+        }
+        value.push_back(0);
+        putLittleEndian(value, 1, 4);       // HALF
+        putLittleEndian(value, 0, 4);       // pLinear and reserved
+        putLittleEndian(value, 1, 4);       // xSampling
+        putLittleEndian(value, 1, 4);       // ySampling
+    }
+    value.push_back(0);
+    putEXRAttribute(header, "channels", "chlist", value);
+    putEXRAttribute(header, "compression", "compression", { 0 });
+
+    value.clear();
+    putLittleEndian(value, 0, 4);
+    putLittleEndian(value, 0, 4);
+    putLittleEndian(value, width - 1, 4);
+    putLittleEndian(value, height - 1, 4);
+    putEXRAttribute(header, "dataWindow", "box2i", value);
+    putEXRAttribute(header, "displayWindow", "box2i", value);
+    putEXRAttribute(header, "lineOrder", "lineOrder", { 0 });
+
+    const float one = 1.0f;
+    value.assign(reinterpret_cast<const unsigned char *>(&one), reinterpret_cast<const unsigned char *>(&one) + 4);
+    putEXRAttribute(header, "pixelAspectRatio", "float", value);
+    putEXRAttribute(header, "screenWindowWidth", "float", value);
+    putEXRAttribute(header, "screenWindowCenter", "v2f", std::vector<unsigned char>(8, 0));
+    header.push_back(0);
+
+    // Offset table, then one block per scanline: y, byte count, then the
+    // row of each channel in turn
+    const size_t blockSize = 8 + size_t(width) * channels * 2;
+    const size_t firstBlock = header.size() + size_t(height) * 8;
+    for (uint32_t y = 0; y < height; ++y) {
+        putLittleEndian(header, firstBlock + y * blockSize, 8);
+    }
+    fwrite(header.data(), 1, header.size(), file);
+
+    std::vector<unsigned char> block;
+    for (uint32_t y = 0; y < height; ++y) {
+        const float *row = trail + size_t(height - 1 - y) * width * channels;
+        block.clear();
+        putLittleEndian(block, y, 4);
+        putLittleEndian(block, size_t(width) * channels * 2, 4);
+        for (uint32_t channel = 0; channel < channels; ++channel) {
+            for (uint32_t x = 0; x < width; ++x) {
+                putLittleEndian(block, floatToHalf(row[size_t(x) * channels + channel]), 2);
+            }
+        }
+        fwrite(block.data(), 1, block.size(), file);
+    }
+
+    bool ok = ferror(file) == 0;
+    fclose(file);
+    return ok;
+}
@@ -1,502 +1,920 @@
+#ifndef PHYSARUM_NO_GPU
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#endif
 #include <iostream>
 #include <vector>
+#ifdef _WIN32
 #include <Windows.h>
 #include <commctrl.h>
+#else
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 #include <chrono>
 #include <random>
 #include <cmath>
-#include <glm/glm.hpp>
-#include <glm/gtc/type_ptr.hpp>
-
-struct FPoint2D {
-    float x;
-    float y;
-};
-
-struct Agent {
-    FPoint2D Position;
-    float Rotation;
-};
-
-#define WIDTH 1920
-#define HEIGHT 1080
-#define AGENT_COUNT 10000000
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include "simulation.h"
+#include "options.h"
+#include "autoscale.h"
+#include "image_io.h"
+#include "recorder.h"
+#include "checkpoint.h"
+#include "control.h"
+#include "trace.h"
+#include "cpu_backend.h"
+#include "sweep.h"
+#ifndef _WIN32
+#include "distributed.h"
+#endif
+#ifndef PHYSARUM_NO_GPU
+#include "gl_context.h"
+#include "gpu_backend.h"
+#include "cpu_display.h"
+#include "gpu_readback.h"
+#include "batch_runner.h"
+#endif
+
 #define ERROR_INIT_FAILED -1
+#define ERROR_INVALID_ARGUMENT -2
+#define ERROR_OUTPUT_FAILED -3
+#define ERROR_VALIDATION_FAILED -4
+#define ERROR_TRANSPORT_FAILED -6
+
+// Parameter changes from the --control stream and the Win32 parameter
+// window, picked up by the loop between batches of steps
+ParameterChannel *Controls = nullptr;
+
+// Filled while --trace is given and written when the run ends
+TraceRecorder StageTrace;
+
+// The --restore checkpoint, mapped until the simulation has loaded it
+MappedFile RestoreFile;
+
+// The --obstacles and --attractors maps, shared by every simulation
+EnvironmentMaps Environment;
+
+#ifndef PHYSARUM_NO_GPU
+// Set by the GLFW callbacks and applied between frames: resizing the window
+// resizes the grid, +/- double or halve the population.
+typedef struct ResizeRequest {
+    bool pending;
+    uint32_t width;
+    uint32_t height;
+    uint32_t agentCount;
+} ResizeRequest;
+
+ResizeRequest PendingResize;
+
+void drawStageOverlay(const StageTimes &times, int width, int height);
+void framebufferSizeCallback(GLFWwindow *window, int width, int height);
+void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods);
+#endif
+
+#ifdef _WIN32
+HWND g_hButton;
+HWND g_hSliderAgentVelocity;
+HWND g_hSliderAgentTurnSpeed;
+HWND g_hSliderAgentSensorLength;
+HWND g_hSliderAgentSensorAngle;
+HWND g_hSliderAgentSensorSize;
+HWND g_hSliderDecayRate;
+HWND g_hSliderDiffusionRate;
+HWND g_hSliderDiffusionSize;
 
-// Compute shader sources
-const char* initAgentsSource = R"(
-#version 430
+DWORD WINAPI ThreadProc(LPVOID lpParameter);
+LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+void setParameter(float SimulationParameters::*field, float value);
+#endif
+
+int runHeadless(Simulation &simulation, const Options &options, uint32_t seed, FrameCapture *capture, CheckpointCapture *checkpoint);
+void configureSimulation(Simulation &simulation, const Options &options);
+void startSimulation(Simulation &simulation, uint32_t seed);
+int saveFinalCheckpoint(CheckpointCapture *checkpoint, const Options &options, uint32_t seed, const SimulationParameters &params);
+bool loadEnvironment(const Options &options);
+bool openRecorder(const Options &options, std::unique_ptr<FrameRecorder> &recorder);
+bool openControl(const Options &options, ParameterChannel &channel, std::unique_ptr<ControlServer> &control);
+std::unique_ptr<PopulationController> startAutoscale(Simulation &simulation, const Options &options);
+void autoscalePopulation(Simulation &simulation, PopulationController *autoscale, uint64_t steps, double seconds);
+int finishRecording(std::unique_ptr<FrameRecorder> &recorder, std::unique_ptr<FrameCapture> &capture);
+void printStageTimes(const StageTimes &times);
+int saveTrace(const Options &options);
+#ifndef PHYSARUM_NO_GPU
+int validateDiffusion(const Options &options, uint32_t seed);
+#endif
+int runSweep(const Options &options, uint32_t seed);
+#ifndef _WIN32
+int runDistributed(const Options &options, uint32_t seed);
+int runBands(Transport &transport, const Options &options, uint32_t seed);
+#endif
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        printUsage(argv[0]);
+        return ERROR_INVALID_ARGUMENT;
+    }
 
-layout (local_size_x = 1024) in;
+    // A restored checkpoint brings its own grid, population, layout,
+    // parameters and seed
+    if (!options.restorePath.empty()) {
+        const CheckpointHeader *header = openCheckpoint(options.restorePath, RestoreFile);
+        if (!header) {
+            return ERROR_INVALID_ARGUMENT;
+        }
+        options.width = header->width;
+        options.height = header->height;
+        options.agents = header->agentCount;
+        options.species = header->speciesCount;
+        options.layout = AgentLayout(header->layout);
+        options.params = header->params;
+        options.seed = header->seed;
+        options.hasSeed = true;
+        printf("Restoring step %llu from %s\n", static_cast<unsigned long long>(header->step), options.restorePath.c_str());
+    }
+    if (!resolveTrailRange(options)) {
+        return ERROR_INVALID_ARGUMENT;
+    }
 
-struct FPoint2D {
-    float x;
-    float y;
-};
+    uint32_t seed = options.hasSeed
+        ? static_cast<uint32_t>(options.seed)
+        : static_cast<uint32_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
 
-struct Agent {
-    FPoint2D Position;
-    float Rotation;
-};
+#ifndef _WIN32
+    if (options.ranks > 1 || !options.peers.empty()) {
+        return runDistributed(options, seed);
+    }
+#endif
+    if (!loadEnvironment(options)) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    if (!options.sweep.empty()) {
+        return runSweep(options, seed);
+    }
 
-layout (std430, binding = 0) buffer AgentsBuffer {
-    Agent agents[];
-};
+    std::unique_ptr<FrameRecorder> recorder;
+    std::unique_ptr<FrameCapture> capture;
+    std::unique_ptr<CheckpointCapture> checkpoint;
+    if (!openRecorder(options, recorder)) {
+        return ERROR_OUTPUT_FAILED;
+    }
 
-uniform uint seed;
-uniform uvec2 dimensions;
+    // The CPU backend needs no context at all when nothing is presented
+    if (options.headless && options.backend == Backend::CPU && !options.validateDiffusion) {
+        std::unique_ptr<CpuSimulation> simulation = CpuSimulation::create(options.layout, uint32_t(options.width), uint32_t(options.height), uint32_t(options.agents), static_cast<unsigned>(options.threads), uint32_t(options.species));
+        printf("CPU backend: %u threads, %d SIMD lanes\n", simulation->threadCount(), simd::LANES);
+        configureSimulation(*simulation, options);
+        startSimulation(*simulation, seed);
+        if (recorder) {
+            capture.reset(new SimulationCapture(*recorder, *simulation));
+        }
+        if (!options.checkpointPath.empty()) {
+            checkpoint.reset(new SimulationCheckpoint(*simulation));
+        }
+        int result = runHeadless(*simulation, options, seed, capture.get(), checkpoint.get());
+        int recordResult = finishRecording(recorder, capture);
+        return result ? result : recordResult;
+    }
 
-float random(inout uint state) {
-    state ^= state << 13;
-    state ^= state >> 17;
-    state ^= state << 5;
-    return float(state) / 4294967295.0;
-}
+#ifdef PHYSARUM_NO_GPU
+    std::cerr << "Built without GPU support, only --headless --backend cpu is available" << std::endl;
+    return ERROR_INVALID_ARGUMENT;
+#else
+    GLFWwindow* window = createContextWindow(int(options.width), int(options.height), "Slime Mold Simulation", options.headless);
+    if (!window) {
+        return ERROR_INIT_FAILED;
+    }
 
-void main() {
-    uint idx = gl_GlobalInvocationID.x;
-    if (idx >= agents.length()) return;
-    
-    uint state = seed + idx;
-    float RandomRadius = random(state) * 300;
-    float RandomAngle = (random(state) - 0.5) * 2.0 * 3.14159265359;
-    
-    agents[idx].Position.x = dimensions.x / 2.0 + RandomRadius * cos(RandomAngle);
-    agents[idx].Position.y = dimensions.y / 2.0 + RandomRadius * -sin(RandomAngle);
-    
-    // agents[idx].Rotation = RandomAngle;
-    agents[idx].Rotation = RandomAngle + 3.14159265359;
-}
-)";
-
-const char* updateAgentsSource = R"(
-#version 430
-
-layout (local_size_x = 1024) in;
-
-struct FPoint2D {
-    float x;
-    float y;
-};
-
-struct Agent {
-    FPoint2D Position;
-    float Rotation;
-};
-
-layout (std430, binding = 0) buffer AgentsBuffer {
-    Agent agents[];
-};
-
-layout (std430, binding = 1) buffer TrailMapBuffer {
-    float trailMap[];
-};
-
-uniform float deltaTime;
-uniform float agentVelocity;
-uniform float agentTurnSpeed;
-uniform float agentSensorLength;
-uniform float agentSensorAngle;
-uniform int agentSensorSize;
-uniform uvec2 dimensions;
-
-float sense(FPoint2D position, float rotation, float angle) {
-    float sensorAngle = rotation + angle;
-    FPoint2D sensorPosition = FPoint2D(
-        position.x + agentSensorLength * cos(sensorAngle),
-        position.y + agentSensorLength * -sin(sensorAngle)
-    );
-    
-    float sum = 0.0f;
-    for(int j = -agentSensorSize; j <= agentSensorSize; ++j) {
-        for(int i = -agentSensorSize; i <= agentSensorSize; ++i) {
-            FPoint2D samplePosition = FPoint2D(
-                sensorPosition.x + i,
-                sensorPosition.y + j
-            );
-
-            if (samplePosition.x < 0 || samplePosition.x >= dimensions.x ||
-                samplePosition.y < 0 || samplePosition.y >= dimensions.y) {
-                return 0.0;
+    if (options.headless) {
+        int result;
+        if (options.validateDiffusion) {
+            result = validateDiffusion(options, seed);
+        } else {
+            GpuSimulation simulation(uint32_t(options.width), uint32_t(options.height), uint32_t(options.agents), options.layout, uint32_t(options.species), options.trailFormat, float(options.trailRange));
+            configureSimulation(simulation, options);
+            startSimulation(simulation, seed);
+            if (recorder) {
+                capture.reset(new GpuFrameReadback(*recorder, simulation));
             }
-
-            uint sampleIndex = uint(sensorPosition.y) * dimensions.x + uint(sensorPosition.x);
-
-            sum += trailMap[sampleIndex];
+            if (!options.checkpointPath.empty()) {
+                checkpoint.reset(new GpuCheckpoint(simulation));
+            }
+            result = runHeadless(simulation, options, seed, capture.get(), checkpoint.get());
+            checkpoint.reset();
+            int recordResult = finishRecording(recorder, capture);
+            result = result ? result : recordResult;
         }
-    }    
-    
-    
-    return sum;
-}
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return result;
+    }
 
-void main() {
-    uint idx = gl_GlobalInvocationID.x;
-    if (idx >= agents.length()) return;
-    
-    FPoint2D position = agents[idx].Position;
-    float rotation = agents[idx].Rotation;
-    
-    float forwardSensor = sense(position, rotation, 0);
-    float leftSensor = sense(position, rotation, agentSensorAngle);
-    float rightSensor = sense(position, rotation, -agentSensorAngle);
-    
-    if (forwardSensor > leftSensor && forwardSensor > rightSensor) {
-        // keep going forward
-    } else if (leftSensor > rightSensor) {
-        rotation += agentTurnSpeed;
-    } else if (rightSensor > leftSensor) {
-        rotation -= agentTurnSpeed;
+    // Create the simulation on the selected backend
+    std::unique_ptr<Simulation> simulation;
+    std::unique_ptr<CpuDisplay> cpuDisplay;
+    CpuSimulation *cpuSimulation = nullptr;
+    GpuSimulation *gpuSimulation = nullptr;
+    if (options.backend == Backend::CPU) {
+        cpuSimulation = CpuSimulation::create(options.layout, uint32_t(options.width), uint32_t(options.height), uint32_t(options.agents), static_cast<unsigned>(options.threads), uint32_t(options.species)).release();
+        simulation.reset(cpuSimulation);
+        cpuDisplay.reset(new CpuDisplay(cpuSimulation->gridWidth(), cpuSimulation->gridHeight()));
+        printf("CPU backend: %u threads, %d SIMD lanes\n", cpuSimulation->threadCount(), simd::LANES);
     } else {
-        rotation += (fract(sin(gl_GlobalInvocationID.x) * 43758.5453) - 0.5) * 2.0 * agentTurnSpeed;
+        gpuSimulation = new GpuSimulation(uint32_t(options.width), uint32_t(options.height), uint32_t(options.agents), options.layout, uint32_t(options.species), options.trailFormat, float(options.trailRange));
+        simulation.reset(gpuSimulation);
     }
-    
-    position.x += agentVelocity * cos(rotation);
-    position.y += agentVelocity * -sin(rotation);
-    
-    // Handle boundary conditions
-    if (position.x < 0) position.x = 0;
-    if (position.x >= dimensions.x) position.x = dimensions.x - 1;
-    if (position.y < 0) position.y = 0;
-    if (position.y >= dimensions.y) position.y = dimensions.y - 1;
-    
-    agents[idx].Position = position;
-    agents[idx].Rotation = rotation;
-}
-)";
 
-const char* renderAgentsSource = R"(
-#version 430
+    // Initialize agents
+    configureSimulation(*simulation, options);
+    startSimulation(*simulation, seed);
+
+    // Recorded frames and checkpoints are read back asynchronously on the
+    // GPU, copied on the CPU
+    if (recorder && gpuSimulation) {
+        capture.reset(new GpuFrameReadback(*recorder, *gpuSimulation));
+    } else if (recorder) {
+        capture.reset(new SimulationCapture(*recorder, *simulation));
+    }
+    if (!options.checkpointPath.empty() && gpuSimulation) {
+        checkpoint.reset(new GpuCheckpoint(*gpuSimulation));
+    } else if (!options.checkpointPath.empty()) {
+        checkpoint.reset(new SimulationCheckpoint(*simulation));
+    }
+    uint64_t nextCheckpoint = options.checkpointEvery ? (simulation->currentStep() / options.checkpointEvery + 1) * options.checkpointEvery : 0;
+    uint64_t frameIndex = 0;
 
-layout (local_size_x = 1024) in;
+    SimulationParameters params = options.params;
+    ParameterChannel channel(params);
+    std::unique_ptr<ControlServer> control;
+    if (!openControl(options, channel, control)) {
+        return ERROR_INIT_FAILED;
+    }
+    Controls = &channel;
+    std::unique_ptr<PopulationController> autoscale = startAutoscale(*simulation, options);
+    uint64_t lastBatch = 0;
+
+#ifdef _WIN32
+    DWORD uiThreadId = 0;
+    HANDLE hThread = CreateThread(NULL, 0, ThreadProc, NULL, 0, &uiThreadId);
+#endif
+
+    PendingResize = { false, simulation->gridWidth(), simulation->gridHeight(), simulation->poolSize() };
+    glfwSetFramebufferSizeCallback(window, framebufferSizeCallback);
+    glfwSetKeyCallback(window, keyCallback);
+    
+    // A batch runs while the frame of the one before it is presented, on
+    // the CPU backend on a thread of its own. Frames go to the texture or
+    // pixel buffer slot the display is not showing, so a frame is on
+    // screen one batch after it was computed.
+    BatchRunner batches(*simulation, cpuSimulation != nullptr);
+    bool framePending = false;
 
-struct FPoint2D {
-    float x;
-    float y;
-};
+    auto lastTime = std::chrono::high_resolution_clock::now();
+    auto lastReport = lastTime;
+    auto nextPresent = lastTime;
+    auto presentInterval = std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+        std::chrono::duration<double>(options.displayRate > 0.0 ? 1.0 / options.displayRate : 0.0));
+    StageTimes shownTimes;
+    char title[256];
+    while (!glfwWindowShouldClose(window)) {
+        // Compute delta time
+        auto currentTime = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<float> elapsedTime = currentTime - lastTime;
+        lastTime = currentTime;
+        float deltaTime = elapsedTime.count();
+        autoscalePopulation(*simulation, autoscale.get(), lastBatch, deltaTime);
+
+        // Apply a pending resize without restarting the simulation; the
+        // frame not yet shown is dropped with the old display
+        if (PendingResize.pending) {
+            PendingResize.pending = false;
+            // A resize activates the whole pool; the autoscaler keeps the
+            // population it had found
+            const uint32_t population = simulation->population();
+            simulation->resize(PendingResize.width, PendingResize.height, PendingResize.agentCount, seed);
+            if (autoscale) {
+                simulation->setPopulation(std::min(population, PendingResize.agentCount));
+            }
+            if (cpuDisplay) {
+                cpuDisplay->resize(PendingResize.width, PendingResize.height);
+            }
+            glViewport(0, 0, PendingResize.width, PendingResize.height);
+            framePending = false;
+            printf("Resized to %u x %u, %u agents\n", PendingResize.width, PendingResize.height, simulation->population());
+        }
 
-struct Agent {
-    FPoint2D Position;
-    float Rotation;
-};
+        // Update agents, render them to the trail map and process it, a
+        // whole batch of steps at a time. A batch that is presented
+        // colorizes in its last diffusion pass, on the CPU straight into
+        // the mapped pixel buffer.
+        const bool presenting = currentTime >= nextPresent;
+        if (presenting && cpuDisplay) {
+            cpuSimulation->setDisplayTarget(cpuDisplay->frame());
+        }
+        channel.consume(params);
+        batches.start(params, options.stepsPerFrame, presenting);
+        lastBatch = options.stepsPerFrame;
+
+        // Blit the frame of an earlier batch to the screen meanwhile
+        if (framePending) {
+            framePending = false;
+            simulation->beginStage(STAGE_PRESENT);
+            int framebufferWidth, framebufferHeight;
+            glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+            if (gpuSimulation) {
+                gpuSimulation->present(framebufferWidth, framebufferHeight);
+            } else {
+                cpuDisplay->present(framebufferWidth, framebufferHeight);
+            }
+            if (options.stageTimes) {
+                drawStageOverlay(shownTimes, framebufferWidth, framebufferHeight);
+            }
 
-layout (std430, binding = 0) buffer AgentsBuffer {
-    Agent agents[];
-};
+            // Swap buffers
+            glfwSwapBuffers(window);
+            simulation->endStage(STAGE_PRESENT);
+        }
+        batches.wait();
+
+        // Autosave; a checkpoint still being written defers the next one
+        if (checkpoint) {
+            checkpoint->poll(false);
+            if (nextCheckpoint && simulation->currentStep() >= nextCheckpoint
+                && checkpoint->save(options.checkpointPath, seed, params)) {
+                nextCheckpoint = (simulation->currentStep() / options.checkpointEvery + 1) * options.checkpointEvery;
+            }
+        }
 
-layout (std430, binding = 1) buffer TrailMapBuffer {
-    float trailMap[];
-};
+        // Between frames of the display rate only the simulation runs
+        if (!presenting) {
+            glfwPollEvents();
+            continue;
+        }
+        nextPresent = std::max(nextPresent + presentInterval, currentTime);
 
-uniform uvec2 dimensions;
+        // The batch colorized its frame; record it and hand it to the display
+        if (capture) {
+            capture->capture(frameIndex);
+        }
+        ++frameIndex;
+        if (gpuSimulation) {
+            gpuSimulation->finishFrame();
+        } else {
+            cpuDisplay->finishFrame();
+        }
+        framePending = true;
+
+        // Report stage times once per second, in the console and the title bar
+        if (options.stageTimes && currentTime - lastReport >= std::chrono::seconds(1)) {
+            shownTimes = simulation->stageTimes();
+            printStageTimes(shownTimes);
+            int length = snprintf(title, sizeof(title), "Slime Mold Simulation -");
+            for (int stage = 0; stage < STAGE_COUNT && length < int(sizeof(title)); ++stage) {
+                if (shownTimes.calls[stage]) {
+                    length += snprintf(title + length, sizeof(title) - length, " %s %.2f ms", stageName(stage), shownTimes.average(stage));
+                }
+            }
+            glfwSetWindowTitle(window, title);
+            simulation->resetStageTimes();
+        }
+        if (currentTime - lastReport >= std::chrono::seconds(1)) {
+            if (recorder) {
+                recorder->printStatus();
+            }
+            lastReport = currentTime;
+        }
 
-void main() {
-    uint idx = gl_GlobalInvocationID.x;
-    if (idx >= agents.length()) return;
-    
-    FPoint2D position = agents[idx].Position;
-    
-    if (position.x >= 0 && position.x < dimensions.x &&
-        position.y >= 0 && position.y < dimensions.y) {
-        uint trailIndex = uint(position.y) * dimensions.x + uint(position.x);
-        trailMap[trailIndex] = 1.0;
+        // Poll for and process events
+        glfwPollEvents();
     }
-}
-)";
-
-const char* processTrailMapSource = R"(
-#version 430
-
-layout (local_size_x = 1024) in;
-
-layout (std430, binding = 1) buffer TrailMapBuffer {
-    float trailMap[];
-};
 
-layout (std430, binding = 2) buffer TrailMapCopyBuffer {
-    float trailMapCopy[];
-};
+    // Clean up
+    simulation->finish();
+    if (autoscale && autoscale->measuredRate() > 0.0) {
+        printf("Autoscale: %u agents at %.2f steps/s\n", simulation->population(), autoscale->measuredRate());
+    }
+    int result = saveTrace(options);
+    int recordResult = finishRecording(recorder, capture);
+    int checkpointResult = saveFinalCheckpoint(checkpoint.get(), options, seed, params);
+    checkpoint.reset();
+    result = result ? result : (recordResult ? recordResult : checkpointResult);
+    simulation.reset();
+    cpuDisplay.reset();
+
+    control.reset();
+#ifdef _WIN32
+    // The parameter window publishes to the channel until it has quit
+    PostThreadMessage(uiThreadId, WM_QUIT, 0, 0);
+    WaitForSingleObject(hThread, INFINITE);
+    CloseHandle(hThread);
+#endif
+    Controls = nullptr;
 
-uniform float decayRate;
-uniform float diffusionRate;
-uniform uvec2 dimensions;
-uniform int diffusionSize;
+    glfwDestroyWindow(window);
+    glfwTerminate();
 
-void main() {
-    uint idx = gl_GlobalInvocationID.x;
-    if (idx >= dimensions.x * dimensions.y) return;
+    return result;
+#endif
+}
 
-    uint x = idx % dimensions.x;
-    uint y = idx / dimensions.x;
-    
-    float sum = 0.0;
-    
-    for (int j = -diffusionSize; j <= diffusionSize; ++j) {
-        for (int i = -diffusionSize; i <= diffusionSize; ++i) {
-            int nx = int(x) + i;
-            int ny = int(y) + j;
-            if (nx >= 0 && nx < dimensions.x && ny >= 0 && ny < dimensions.y) {
-                uint neighborIdx = ny * dimensions.x + nx;
-                sum += trailMapCopy[neighborIdx];
-            }
+#ifndef PHYSARUM_NO_GPU
+// Stacked bar along the top edge with one colour per stage, in stage order.
+// The full window width is one 60 Hz frame.
+void drawStageOverlay(const StageTimes &times, int width, int height) {
+    static const float colors[STAGE_COUNT][3] = {
+        { 0.6f, 0.6f, 0.6f }, { 0.9f, 0.3f, 0.2f }, { 0.9f, 0.8f, 0.2f },
+        { 0.2f, 0.6f, 0.9f }, { 0.7f, 0.3f, 0.9f }, { 0.9f, 0.9f, 0.9f }
+    };
+    const int barHeight = std::min(12, height);
+
+    glEnable(GL_SCISSOR_TEST);
+    int x = 0;
+    for (int stage = 0; stage < STAGE_COUNT && x < width; ++stage) {
+        int barWidth = int(times.average(stage) / (1000.0 / 60.0) * width);
+        if (barWidth <= 0) {
+            continue;
         }
+        glScissor(x, height - barHeight, std::min(barWidth, width - x), barHeight);
+        glClearColor(colors[stage][0], colors[stage][1], colors[stage][2], 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        x += barWidth;
     }
-    float blur = sum / ((diffusionSize * 2 + 1)*(diffusionSize * 2 + 1));
-    float diffused = mix(trailMap[idx], blur, diffusionRate);
-    trailMap[idx] = diffused * decayRate;
+    glDisable(GL_SCISSOR_TEST);
 }
-)";
-
-const char* renderTrailMapSource = R"(
-#version 430
 
-layout (local_size_x = 1024) in;
+void framebufferSizeCallback(GLFWwindow *window, int width, int height) {
+    (void)window;
+    if (width > 0 && height > 0) {
+        PendingResize.width = width;
+        PendingResize.height = height;
+        PendingResize.pending = true;
+    }
+}
 
-layout (std430, binding = 1) buffer TrailMapBuffer {
-    float trailMap[];
-};
+void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+    (void)window;
+    (void)scancode;
+    (void)mods;
+    if (action != GLFW_PRESS) {
+        return;
+    }
+    if (key == GLFW_KEY_EQUAL || key == GLFW_KEY_KP_ADD) {
+        PendingResize.agentCount = PendingResize.agentCount > 0x7FFFFFFF ? 0xFFFFFFFF : PendingResize.agentCount * 2;
+        PendingResize.pending = true;
+    } else if ((key == GLFW_KEY_MINUS || key == GLFW_KEY_KP_SUBTRACT) && PendingResize.agentCount > 1) {
+        PendingResize.agentCount /= 2;
+        PendingResize.pending = true;
+    }
+}
+#endif
+
+void configureSimulation(Simulation &simulation, const Options &options) {
+    // The GPU scatter places agents of a tile in arrival order, and an
+    // agent's random numbers follow its slot
+    if (options.deterministic && options.backend == Backend::GPU && options.sortEvery) {
+        printf("Deterministic mode: sorting is off on the GPU backend\n");
+        simulation.setSortEvery(0);
+    } else {
+        simulation.setSortEvery(options.sortEvery);
+    }
+    simulation.enableStageTiming(options.stageTimes || !options.tracePath.empty());
+    simulation.setTrace(options.tracePath.empty() ? nullptr : &StageTrace);
+    printf("Agent layout %s: %.1f MB\n", agentLayoutName(options.layout),
+        simulation.population() * agentLayoutBytes(options.layout) / (1024.0 * 1024.0));
+    if (options.trailFormat != TrailFormat::FP32) {
+        printf("Trail format %s: %.1f MB per map\n", trailFormatName(options.trailFormat),
+            double(simulation.gridWidth()) * simulation.gridHeight() * simulation.species() * trailFormatBytes(options.trailFormat) / (1024.0 * 1024.0));
+        if (options.trailRange > 0.0) {
+            printf("Trail values stored from 0 to %g\n", options.trailRange);
+        }
+    }
+    if (simulation.species() > 1) {
+        printf("%u species, one trail channel each\n", simulation.species());
+    }
+    if (Environment.hasObstacles() || Environment.hasAttractors()) {
+        simulation.setEnvironment(&Environment);
+    }
+}
 
-layout (std430, binding = 3) buffer DisplayBuffer {
-    uint display[];
-};
+bool loadEnvironment(const Options &options) {
+    if (!options.obstaclesPath.empty()) {
+        if (!Environment.loadObstacles(options.obstaclesPath)) {
+            std::cerr << "Failed to read obstacles from " << options.obstaclesPath << std::endl;
+            return false;
+        }
+        printf("Obstacles from %s\n", options.obstaclesPath.c_str());
+    }
+    if (!options.attractorsPath.empty()) {
+        if (!Environment.loadAttractors(options.attractorsPath, float(options.attractorStrength), uint32_t(options.attractorLevels))) {
+            std::cerr << "Failed to read attractors from " << options.attractorsPath << std::endl;
+            return false;
+        }
+        printf("Attractors from %s: strength %g over %llu mip levels\n", options.attractorsPath.c_str(),
+            options.attractorStrength, static_cast<unsigned long long>(options.attractorLevels));
+    }
+    return true;
+}
 
-uniform uvec2 dimensions;
+// Seeds the agents, or loads them from the --restore checkpoint.
+void startSimulation(Simulation &simulation, uint32_t seed) {
+    if (RestoreFile.data()) {
+        restoreCheckpoint(simulation, RestoreFile);
+        RestoreFile.close();
+    } else {
+        simulation.initAgents(seed);
+    }
+}
 
-uvec3 encodeColor(float value) {
-    uint intensity = uint(value * 255);
-    return uvec3(0, intensity, 0);
+// Waits for an autosave in progress, then writes the final state.
+int saveFinalCheckpoint(CheckpointCapture *checkpoint, const Options &options, uint32_t seed, const SimulationParameters &params) {
+    if (!checkpoint) {
+        return 0;
+    }
+    checkpoint->finish();
+    checkpoint->save(options.checkpointPath, seed, params);
+    if (!checkpoint->finish()) {
+        return ERROR_OUTPUT_FAILED;
+    }
+    printf("Wrote checkpoint %s\n", options.checkpointPath.c_str());
+    return 0;
 }
 
-void main() {
-    uint idx = gl_GlobalInvocationID.x;
-    if (idx >= dimensions.x * dimensions.y) return;
+bool openRecorder(const Options &options, std::unique_ptr<FrameRecorder> &recorder) {
+    if (options.recordTarget.empty()) {
+        return true;
+    }
+    recorder = FrameRecorder::open(options.recordTarget, size_t(options.recordQueue), uint32_t(options.recordFps));
+    return recorder != nullptr;
+}
 
-    float trailValue = trailMap[idx];
-    uvec3 color = encodeColor(trailValue);
-    display[idx] = (color.r << 16) | (color.g << 8) | color.b;
+// Starts the --control reader that feeds channel.
+bool openControl(const Options &options, ParameterChannel &channel, std::unique_ptr<ControlServer> &control) {
+    if (options.controlSource.empty()) {
+        return true;
+    }
+    control = ControlServer::open(options.controlSource, channel, uint32_t(options.species));
+    return control != nullptr;
 }
-)";
 
-GLuint compileShader(const char* source, GLenum type) {
-    GLuint shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, nullptr);
-    glCompileShader(shader);
-    
-    GLint status;
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if (status != GL_TRUE) {
-        char buffer[512];
-        glGetShaderInfoLog(shader, 512, nullptr, buffer);
-        std::cerr << "Shader compile error: " << buffer << std::endl;
-        exit(-1);
-    }
-    return shader;
+// With --target-rate, shrinks the population to where the controller starts.
+std::unique_ptr<PopulationController> startAutoscale(Simulation &simulation, const Options &options) {
+    if (options.targetRate <= 0.0) {
+        return nullptr;
+    }
+    std::unique_ptr<PopulationController> autoscale(new PopulationController(options.targetRate, uint32_t(options.minAgents)));
+    simulation.setPopulation(autoscale->initialPopulation(simulation.poolSize()));
+    printf("Autoscale: %.2f steps/s target, starting at %u of %u agents\n", options.targetRate,
+        simulation.population(), simulation.poolSize());
+    return autoscale;
 }
 
-GLuint createComputeProgram(const char* source) {
-    GLuint program = glCreateProgram();
-    GLuint shader = compileShader(source, GL_COMPUTE_SHADER);
-    glAttachShader(program, shader);
-    glLinkProgram(program);
-    glDeleteShader(shader);
-
-    GLint status;
-    glGetProgramiv(program, GL_LINK_STATUS, &status);
-    if (status != GL_TRUE) {
-        char buffer[512];
-        glGetProgramInfoLog(program, 512, nullptr, buffer);
-        std::cerr << "Program link error: " << buffer << std::endl;
-        exit(-1);
-    }
-    return program;
+// Feeds the last batch to the controller and applies the count it picks.
+void autoscalePopulation(Simulation &simulation, PopulationController *autoscale, uint64_t steps, double seconds) {
+    if (!autoscale) {
+        return;
+    }
+    uint32_t count = autoscale->update(steps, seconds, simulation.population(), simulation.poolSize());
+    if (count) {
+        printf("Autoscale: %.2f steps/s at %u agents, now %u\n", autoscale->measuredRate(), simulation.population(), count);
+        simulation.setPopulation(count);
+    }
 }
 
-typedef struct WindowParam {
-    float *agentVelocity;
-    float *agentTurnSpeed;
-    float *agentSensorLength;
-    float *agentSensorAngle;
-    float *agentSensorSize;
+// Waits for readbacks still in flight and lets the writer drain its queue.
+int finishRecording(std::unique_ptr<FrameRecorder> &recorder, std::unique_ptr<FrameCapture> &capture) {
+    if (!recorder) {
+        return 0;
+    }
+    if (capture) {
+        capture->poll(true);
+        capture.reset();
+    }
+    bool ok = recorder->close();
+    recorder.reset();
+    return ok ? 0 : ERROR_OUTPUT_FAILED;
+}
 
-    float *decayRate;
-    float *diffusionRate;
-    float *diffusionSize;
-} WindowParam;
+int saveTrace(const Options &options) {
+    if (options.tracePath.empty()) {
+        return 0;
+    }
+    if (!StageTrace.write(options.tracePath)) {
+        std::cerr << "Failed to write " << options.tracePath << std::endl;
+        return ERROR_OUTPUT_FAILED;
+    }
+    printf("Wrote trace to %s\n", options.tracePath.c_str());
+    return 0;
+}
 
-HWND g_hButton;
-HWND g_hSliderAgentVelocity;
-HWND g_hSliderAgentTurnSpeed;
-HWND g_hSliderAgentSensorLength;
-HWND g_hSliderAgentSensorAngle;
-HWND g_hSliderAgentSensorSize;
-HWND g_hSliderDecayRate;
-HWND g_hSliderDiffusionRate;
-HWND g_hSliderDiffusionSize;
-WindowParam WindowParameter;
+void printStageTimes(const StageTimes &times) {
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        if (times.calls[stage]) {
+            printf("%s %.3f ms  ", stageName(stage), times.average(stage));
+        }
+    }
+    printf("\n");
+}
 
-DWORD WINAPI ThreadProc(LPVOID lpParameter);
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+#ifndef PHYSARUM_NO_GPU
+// Runs the GPU pipeline for the requested steps, then diffuses the resulting
+// trail map once on each backend and compares the two.
+int validateDiffusion(const Options &options, uint32_t seed) {
+    GpuSimulation gpuSimulation(uint32_t(options.width), uint32_t(options.height), uint32_t(options.agents), options.layout, uint32_t(options.species));
+    std::unique_ptr<CpuSimulation> cpuSimulation = CpuSimulation::create(AgentLayout::AOS, uint32_t(options.width), uint32_t(options.height), 0, static_cast<unsigned>(options.threads), uint32_t(options.species));
 
-int main() {
-    // Initialize GLFW
-    if (!glfwInit()) {
-        std::cerr << "Failed to initialize GLFW" << std::endl;
-        return ERROR_INIT_FAILED;
+    gpuSimulation.initAgents(seed);
+    for (uint64_t step = 0; step < options.steps; ++step) {
+        gpuSimulation.step(options.params);
     }
 
-    // Create a windowed mode window and its OpenGL context
-    GLFWwindow* window = glfwCreateWindow(WIDTH, HEIGHT, "Slime Mold Simulation", nullptr, nullptr);
-    if (!window) {
-        std::cerr << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return ERROR_INIT_FAILED;
+    std::vector<float> trail, expected, actual;
+    gpuSimulation.readTrailMap(trail);
+    // Written back too, so both diffuse every tile rather than the active ones
+    gpuSimulation.writeTrailMap(trail.data());
+    cpuSimulation->writeTrailMap(trail.data());
+
+    gpuSimulation.processTrailMap(options.params);
+    cpuSimulation->processTrailMap(options.params);
+    gpuSimulation.readTrailMap(actual);
+    cpuSimulation->readTrailMap(expected);
+
+    // Deposits accumulate, so trail values can grow past 1 and the error is
+    // taken relative to them
+    float maxError = 0.0f;
+    for (size_t i = 0; i < expected.size(); ++i) {
+        maxError = std::max(maxError, std::fabs(expected[i] - actual[i]) / std::max(1.0f, std::fabs(expected[i])));
     }
+    printf("Diffusion radius %d: max relative error %g between GPU and CPU\n",
+        clampDiffusionSize(options.params.diffusionSize), maxError);
+    return maxError <= 1e-5f ? 0 : ERROR_VALIDATION_FAILED;
+}
+#endif
 
-    // Make the window's context current
-    glfwMakeContextCurrent(window);
-    glfwSwapInterval(0);
+int runHeadless(Simulation &simulation, const Options &options, uint32_t seed, FrameCapture *capture, CheckpointCapture *checkpoint) {
+    std::vector<uint32_t> display;
+    char path[1024];
 
-    // Initialize GLEW
-    glewExperimental = GL_TRUE;
-    if (glewInit() != GLEW_OK) {
-        std::cerr << "Failed to initialize GLEW" << std::endl;
+    // Recording without --output-every captures every step
+    const uint64_t outputEvery = options.outputEvery || !capture ? options.outputEvery : 1;
+    const uint64_t checkpointEvery = checkpoint ? options.checkpointEvery : 0;
+
+    // Steps count on from a restored checkpoint
+    const uint64_t lastStep = simulation.currentStep() + options.steps;
+
+    SimulationParameters params = options.params;
+    ParameterChannel channel(params);
+    std::unique_ptr<ControlServer> control;
+    if (!openControl(options, channel, control)) {
         return ERROR_INIT_FAILED;
     }
-    printf("OpenGL Version: %s\n", glGetString(GL_VERSION));
-
-    // Create and bind SSBOs for agents and trail map
-    GLuint agentsBuffer, trailMapBuffer, trailMapCopyBuffer, displayBuffer;
-    glGenBuffers(1, &agentsBuffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, agentsBuffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, AGENT_COUNT * sizeof(Agent), nullptr, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, agentsBuffer);
-
-    glGenBuffers(1, &trailMapBuffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, trailMapBuffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, WIDTH * HEIGHT * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, trailMapBuffer);
-
-    glGenBuffers(1, &trailMapCopyBuffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, trailMapCopyBuffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, WIDTH * HEIGHT * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, trailMapCopyBuffer);
-
-    glGenBuffers(1, &displayBuffer);
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, displayBuffer);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, WIDTH * HEIGHT * sizeof(uint32_t), nullptr, GL_DYNAMIC_DRAW);
-    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, displayBuffer);
-
-    // Create compute programs
-    GLuint initAgentsProgram = createComputeProgram(initAgentsSource);
-    GLuint updateAgentsProgram = createComputeProgram(updateAgentsSource);
-    GLuint renderAgentsProgram = createComputeProgram(renderAgentsSource);
-    GLuint processTrailMapProgram = createComputeProgram(processTrailMapSource);
-    GLuint renderTrailMapProgram = createComputeProgram(renderTrailMapSource);
 
-    // Initialize agents
-    glUseProgram(initAgentsProgram);
-    glUniform1ui(glGetUniformLocation(initAgentsProgram, "seed"), static_cast<uint32_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count()));
-    glUniform2uiv(glGetUniformLocation(initAgentsProgram, "dimensions"), 1, glm::value_ptr(glm::uvec2(WIDTH, HEIGHT)));
-    glDispatchCompute((AGENT_COUNT + 1023) / 1024, 1, 1);
-    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-
-    float agentVelocity = 1.0f;
-    float agentTurnSpeed = 0.2f;
-    float agentSensorLength = 10.0f;
-    float agentSensorAngle = 0.0174532925f * 20.0f;
-    float agentSensorSize = 0;
-
-    float decayRate = 0.999f;
-    float diffusionRate = 0.13f;
-    float diffusionSize = 1;
-
-    WindowParameter = {
-        .agentVelocity = &agentVelocity,
-        .agentTurnSpeed = &agentTurnSpeed,
-        .agentSensorLength = &agentSensorLength,
-        .agentSensorAngle = &agentSensorAngle,
-        .agentSensorSize = &agentSensorSize,
-        .decayRate = &decayRate,
-        .diffusionRate = &diffusionRate,
-        .diffusionSize = &diffusionSize
-    };
+    std::unique_ptr<PopulationController> autoscale = startAutoscale(simulation, options);
+    uint64_t lastBatch = 0;
+    double agentUpdates = 0.0;
 
-    HANDLE hThread = CreateThread(NULL, 0, ThreadProc, NULL, 0, NULL);
-    
-    auto lastTime = std::chrono::high_resolution_clock::now();
-    while (!glfwWindowShouldClose(window)) {
-        // Compute delta time
+    auto startTime = std::chrono::high_resolution_clock::now();
+    auto lastTime = startTime;
+    for (uint64_t step = simulation.currentStep(); step < lastStep;) {
         auto currentTime = std::chrono::high_resolution_clock::now();
         std::chrono::duration<float> elapsedTime = currentTime - lastTime;
         lastTime = currentTime;
-        float deltaTime = elapsedTime.count();
+        autoscalePopulation(simulation, autoscale.get(), lastBatch, elapsedTime.count());
 
+        // Batches never run past the next frame written out or checkpoint
+        uint64_t batch = std::min(options.stepsPerFrame, lastStep - step);
+        if (outputEvery) {
+            batch = std::min(batch, outputEvery - step % outputEvery);
+        }
+        if (checkpointEvery) {
+            batch = std::min(batch, checkpointEvery - step % checkpointEvery);
+        }
+        // A batch that ends on a frame colorizes in its last step
+        const bool output = outputEvery && (step + batch) % outputEvery == 0;
+        channel.consume(params);
+        simulation.advance(params, batch, output);
+        step += batch;
+        lastBatch = batch;
+        agentUpdates += double(batch) * simulation.population();
+
+        if (checkpoint) {
+            checkpoint->poll(false);
+            if (checkpointEvery && step % checkpointEvery == 0 && !checkpoint->save(options.checkpointPath, seed, params)) {
+                printf("Skipped the checkpoint at step %llu, the previous one is still being written\n", static_cast<unsigned long long>(step));
+            }
+        }
 
-        // Update agents
-        glUseProgram(updateAgentsProgram);
-        glUniform1f(glGetUniformLocation(updateAgentsProgram, "deltaTime"), deltaTime);
-        glUniform1f(glGetUniformLocation(updateAgentsProgram, "agentVelocity"), agentVelocity);
-        glUniform1f(glGetUniformLocation(updateAgentsProgram, "agentTurnSpeed"), agentTurnSpeed);
-        glUniform1f(glGetUniformLocation(updateAgentsProgram, "agentSensorLength"), agentSensorLength);
-        glUniform1f(glGetUniformLocation(updateAgentsProgram, "agentSensorAngle"), agentSensorAngle);
-        glUniform1i(glGetUniformLocation(updateAgentsProgram, "agentSensorSize"), agentSensorSize);
-        glUniform2uiv(glGetUniformLocation(updateAgentsProgram, "dimensions"), 1, glm::value_ptr(glm::uvec2(WIDTH, HEIGHT)));
-        glDispatchCompute((AGENT_COUNT + 1023) / 1024, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-
-        // Render agents to trail map
-        glUseProgram(renderAgentsProgram);
-        glUniform2uiv(glGetUniformLocation(renderAgentsProgram, "dimensions"), 1, glm::value_ptr(glm::uvec2(WIDTH, HEIGHT)));
-        glDispatchCompute((AGENT_COUNT + 1023) / 1024, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-
-        // Process trail map
-        glUseProgram(processTrailMapProgram);
-        glUniform1f(glGetUniformLocation(processTrailMapProgram, "decayRate"), decayRate);
-        glUniform1f(glGetUniformLocation(processTrailMapProgram, "diffusionRate"), diffusionRate);
-        glUniform1i(glGetUniformLocation(processTrailMapProgram, "diffusionSize"), diffusionSize);
-        glUniform2uiv(glGetUniformLocation(processTrailMapProgram, "dimensions"), 1, glm::value_ptr(glm::uvec2(WIDTH, HEIGHT)));
-        glDispatchCompute((WIDTH * HEIGHT + 1023) / 1024, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-
-        // Render trail map to display buffer
-        glUseProgram(renderTrailMapProgram);
-        glUniform2uiv(glGetUniformLocation(renderTrailMapProgram, "dimensions"), 1, glm::value_ptr(glm::uvec2(WIDTH, HEIGHT)));
-        glDispatchCompute((WIDTH * HEIGHT + 1023) / 1024, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-
-        // Render display buffer to screen
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, displayBuffer);
-        glDrawPixels(WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-
-        // Swap buffers
-        glfwSwapBuffers(window);
+        if (output) {
+            simulation.renderTrailMap();
+            // Headless runs present by writing the frame out, or by handing
+            // it to the recorder
+            simulation.beginStage(STAGE_PRESENT);
+            if (capture) {
+                capture->capture(step);
+                simulation.endStage(STAGE_PRESENT);
+                continue;
+            }
+            simulation.readDisplay(display);
+            snprintf(path, sizeof(path), "%s_%06llu.ppm", options.outputPrefix.c_str(), static_cast<unsigned long long>(step));
+            if (!writeDisplayPPM(path, simulation.gridWidth(), simulation.gridHeight(), display.data())) {
+                std::cerr << "Failed to write " << path << std::endl;
+                return ERROR_OUTPUT_FAILED;
+            }
+            simulation.endStage(STAGE_PRESENT);
+        }
+    }
+    if (capture) {
+        capture->poll(true);
+    }
+    simulation.finish();
+
+    std::chrono::duration<double> totalTime = std::chrono::high_resolution_clock::now() - startTime;
+    double seconds = totalTime.count();
+    double stepsPerSecond = seconds > 0.0 ? options.steps / seconds : 0.0;
+    printf("%llu steps in %.3f s: %.2f steps/s, %.3g agent updates/s\n",
+        static_cast<unsigned long long>(options.steps), seconds, stepsPerSecond, seconds > 0.0 ? agentUpdates / seconds : 0.0);
+    if (autoscale && autoscale->measuredRate() > 0.0) {
+        printf("Autoscale: %u agents at %.2f steps/s\n", simulation.population(), autoscale->measuredRate());
+    }
+    if (options.stageTimes) {
+        printStageTimes(simulation.stageTimes());
+    }
+    control.reset();
+    int result = saveFinalCheckpoint(checkpoint, options, seed, params);
+    int traceResult = saveTrace(options);
+    return result ? result : traceResult;
+}
 
-        // Poll for and process events
-        glfwPollEvents();
+// Runs every variant of the sweep, then prints and saves their summaries.
+int runSweep(const Options &options, uint32_t seed) {
+    ParameterSweep sweep(options, Environment.hasObstacles() || Environment.hasAttractors() ? &Environment : nullptr);
+    printf("Sweep of %zu variants on %u threads, %ux%u with %llu agents, %llu steps each\n", sweep.variantCount(),
+        sweep.threadCount(), unsigned(options.width), unsigned(options.height), static_cast<unsigned long long>(options.agents),
+        static_cast<unsigned long long>(options.steps));
+
+    std::vector<ParameterSweep::Result> results;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    bool written = sweep.run(seed, results);
+    std::chrono::duration<double> totalTime = std::chrono::high_resolution_clock::now() - startTime;
+
+    for (size_t variant = 0; variant < results.size(); ++variant) {
+        const ParameterSweep::Result &result = results[variant];
+        printf("%4zu", variant);
+        for (size_t axis = 0; axis < options.sweep.size(); ++axis) {
+            printf("  %s %g", options.sweep[axis].name.c_str(), result.values[axis]);
+        }
+        printf(": %.2f steps/s, mean %.4g, peak %.4g, coverage %.1f%%\n", result.stepsPerSecond, result.summary.mean,
+            result.summary.peak, result.summary.coverage * 100.0);
+    }
+    double seconds = totalTime.count();
+    double steps = double(options.steps) * results.size();
+    printf("%.0f steps in %.3f s: %.2f steps/s, %.3g agent updates/s over all variants\n", steps, seconds,
+        seconds > 0.0 ? steps / seconds : 0.0, seconds > 0.0 ? steps * options.agents / seconds : 0.0);
+
+    std::string summaryPath = options.outputPrefix + ".csv";
+    if (!sweep.writeSummary(summaryPath, results)) {
+        std::cerr << "Failed to write " << summaryPath << std::endl;
+        return ERROR_OUTPUT_FAILED;
     }
+    return written ? 0 : ERROR_OUTPUT_FAILED;
+}
 
-    // Clean up
-    glDeleteBuffers(1, &agentsBuffer);
-    glDeleteBuffers(1, &trailMapBuffer);
-    glDeleteBuffers(1, &trailMapCopyBuffer);
-    glDeleteBuffers(1, &displayBuffer);
-    glDeleteProgram(initAgentsProgram);
-    glDeleteProgram(updateAgentsProgram);
-    glDeleteProgram(renderAgentsProgram);
-    glDeleteProgram(processTrailMapProgram);
-    glDeleteProgram(renderTrailMapProgram);
+#ifndef _WIN32
+// Runs one band per rank. Without --peers this process is rank 0 and forks
+// the others, which connect over Unix sockets in a temporary directory.
+int runDistributed(const Options &options, uint32_t seed) {
+    const int ranks = int(options.ranks);
+    int rank = int(options.rank);
+    std::vector<std::string> addresses;
+    std::string directory;
+    std::vector<pid_t> children;
+    if (options.peers.empty()) {
+        char pattern[] = "/tmp/physarum-XXXXXX";
+        if (!mkdtemp(pattern)) {
+            std::cerr << "Failed to create a directory for the rank sockets" << std::endl;
+            return ERROR_INIT_FAILED;
+        }
+        directory = pattern;
+        for (int i = 0; i < ranks; ++i) {
+            addresses.push_back(directory + "/rank" + std::to_string(i));
+        }
+        // Nothing buffered may be printed twice
+        fflush(stdout);
+        for (int child = 1; child < ranks; ++child) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                rank = child;
+                children.clear();
+                directory.clear();
+                break;
+            }
+            if (pid < 0) {
+                std::cerr << "Failed to start rank " << child << std::endl;
+                break;
+            }
+            children.push_back(pid);
+        }
+    } else {
+        size_t start = 0;
+        while (true) {
+            size_t comma = options.peers.find(',', start);
+            addresses.push_back(options.peers.substr(start, comma - start));
+            if (comma == std::string::npos) {
+                break;
+            }
+            start = comma + 1;
+        }
+    }
 
-    CloseHandle(hThread);
+    std::unique_ptr<SocketTransport> transport = SocketTransport::connect(addresses, rank);
+    int result = transport ? runBands(*transport, options, seed) : ERROR_INIT_FAILED;
+    transport.reset();
 
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    for (pid_t child : children) {
+        int status = 0;
+        if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            result = result ? result : ERROR_TRANSPORT_FAILED;
+        }
+    }
+    if (!directory.empty()) {
+        rmdir(directory.c_str());
+    }
+    return result;
+}
+
+// The loop of runHeadless for one rank. Rank 0 writes the frames and prints
+// the results; the others only report errors.
+int runBands(Transport &transport, const Options &options, uint32_t seed) {
+    const bool lead = transport.rank() == 0;
+    // Ranks on other machines drew their own clock seed
+    bool ok = lead || transport.receive(0, &seed, sizeof(seed));
+    for (int rank = 1; rank < transport.size() && lead && ok; ++rank) {
+        ok = transport.send(rank, &seed, sizeof(seed));
+    }
+    if (!ok) {
+        return ERROR_TRANSPORT_FAILED;
+    }
+
+    std::unique_ptr<DistributedSimulation> simulation = DistributedSimulation::create(transport, options.layout,
+        uint32_t(options.width), uint32_t(options.height), static_cast<unsigned>(options.threads), options.params);
+    if (!simulation) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    CpuSimulation &local = simulation->local();
+    local.enableStageTiming(options.stageTimes);
+    simulation->setSortEvery(options.sortEvery);
+    simulation->initAgents(seed, uint32_t(options.agents));
+    if (lead) {
+        printf("%d ranks: bands of about %u rows with %u halo rows, %u threads each\n", transport.size(),
+            uint32_t(options.height / transport.size()), simulation->haloSize(), local.threadCount());
+    }
 
+    std::vector<uint32_t> display;
+    char path[1024];
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (uint64_t step = 1; step <= options.steps; ++step) {
+        if (!simulation->step(options.params)) {
+            return ERROR_TRANSPORT_FAILED;
+        }
+        if (options.outputEvery && step % options.outputEvery == 0) {
+            if (!simulation->gatherDisplay(display)) {
+                return ERROR_TRANSPORT_FAILED;
+            }
+            snprintf(path, sizeof(path), "%s_%06llu.ppm", options.outputPrefix.c_str(), static_cast<unsigned long long>(step));
+            if (lead && !writeDisplayPPM(path, uint32_t(options.width), uint32_t(options.height), display.data())) {
+                std::cerr << "Failed to write " << path << std::endl;
+                return ERROR_OUTPUT_FAILED;
+            }
+        }
+    }
+    std::chrono::duration<double> totalTime = std::chrono::high_resolution_clock::now() - startTime;
+
+    std::vector<RankStatistics> ranks;
+    if (!simulation->gatherStatistics(ranks)) {
+        return ERROR_TRANSPORT_FAILED;
+    }
+    if (!lead) {
+        return 0;
+    }
+    double seconds = totalTime.count();
+    double stepsPerSecond = seconds > 0.0 ? options.steps / seconds : 0.0;
+    printf("%llu steps in %.3f s: %.2f steps/s, %.3g agent updates/s\n",
+        static_cast<unsigned long long>(options.steps), seconds, stepsPerSecond, stepsPerSecond * options.agents);
+    for (size_t rank = 0; rank < ranks.size(); ++rank) {
+        printf("Rank %zu: rows %u-%u, %u agents, %.3f ms/step exchanging\n", rank, ranks[rank].bandFirst,
+            ranks[rank].bandLast - 1, ranks[rank].agents, ranks[rank].exchangeMilliseconds / std::max<uint64_t>(options.steps, 1));
+    }
+    if (options.stageTimes) {
+        printStageTimes(local.stageTimes());
+    }
     return 0;
 }
+#endif
 
+#ifdef _WIN32
 DWORD WINAPI ThreadProc(LPVOID lpParameter) {
     HINSTANCE hInstance = GetModuleHandle(NULL);
 
@@ -578,16 +996,23 @@ DWORD WINAPI ThreadProc(LPVOID lpParameter) {
     ShowWindow(hWnd, SW_SHOW);
     UpdateWindow(hWnd);
 
-    // Message loop
+    // Message loop; GetMessage sleeps until there is input
     MSG msg = {0};
-    while (true) {
-        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
-        }
+    while (GetMessage(&msg, NULL, 0, 0) > 0) {
+        TranslateMessage(&msg);
+        DispatchMessage(&msg);
     }
+    DestroyWindow(hWnd);
+
+    return (DWORD)msg.wParam;
+}
 
-    return msg.wParam;
+// Publishes a slider change through the parameter channel.
+void setParameter(float SimulationParameters::*field, float value) {
+    Controls->update([&](SimulationParameters &params) {
+        params.*field = value;
+        return true;
+    });
 }
 
 // Window procedure
@@ -602,42 +1027,42 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
             WCHAR buffer[10];
 
             if (hSlider == g_hSliderAgentVelocity) {
-                *WindowParameter.agentVelocity = pos / 10.0f;
+                setParameter(&SimulationParameters::agentVelocity, pos / 10.0f);
                 swprintf(buffer, 10, L"%.1f", pos / 10.0f);
                 SetWindowTextW(GetDlgItem(hWnd, 1), buffer);
             }
             else if (hSlider == g_hSliderAgentTurnSpeed) {
-                *WindowParameter.agentTurnSpeed = pos / 100.0f;
+                setParameter(&SimulationParameters::agentTurnSpeed, pos / 100.0f);
                 swprintf(buffer, 10, L"%.2f", pos / 100.0f);
                 SetWindowTextW(GetDlgItem(hWnd, 2), buffer);
             }
             else if (hSlider == g_hSliderAgentSensorLength) {
-                *WindowParameter.agentSensorLength = pos;
+                setParameter(&SimulationParameters::agentSensorLength, pos);
                 swprintf(buffer, 10, L"%d", pos);
                 SetWindowTextW(GetDlgItem(hWnd, 3), buffer);
             }
             else if (hSlider == g_hSliderAgentSensorAngle) {
-                *WindowParameter.agentSensorAngle = pos * 0.0174532925f;
+                setParameter(&SimulationParameters::agentSensorAngle, pos * 0.0174532925f);
                 swprintf(buffer, 10, L"%d", pos);
                 SetWindowTextW(GetDlgItem(hWnd, 4), buffer);
             }
             else if (hSlider == g_hSliderAgentSensorSize) {
-                *WindowParameter.agentSensorSize = pos;
+                setParameter(&SimulationParameters::agentSensorSize, pos);
                 swprintf(buffer, 10, L"%d", pos);
                 SetWindowTextW(GetDlgItem(hWnd, 5), buffer);
             }
             else if (hSlider == g_hSliderDecayRate) {
-                *WindowParameter.decayRate = pos / 1000.0f;
+                setParameter(&SimulationParameters::decayRate, pos / 1000.0f);
                 swprintf(buffer, 10, L"%.3f", pos / 1000.0f);
                 SetWindowTextW(GetDlgItem(hWnd, 6), buffer);
             }
             else if (hSlider == g_hSliderDiffusionRate) {
-                *WindowParameter.diffusionRate = pos / 100.0f;
+                setParameter(&SimulationParameters::diffusionRate, pos / 100.0f);
                 swprintf(buffer, 10, L"%.2f", pos / 100.0f);
                 SetWindowTextW(GetDlgItem(hWnd, 7), buffer);
             }
             else if (hSlider == g_hSliderDiffusionSize) {
-                *WindowParameter.diffusionSize = pos;
+                setParameter(&SimulationParameters::diffusionSize, pos);
                 swprintf(buffer, 10, L"%d", pos);
                 SetWindowTextW(GetDlgItem(hWnd, 8), buffer);
             }
@@ -648,3 +1073,4 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
     }
     return 0;
 }
+#endif
@@ -0,0 +1,573 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "environment.h"
+#include "simulation.h"
+
+enum class Backend {
+    GPU,
+    CPU
+};
+
+constexpr uint64_t NO_SEED = ~uint64_t(0);
+
+// One parameter of a --sweep and the values it takes, in command line units
+struct SweepAxis {
+    std::string name;
+    std::vector<float> values;
+};
+
+struct Options {
+#ifdef PHYSARUM_NO_GPU
+    Backend backend = Backend::CPU;
+    bool headless = true;
+#else
+    Backend backend = Backend::GPU;
+    bool headless = false;
+#endif
+    uint64_t threads = 0;
+    uint64_t width = 1920;
+    uint64_t height = 1080;
+    uint64_t agents = 10000000;
+    uint64_t species = 1;
+    // Above 0, --agents is a pool and the active count is steered towards
+    // this many steps per second, never below minAgents
+    double targetRate = 0.0;
+    uint64_t minAgents = 1024;
+    AgentLayout layout = AgentLayout::AOS;
+    TrailFormat trailFormat = TrailFormat::FP32;
+    // Top of the unorm trail formats' values; 0 until resolveTrailRange()
+    // picks the default
+    double trailRange = 0.0;
+
+    uint64_t steps = 1000;
+    uint64_t stepsPerFrame = 1;
+    double displayRate = 0.0;
+    uint64_t outputEvery = 0;
+    std::string outputPrefix = "frame";
+
+    std::string recordTarget;
+    uint64_t recordQueue = 8;
+    uint64_t recordFps = 60;
+
+    std::string checkpointPath;
+    uint64_t checkpointEvery = 0;
+    std::string restorePath;
+
+    // "-" for stdin, or the path of a Unix socket
+    std::string controlSource;
+
+    bool validateDiffusion = false;
+
+    uint64_t sortEvery = 0;
+    bool stageTimes = false;
+    std::string tracePath;
+
+    // Distributed runs: --ranks forks the ranks on this machine, --peers
+    // lists where each rank listens and --rank picks this process's entry
+    uint64_t ranks = 1;
+    uint64_t rank = 0;
+    std::string peers;
+
+    // Parameter sweeps run every combination of these as its own simulation
+    std::vector<SweepAxis> sweep;
+
+    // Environment maps, see EnvironmentMaps
+    std::string obstaclesPath;
+    std::string attractorsPath;
+    double attractorStrength = 1.0;
+    uint64_t attractorLevels = 6;
+
+    bool hasSeed = false;
+    uint64_t seed = NO_SEED;
+    bool deterministic = false;
+
+    SimulationParameters params;
+};
+
+inline void printUsage(const char *program) {
+    std::cerr <<
+        "Usage: " << program << " [options]\n"
+        "  --backend gpu|cpu          simulation backend (default gpu, cpu-only builds: cpu)\n"
+        "  --threads N                CPU backend worker threads (default: all cores)\n"
+        "  --width N, --height N      grid size in pixels (default 1920 x 1080)\n"
+        "  --agents N                 number of agents (default 10000000)\n"
+        "  --target-rate HZ           grow or shrink the active agents, up to --agents, to hold this many\n"
+        "                             steps per second (default 0: fixed count)\n"
+        "  --min-agents N             fewest agents --target-rate may shrink to (default 1024)\n"
+        "  --species N                species sharing the agents, 1 to 4 (default 1); each one deposits\n"
+        "                             into its own trail channel\n"
+        "  --agent-layout aos|soa|compact\n"
+        "                             agent memory layout (default aos; compact: 16-bit fixed point)\n"
+        "  --trail-format fp32|fp16|unorm16|unorm8\n"
+        "                             gpu: trail map storage (default fp32)\n"
+        "  --trail-range R            unorm16 and unorm8 hold trail values 0 to R (default 64 times\n"
+        "                             deposit / (1 - decay rate), what one agent settles at)\n"
+        "  --headless                 run without a window or presentation\n"
+        "  --steps-per-frame N        simulation steps run back to back between frames (default 1)\n"
+        "  --display-rate HZ          colorize and present at most this often, stepping in between\n"
+        "                             (default 0: after every batch of steps)\n"
+        "  --steps N                  headless: number of steps to run (default 1000)\n"
+        "  --output-every N           headless: write a frame every N steps (0 = never)\n"
+        "  --output PREFIX            headless: frame file prefix (default frame)\n"
+        "  --record TARGET            record presented frames (headless: every --output-every steps) to\n"
+        "                             FILE.y4m, \"|command\" (Y4M on its stdin), or PREFIX.png, .qoi,\n"
+        "                             .ppm or .exr (the raw trail map as half floats)\n"
+        "  --record-queue N           frames waiting for the writer before captures are dropped (default 8)\n"
+        "  --record-fps N             frame rate in the Y4M header (default 60)\n"
+        "  --checkpoint FILE          save the simulation to FILE at exit, and every --checkpoint-every steps\n"
+        "  --checkpoint-every N       autosave interval in steps (0 = only at exit)\n"
+        "  --restore FILE             resume from a checkpoint; its grid, agents, parameters and seed\n"
+        "                             replace the corresponding options\n"
+        "  --control -|SOCKET         take parameter changes as JSON lines, e.g. {\"agent-velocity\": 2}, from\n"
+        "                             stdin (-) or clients of a Unix socket; applied between batches of steps\n"
+        "  --sort-every N             sort agents by screen tile every N steps (0 = never)\n"
+        "  --stage-times              print average time per stage, and show it on screen\n"
+        "  --trace FILE               write per-stage timings as a Chrome trace (chrome://tracing, Perfetto)\n"
+        "  --validate-diffusion       run --steps on the GPU, then compare one diffusion step against the CPU\n"
+        "  --ranks N                  split the grid into N bands of rows, one process each, forked on this\n"
+        "                             machine; runs headless on the CPU backend with a single species\n"
+        "  --peers LIST               comma separated address of every rank, host:port or a Unix socket path,\n"
+        "                             for a run across machines; start one process per entry\n"
+        "  --rank N                   this process's entry in --peers (default 0)\n"
+        "  --sweep NAME=V1,V2,...     run a simulation for every combination of the values of each --sweep\n"
+        "                             parameter, e.g. --sweep decay-rate=0.9,0.95 --sweep agent-velocity=1,2;\n"
+        "                             headless on the CPU backend, one thread per simulation, writing\n"
+        "                             PREFIX_VVVV_SSSSSS.ppm frames and a PREFIX.csv summary\n"
+        "  --obstacles FILE           binary PGM/PPM whose bright pixels are walls the agents cannot cross,\n"
+        "                             stretched over the grid\n"
+        "  --attractors FILE          binary PGM/PPM added to what the sensors read, e.g. food sources\n"
+        "  --attractor-strength F     sensor reading of a full-brightness attractor (default 1)\n"
+        "  --attractor-levels N       mip levels the attractors are averaged over, each reaching twice as\n"
+        "                             far, 0 to 16 (default 6)\n"
+        "  --seed N                   agent initialization seed, 0 to 4294967295 (default: clock)\n"
+        "  --deterministic            reproducible runs: requires --seed, and turns off GPU sorting, whose\n"
+        "                             order within a tile varies from run to run\n"
+        "  --agent-velocity F\n"
+        "  --agent-turn-speed F\n"
+        "  --agent-sensor-length F\n"
+        "  --agent-sensor-angle DEG\n"
+        "  --agent-sensor-size N\n"
+        "  --deposit-amount F         trail each agent adds where it lands per step (default 0.001)\n"
+        "  --decay-rate F\n"
+        "  --diffusion-rate F\n"
+        "  --diffusion-size N\n"
+        "  --species-K-velocity F, --species-K-turn-speed F, --species-K-sensor-length F,\n"
+        "  --species-K-sensor-angle DEG, --species-K-deposit-amount F\n"
+        "                             species K = 1 to 3; species 0 uses the --agent-* and --deposit-amount\n"
+        "                             values\n"
+        "  --species-weight-S-C F     how species S weighs trail channel C when sensing (default 1 for its\n"
+        "                             own channel, -1 for the others)\n";
+}
+
+inline bool parseBackend(const std::string &name, Backend &out) {
+    if (name == "gpu") {
+        out = Backend::GPU;
+    } else if (name == "cpu") {
+        out = Backend::CPU;
+    } else {
+        std::cerr << "Unknown backend: " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline bool parseAgentLayout(const std::string &name, AgentLayout &out) {
+    if (name == "aos") {
+        out = AgentLayout::AOS;
+    } else if (name == "soa") {
+        out = AgentLayout::SOA;
+    } else if (name == "compact") {
+        out = AgentLayout::COMPACT;
+    } else {
+        std::cerr << "Unknown agent layout: " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline bool parseTrailFormat(const std::string &name, TrailFormat &out) {
+    if (name == "fp32") {
+        out = TrailFormat::FP32;
+    } else if (name == "fp16") {
+        out = TrailFormat::FP16;
+    } else if (name == "unorm16") {
+        out = TrailFormat::UNORM16;
+    } else if (name == "unorm8") {
+        out = TrailFormat::UNORM8;
+    } else {
+        std::cerr << "Unknown trail format: " << name << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Finite numbers only: strtod also reads nan and inf, which would get past
+// every range check.
+inline bool parseNumber(const char *text, double &out) {
+    char *end = nullptr;
+    out = std::strtod(text, &end);
+    return end != text && *end == '\0' && std::isfinite(out);
+}
+
+inline bool parseCount(const char *text, uint64_t &out) {
+    char *end = nullptr;
+    out = std::strtoull(text, &end, 10);
+    return end != text && *end == '\0' && text[0] != '-';
+}
+
+inline uint64_t *countOption(Options &options, const std::string &name) {
+    if (name == "--threads") return &options.threads;
+    if (name == "--width") return &options.width;
+    if (name == "--height") return &options.height;
+    if (name == "--agents") return &options.agents;
+    if (name == "--min-agents") return &options.minAgents;
+    if (name == "--species") return &options.species;
+    if (name == "--steps") return &options.steps;
+    if (name == "--output-every") return &options.outputEvery;
+    if (name == "--seed") return &options.seed;
+    if (name == "--sort-every") return &options.sortEvery;
+    if (name == "--steps-per-frame") return &options.stepsPerFrame;
+    if (name == "--record-queue") return &options.recordQueue;
+    if (name == "--record-fps") return &options.recordFps;
+    if (name == "--checkpoint-every") return &options.checkpointEvery;
+    if (name == "--ranks") return &options.ranks;
+    if (name == "--rank") return &options.rank;
+    if (name == "--attractor-levels") return &options.attractorLevels;
+    return nullptr;
+}
+
+inline double *rateOption(Options &options, const std::string &name) {
+    if (name == "--display-rate") return &options.displayRate;
+    if (name == "--target-rate") return &options.targetRate;
+    if (name == "--trail-range") return &options.trailRange;
+    if (name == "--attractor-strength") return &options.attractorStrength;
+    return nullptr;
+}
+
+// Sensor angles are given in degrees on the command line, like the slider.
+inline float *parameterOption(SimulationParameters &params, const std::string &name, float &scale) {
+    scale = 1.0f;
+    if (name == "--agent-velocity") return &params.agentVelocity;
+    if (name == "--agent-turn-speed") return &params.agentTurnSpeed;
+    if (name == "--agent-sensor-length") return &params.agentSensorLength;
+    if (name == "--agent-sensor-angle") {
+        scale = 0.0174532925f;
+        return &params.agentSensorAngle;
+    }
+    if (name == "--agent-sensor-size") return &params.agentSensorSize;
+    if (name == "--deposit-amount") return &params.depositAmount;
+    if (name == "--decay-rate") return &params.decayRate;
+    if (name == "--diffusion-rate") return &params.diffusionRate;
+    if (name == "--diffusion-size") return &params.diffusionSize;
+
+    unsigned species = 0, channel = 0;
+    int length = 0;
+    if (sscanf(name.c_str(), "--species-weight-%u-%u%n", &species, &channel, &length) == 2
+        && length == int(name.size()) && species < MAX_SPECIES && channel < MAX_SPECIES) {
+        return &params.speciesWeights[species][channel];
+    }
+    if (sscanf(name.c_str(), "--species-%u-%n", &species, &length) == 1 && length > 0
+        && species >= 1 && species < MAX_SPECIES) {
+        SpeciesParameters &motion = params.species[species - 1];
+        std::string field = name.substr(length);
+        if (field == "velocity") return &motion.agentVelocity;
+        if (field == "turn-speed") return &motion.agentTurnSpeed;
+        if (field == "deposit-amount") return &motion.depositAmount;
+        if (field == "sensor-length") return &motion.agentSensorLength;
+        if (field == "sensor-angle") {
+            scale = 0.0174532925f;
+            return &motion.agentSensorAngle;
+        }
+    }
+    return nullptr;
+}
+
+// The highest species index a parameter option names: the species of a
+// --species-K-* option, the larger of species and channel of a weight, and
+// 0 for the options of species 0.
+inline unsigned parameterOptionSpecies(const std::string &name) {
+    unsigned species = 0, channel = 0;
+    int length = 0;
+    if (sscanf(name.c_str(), "--species-weight-%u-%u%n", &species, &channel, &length) == 2
+        && length == int(name.size())) {
+        return species > channel ? species : channel;
+    }
+    if (sscanf(name.c_str(), "--species-%u-%n", &species, &length) == 1 && length > 0) {
+        return species;
+    }
+    return 0;
+}
+
+// NAME=V1,V2,... with NAME a parameter option without the dashes.
+inline bool parseSweepAxis(const std::string &text, SweepAxis &out) {
+    size_t equals = text.find('=');
+    SimulationParameters params;
+    float scale = 1.0f;
+    if (equals == std::string::npos || !parameterOption(params, "--" + text.substr(0, equals), scale)) {
+        std::cerr << "Unknown sweep parameter: " << text << std::endl;
+        return false;
+    }
+    out.name = text.substr(0, equals);
+    out.values.clear();
+    size_t start = equals + 1;
+    while (true) {
+        size_t comma = text.find(',', start);
+        std::string item = text.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        double number = 0.0;
+        if (!parseNumber(item.c_str(), number) || !std::isfinite(float(number) * scale)) {
+            std::cerr << "Invalid sweep value for " << out.name << ": " << item << std::endl;
+            return false;
+        }
+        out.values.push_back(float(number));
+        if (comma == std::string::npos) {
+            return true;
+        }
+        start = comma + 1;
+    }
+}
+
+// Returns false and prints the reason when the command line is invalid.
+inline bool parseOptions(int argc, char **argv, Options &options) {
+    // The per-species option naming the highest species, checked against
+    // --species once every option is read
+    std::string speciesOption;
+    unsigned speciesOptionIndex = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        double number = 0.0;
+        float scale = 1.0f;
+
+        if (arg == "--headless") {
+            options.headless = true;
+            continue;
+        }
+        if (arg == "--deterministic") {
+            options.deterministic = true;
+            continue;
+        }
+        if (arg == "--stage-times") {
+            options.stageTimes = true;
+            continue;
+        }
+        if (arg == "--validate-diffusion") {
+            options.validateDiffusion = true;
+            options.headless = true;
+            continue;
+        }
+        if (arg == "--help" || arg == "-h") {
+            return false;
+        }
+        if (!value) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        ++i;
+
+        if (arg == "--backend") {
+            if (!parseBackend(value, options.backend)) {
+                return false;
+            }
+        } else if (arg == "--agent-layout") {
+            if (!parseAgentLayout(value, options.layout)) {
+                return false;
+            }
+        } else if (arg == "--trail-format") {
+            if (!parseTrailFormat(value, options.trailFormat)) {
+                return false;
+            }
+        } else if (arg == "--output") {
+            options.outputPrefix = value;
+        } else if (arg == "--trace") {
+            options.tracePath = value;
+        } else if (arg == "--record") {
+            options.recordTarget = value;
+        } else if (arg == "--checkpoint") {
+            options.checkpointPath = value;
+        } else if (arg == "--restore") {
+            options.restorePath = value;
+        } else if (arg == "--control") {
+            options.controlSource = value;
+        } else if (arg == "--peers") {
+            options.peers = value;
+        } else if (arg == "--obstacles") {
+            options.obstaclesPath = value;
+        } else if (arg == "--attractors") {
+            options.attractorsPath = value;
+        } else if (arg == "--sweep") {
+            options.sweep.emplace_back();
+            if (!parseSweepAxis(value, options.sweep.back())) {
+                return false;
+            }
+            if (parameterOptionSpecies("--" + options.sweep.back().name) > speciesOptionIndex) {
+                speciesOption = "--sweep " + options.sweep.back().name;
+                speciesOptionIndex = parameterOptionSpecies("--" + options.sweep.back().name);
+            }
+        } else if (uint64_t *target = countOption(options, arg)) {
+            // Seeds are 32 bits, which also keeps an explicit seed from
+            // reading as NO_SEED
+            if (!parseCount(value, *target) || (target == &options.seed && *target > 0xFFFFFFFF)) {
+                std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+                return false;
+            }
+        } else if (double *target = rateOption(options, arg)) {
+            if (!parseNumber(value, *target) || *target < 0.0) {
+                std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+                return false;
+            }
+        } else if (float *target = parameterOption(options.params, arg, scale)) {
+            if (!parseNumber(value, number) || !std::isfinite(float(number) * scale)) {
+                std::cerr << "Invalid value for " << arg << ": " << value << std::endl;
+                return false;
+            }
+            *target = float(number) * scale;
+            if (parameterOptionSpecies(arg) > speciesOptionIndex) {
+                speciesOption = arg;
+                speciesOptionIndex = parameterOptionSpecies(arg);
+            }
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (options.threads > 0xFFFF) {
+        std::cerr << "Too many threads: " << options.threads << std::endl;
+        return false;
+    }
+    if (options.width < 1 || options.width > 32768 || options.height < 1 || options.height > 32768) {
+        std::cerr << "Grid size must be between 1 and 32768 pixels per side" << std::endl;
+        return false;
+    }
+    if (options.agents < 1 || options.agents > 0xFFFFFFFF) {
+        std::cerr << "Agent count must be between 1 and 4294967295" << std::endl;
+        return false;
+    }
+    if (options.minAgents < 1 || options.minAgents > 0xFFFFFFFF) {
+        std::cerr << "Minimum agent count must be between 1 and 4294967295" << std::endl;
+        return false;
+    }
+    if (options.species < 1 || options.species > MAX_SPECIES) {
+        std::cerr << "Species count must be between 1 and " << MAX_SPECIES << std::endl;
+        return false;
+    }
+    // A restored run takes its species and parameters from the checkpoint
+    if (speciesOptionIndex >= options.species && options.restorePath.empty()) {
+        std::cerr << speciesOption << " needs --species " << speciesOptionIndex + 1 << " or more" << std::endl;
+        return false;
+    }
+    // The CPU backend gathers trail values with 32-bit indices
+    if (options.width * options.height * options.species > 0x7FFFFFFF) {
+        std::cerr << "Grid too large for " << options.species << " species" << std::endl;
+        return false;
+    }
+    if (options.recordQueue < 1 || options.recordQueue > 1024 || options.recordFps < 1 || options.recordFps > 1000) {
+        std::cerr << "Record queue must be 1 to 1024 frames and the frame rate 1 to 1000" << std::endl;
+        return false;
+    }
+    if (options.stepsPerFrame < 1) {
+        std::cerr << "Steps per frame must be at least 1" << std::endl;
+        return false;
+    }
+    if (!options.peers.empty()) {
+        uint64_t peers = 1;
+        for (char c : options.peers) {
+            peers += c == ',';
+        }
+        if (options.ranks > 1 && options.ranks != peers) {
+            std::cerr << "--ranks " << options.ranks << " does not match the " << peers << " --peers" << std::endl;
+            return false;
+        }
+        options.ranks = peers;
+    }
+    if (options.ranks < 1 || options.ranks > 4096 || options.rank >= options.ranks) {
+        std::cerr << "Ranks must be 1 to 4096, and --rank one of them" << std::endl;
+        return false;
+    }
+    if (options.attractorLevels > MAX_ATTRACTOR_LEVELS) {
+        std::cerr << "Attractor levels must be between 0 and " << MAX_ATTRACTOR_LEVELS << std::endl;
+        return false;
+    }
+    if (options.ranks > 1 || !options.peers.empty()) {
+#ifdef _WIN32
+        std::cerr << "Distributed runs need a POSIX system" << std::endl;
+        return false;
+#endif
+        if (options.species > 1 || options.validateDiffusion || !options.recordTarget.empty() ||
+            !options.checkpointPath.empty() || !options.restorePath.empty() || !options.controlSource.empty() ||
+            options.targetRate > 0.0 || !options.tracePath.empty() || !options.obstaclesPath.empty() ||
+            !options.attractorsPath.empty()) {
+            std::cerr << "Distributed runs support a single species, without recording, checkpoints, --control,"
+                " --target-rate, --trace, environment maps or validation" << std::endl;
+            return false;
+        }
+        options.headless = true;
+        options.backend = Backend::CPU;
+    }
+    if (!options.sweep.empty()) {
+        size_t variants = 1;
+        for (const SweepAxis &axis : options.sweep) {
+            variants *= axis.values.size();
+        }
+        if (variants > 1000000) {
+            std::cerr << "A sweep may have at most 1000000 variants" << std::endl;
+            return false;
+        }
+        if (options.ranks > 1 || !options.peers.empty() || options.validateDiffusion || !options.recordTarget.empty() ||
+            !options.checkpointPath.empty() || !options.restorePath.empty() || !options.controlSource.empty() ||
+            options.targetRate > 0.0 || !options.tracePath.empty()) {
+            std::cerr << "Sweeps run without distribution, recording, checkpoints, --control, --target-rate,"
+                " --trace or validation" << std::endl;
+            return false;
+        }
+        options.headless = true;
+        options.backend = Backend::CPU;
+    }
+    if (options.trailFormat != TrailFormat::FP32 && (options.backend == Backend::CPU || options.validateDiffusion)) {
+        std::cerr << "--trail-format " << trailFormatName(options.trailFormat)
+                  << " is for the GPU backend, without --validate-diffusion" << std::endl;
+        return false;
+    }
+    if (options.trailRange > 0.0 && options.trailFormat != TrailFormat::UNORM16 && options.trailFormat != TrailFormat::UNORM8) {
+        std::cerr << "--trail-range is for --trail-format unorm16 and unorm8" << std::endl;
+        return false;
+    }
+    options.hasSeed = options.seed != NO_SEED;
+    if (options.deterministic && !options.hasSeed && options.restorePath.empty()) {
+        std::cerr << "--deterministic needs a --seed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Sets the range of a unorm trail format, by default from the parameters,
+// and fails when it would clip the trail of a single agent. Runs once
+// --restore has brought in the checkpoint's parameters.
+inline bool resolveTrailRange(Options &options) {
+    if (options.trailFormat != TrailFormat::UNORM16 && options.trailFormat != TrailFormat::UNORM8) {
+        return true;
+    }
+    const float equilibrium = trailEquilibrium(options.params, uint32_t(options.species));
+    if (!std::isfinite(equilibrium)) {
+        std::cerr << "--trail-format " << trailFormatName(options.trailFormat)
+                  << " needs a --decay-rate below 1, or trails grow past any range" << std::endl;
+        return false;
+    }
+    if (options.trailRange == 0.0) {
+        options.trailRange = defaultTrailRange(options.params, uint32_t(options.species));
+    }
+    if (options.trailRange < equilibrium) {
+        std::cerr << "--trail-range " << options.trailRange << " is below " << equilibrium
+                  << ", the value one agent's trail settles at" << std::endl;
+        return false;
+    }
+    return true;
+}
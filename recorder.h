@@ -0,0 +1,286 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image_io.h"
+#include "simulation.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+enum class RecordFormat {
+    Y4M,
+    PNG,
+    QOI,
+    EXR,
+    PPM
+};
+
+// One captured frame: the packed display, or the raw trail map for EXR
+// with one channel per species.
+struct RecordedFrame {
+    uint64_t index;
+    uint32_t width;
+    uint32_t height;
+    uint32_t channels;
+    std::vector<uint32_t> display;
+    std::vector<float> trail;
+};
+
+// Writes captured frames on its own thread. The queue holds a fixed number
+// of frames, and a capture that finds it full is dropped instead of waiting,
+// so recording never stalls the simulation loop.
+class FrameRecorder {
+public:
+    // target is a .y4m file, "|command" to pipe a Y4M stream into a command
+    // (e.g. "|ffmpeg -i - out.mp4"), or a file prefix ending in .png, .qoi,
+    // .exr or .ppm; frames then get _NNNNNN before the extension.
+    static std::unique_ptr<FrameRecorder> open(const std::string &target, size_t queueLength, uint32_t frameRate) {
+        std::unique_ptr<FrameRecorder> recorder(new FrameRecorder(queueLength, frameRate));
+        std::string extension = target.size() > 4 ? target.substr(target.size() - 4) : "";
+        if (!target.empty() && target[0] == '|') {
+            recorder->format = RecordFormat::Y4M;
+            recorder->stream = popen(target.c_str() + 1, "w");
+            recorder->pipe = true;
+        } else if (extension == ".y4m") {
+            recorder->format = RecordFormat::Y4M;
+            recorder->stream = fopen(target.c_str(), "wb");
+        } else if (extension == ".png" || extension == ".qoi" || extension == ".exr" || extension == ".ppm") {
+            recorder->format = extension == ".png" ? RecordFormat::PNG
+                : extension == ".qoi" ? RecordFormat::QOI
+                : extension == ".exr" ? RecordFormat::EXR : RecordFormat::PPM;
+            recorder->prefix = target.substr(0, target.size() - 4);
+            recorder->extension = extension;
+        } else {
+            std::cerr << "Unknown recording format: " << target << std::endl;
+            return nullptr;
+        }
+        if (recorder->format == RecordFormat::Y4M && !recorder->stream) {
+            std::cerr << "Failed to open " << target << std::endl;
+            return nullptr;
+        }
+        recorder->writer = std::thread(&FrameRecorder::writerLoop, recorder.get());
+        return recorder;
+    }
+
+    ~FrameRecorder() { close(); }
+
+    FrameRecorder(const FrameRecorder &) = delete;
+    FrameRecorder &operator=(const FrameRecorder &) = delete;
+
+    bool wantsTrailMap() const { return format == RecordFormat::EXR; }
+
+    // A free frame to fill, or nullptr when the queue is full; the frame is
+    // counted as dropped then.
+    RecordedFrame *acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (available.empty()) {
+            ++dropped;
+            return nullptr;
+        }
+        RecordedFrame *frame = available.back();
+        available.pop_back();
+        return frame;
+    }
+
+    void submit(RecordedFrame *frame) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queue.push_back(frame);
+            maxDepth = std::max(maxDepth, queue.size());
+        }
+        wake.notify_one();
+    }
+
+    // Returns an acquired frame unfilled.
+    void release(RecordedFrame *frame) {
+        std::lock_guard<std::mutex> lock(mutex);
+        available.push_back(frame);
+    }
+
+    // For captures that were lost before reaching the queue.
+    void drop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++dropped;
+    }
+
+    void printStatus() {
+        std::lock_guard<std::mutex> lock(mutex);
+        printf("Recording: %llu frames written, queue %zu/%zu, %llu dropped\n",
+            static_cast<unsigned long long>(written), queue.size(), frames.size(), static_cast<unsigned long long>(dropped));
+    }
+
+    // Writes what is still queued and stops the writer. Returns false when
+    // any frame failed to write.
+    bool close() {
+        if (!writer.joinable()) {
+            return !failed;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+
+        if (stream) {
+            failed |= (pipe ? pclose(stream) : fclose(stream)) != 0;
+            stream = nullptr;
+        }
+        printf("Recorded %llu frames, %llu dropped, deepest queue %zu of %zu\n",
+            static_cast<unsigned long long>(written), static_cast<unsigned long long>(dropped), maxDepth, frames.size());
+        return !failed;
+    }
+
+private:
+    FrameRecorder(size_t queueLength, uint32_t frameRate) : frameRate(frameRate) {
+        for (size_t i = 0; i < queueLength; ++i) {
+            frames.emplace_back(new RecordedFrame());
+            available.push_back(frames.back().get());
+        }
+    }
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            RecordedFrame *frame = queue.front();
+            queue.pop_front();
+
+            lock.unlock();
+            bool ok = write(*frame);
+            lock.lock();
+
+            available.push_back(frame);
+            if (ok) {
+                ++written;
+            } else {
+                ++dropped;
+            }
+        }
+    }
+
+    // Runs on the writer thread only.
+    bool write(const RecordedFrame &frame) {
+        if (format == RecordFormat::Y4M) {
+            if (!streamWidth) {
+                streamWidth = frame.width;
+                streamHeight = frame.height;
+                writeY4MHeader(stream, streamWidth, streamHeight, frameRate);
+            }
+            // A Y4M stream cannot change size, so frames after a resize are dropped
+            if (frame.width != streamWidth || frame.height != streamHeight) {
+                if (!warnedSize) {
+                    std::cerr << "Recording: dropping frames that do not match the " << streamWidth << " x "
+                              << streamHeight << " stream" << std::endl;
+                    warnedSize = true;
+                }
+                return false;
+            }
+            if (!writeY4MFrame(stream, frame.width, frame.height, frame.display.data())) {
+                return fail("the Y4M stream");
+            }
+            return true;
+        }
+
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), "_%06llu", static_cast<unsigned long long>(frame.index));
+        std::string path = prefix + suffix + extension;
+        bool ok = false;
+        switch (format) {
+            case RecordFormat::PNG: ok = writeDisplayPNG(path, frame.width, frame.height, frame.display.data()); break;
+            case RecordFormat::QOI: ok = writeDisplayQOI(path, frame.width, frame.height, frame.display.data()); break;
+            case RecordFormat::EXR: ok = writeTrailMapEXR(path, frame.width, frame.height, frame.channels, frame.trail.data()); break;
+            default: ok = writeDisplayPPM(path, frame.width, frame.height, frame.display.data()); break;
+        }
+        return ok || fail(path);
+    }
+
+    bool fail(const std::string &what) {
+        if (!failed) {
+            std::cerr << "Recording: failed to write " << what << std::endl;
+        }
+        failed = true;
+        return false;
+    }
+
+    RecordFormat format = RecordFormat::Y4M;
+    std::string prefix;
+    std::string extension;
+    FILE *stream = nullptr;
+    bool pipe = false;
+    uint32_t frameRate;
+    uint32_t streamWidth = 0;
+    uint32_t streamHeight = 0;
+    bool warnedSize = false;
+
+    std::vector<std::unique_ptr<RecordedFrame>> frames;
+    std::vector<RecordedFrame *> available;
+    std::deque<RecordedFrame *> queue;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread writer;
+    bool stopping = false;
+    bool failed = false;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    size_t maxDepth = 0;
+};
+
+// Takes frames from a simulation and hands them to a recorder. capture() is
+// called after renderTrailMap; poll() moves finished readbacks along and
+// waits for all of them when asked to.
+class FrameCapture {
+public:
+    explicit FrameCapture(FrameRecorder &recorder) : recorder(recorder) {}
+    virtual ~FrameCapture() = default;
+
+    virtual void capture(uint64_t index) = 0;
+    virtual void poll(bool wait) { (void)wait; }
+
+protected:
+    FrameRecorder &recorder;
+};
+
+// The CPU backend already has the frame in memory, so a capture is a copy
+// into a queued frame.
+class SimulationCapture : public FrameCapture {
+public:
+    SimulationCapture(FrameRecorder &recorder, Simulation &simulation)
+        : FrameCapture(recorder), simulation(simulation) {}
+
+    void capture(uint64_t index) override {
+        RecordedFrame *frame = recorder.acquire();
+        if (!frame) {
+            return;
+        }
+        frame->index = index;
+        frame->width = simulation.gridWidth();
+        frame->height = simulation.gridHeight();
+        frame->channels = simulation.species();
+        if (recorder.wantsTrailMap()) {
+            simulation.readTrailMap(frame->trail);
+        } else {
+            simulation.readDisplay(frame->display);
+        }
+        recorder.submit(frame);
+    }
+
+private:
+    Simulation &simulation;
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Thin wrappers over the native vector width so the CPU kernels are written
+// once: AVX2 (8 lanes), NEON (4 lanes) or plain scalar code as a fallback.
+namespace simd {
+
+#if defined(__AVX2__)
+
+constexpr int LANES = 8;
+
+struct VecF { __m256 v; };
+struct VecI { __m256i v; };
+struct Mask { __m256 v; };
+
+inline VecF set1(float value) { return { _mm256_set1_ps(value) }; }
+inline VecI set1i(int32_t value) { return { _mm256_set1_epi32(value) }; }
+inline VecF load(const float *p) { return { _mm256_loadu_ps(p) }; }
+inline void store(float *p, VecF a) { _mm256_storeu_ps(p, a.v); }
+inline VecI loadi(const int32_t *p) { return { _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)) }; }
+inline void storei(int32_t *p, VecI a) { _mm256_storeu_si256(reinterpret_cast<__m256i *>(p), a.v); }
+
+inline VecF operator+(VecF a, VecF b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline VecF operator-(VecF a, VecF b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline VecF operator*(VecF a, VecF b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline VecF operator-(VecF a) { return { _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)) }; }
+inline VecF min(VecF a, VecF b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline VecF max(VecF a, VecF b) { return { _mm256_max_ps(a.v, b.v) }; }
+inline VecF floor(VecF a) { return { _mm256_floor_ps(a.v) }; }
+
+inline Mask operator<(VecF a, VecF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline Mask operator>(VecF a, VecF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+inline Mask operator<=(VecF a, VecF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+inline Mask operator>=(VecF a, VecF b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+inline Mask operator&(Mask a, Mask b) { return { _mm256_and_ps(a.v, b.v) }; }
+inline Mask operator|(Mask a, Mask b) { return { _mm256_or_ps(a.v, b.v) }; }
+inline Mask operator!(Mask a) { return { _mm256_xor_ps(a.v, _mm256_castsi256_ps(_mm256_set1_epi32(-1))) }; }
+inline bool any(Mask a) { return _mm256_movemask_ps(a.v) != 0; }
+inline VecF select(Mask m, VecF a, VecF b) { return { _mm256_blendv_ps(b.v, a.v, m.v) }; }
+
+inline VecI operator+(VecI a, VecI b) { return { _mm256_add_epi32(a.v, b.v) }; }
+inline VecI operator*(VecI a, VecI b) { return { _mm256_mullo_epi32(a.v, b.v) }; }
+inline VecI operator&(VecI a, VecI b) { return { _mm256_and_si256(a.v, b.v) }; }
+inline Mask operator==(VecI a, VecI b) { return { _mm256_castsi256_ps(_mm256_cmpeq_epi32(a.v, b.v)) }; }
+inline VecI truncate(VecF a) { return { _mm256_cvttps_epi32(a.v) }; }
+inline VecF toFloat(VecI a) { return { _mm256_cvtepi32_ps(a.v) }; }
+
+// Loads base[index] for the lanes set in the mask and 0 elsewhere.
+inline VecF gather(const float *base, VecI index, Mask m) {
+    return { _mm256_mask_i32gather_ps(_mm256_setzero_ps(), base, index.v, m.v, 4) };
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+constexpr int LANES = 4;
+
+struct VecF { float32x4_t v; };
+struct VecI { int32x4_t v; };
+struct Mask { uint32x4_t v; };
+
+inline VecF set1(float value) { return { vdupq_n_f32(value) }; }
+inline VecI set1i(int32_t value) { return { vdupq_n_s32(value) }; }
+inline VecF load(const float *p) { return { vld1q_f32(p) }; }
+inline void store(float *p, VecF a) { vst1q_f32(p, a.v); }
+inline VecI loadi(const int32_t *p) { return { vld1q_s32(p) }; }
+inline void storei(int32_t *p, VecI a) { vst1q_s32(p, a.v); }
+
+inline VecF operator+(VecF a, VecF b) { return { vaddq_f32(a.v, b.v) }; }
+inline VecF operator-(VecF a, VecF b) { return { vsubq_f32(a.v, b.v) }; }
+inline VecF operator*(VecF a, VecF b) { return { vmulq_f32(a.v, b.v) }; }
+inline VecF operator-(VecF a) { return { vnegq_f32(a.v) }; }
+inline VecF min(VecF a, VecF b) { return { vminq_f32(a.v, b.v) }; }
+inline VecF max(VecF a, VecF b) { return { vmaxq_f32(a.v, b.v) }; }
+inline VecF floor(VecF a) { return { vrndmq_f32(a.v) }; }
+
+inline Mask operator<(VecF a, VecF b) { return { vcltq_f32(a.v, b.v) }; }
+inline Mask operator>(VecF a, VecF b) { return { vcgtq_f32(a.v, b.v) }; }
+inline Mask operator<=(VecF a, VecF b) { return { vcleq_f32(a.v, b.v) }; }
+inline Mask operator>=(VecF a, VecF b) { return { vcgeq_f32(a.v, b.v) }; }
+inline Mask operator&(Mask a, Mask b) { return { vandq_u32(a.v, b.v) }; }
+inline Mask operator|(Mask a, Mask b) { return { vorrq_u32(a.v, b.v) }; }
+inline Mask operator!(Mask a) { return { vmvnq_u32(a.v) }; }
+inline bool any(Mask a) { return vmaxvq_u32(a.v) != 0; }
+inline VecF select(Mask m, VecF a, VecF b) { return { vbslq_f32(m.v, a.v, b.v) }; }
+
+inline VecI operator+(VecI a, VecI b) { return { vaddq_s32(a.v, b.v) }; }
+inline VecI operator*(VecI a, VecI b) { return { vmulq_s32(a.v, b.v) }; }
+inline VecI operator&(VecI a, VecI b) { return { vandq_s32(a.v, b.v) }; }
+inline Mask operator==(VecI a, VecI b) { return { vceqq_s32(a.v, b.v) }; }
+inline VecI truncate(VecF a) { return { vcvtq_s32_f32(a.v) }; }
+inline VecF toFloat(VecI a) { return { vcvtq_f32_s32(a.v) }; }
+
+// NEON has no gather instruction, so the lanes are fetched one by one.
+inline VecF gather(const float *base, VecI index, Mask m) {
+    int32_t indices[LANES];
+    uint32_t lanes[LANES];
+    float values[LANES];
+    vst1q_s32(indices, index.v);
+    vst1q_u32(lanes, m.v);
+    for (int i = 0; i < LANES; ++i) {
+        values[i] = lanes[i] ? base[indices[i]] : 0.0f;
+    }
+    return { vld1q_f32(values) };
+}
+
+#else
+
+constexpr int LANES = 1;
+
+struct VecF { float v; };
+struct VecI { int32_t v; };
+struct Mask { bool v; };
+
+inline VecF set1(float value) { return { value }; }
+inline VecI set1i(int32_t value) { return { value }; }
+inline VecF load(const float *p) { return { *p }; }
+inline void store(float *p, VecF a) { *p = a.v; }
+inline VecI loadi(const int32_t *p) { return { *p }; }
+inline void storei(int32_t *p, VecI a) { *p = a.v; }
+
+inline VecF operator+(VecF a, VecF b) { return { a.v + b.v }; }
+inline VecF operator-(VecF a, VecF b) { return { a.v - b.v }; }
+inline VecF operator*(VecF a, VecF b) { return { a.v * b.v }; }
+inline VecF operator-(VecF a) { return { -a.v }; }
+inline VecF min(VecF a, VecF b) { return { b.v < a.v ? b.v : a.v }; }
+inline VecF max(VecF a, VecF b) { return { a.v < b.v ? b.v : a.v }; }
+inline VecF floor(VecF a) { return { std::floor(a.v) }; }
+
+inline Mask operator<(VecF a, VecF b) { return { a.v < b.v }; }
+inline Mask operator>(VecF a, VecF b) { return { a.v > b.v }; }
+inline Mask operator<=(VecF a, VecF b) { return { a.v <= b.v }; }
+inline Mask operator>=(VecF a, VecF b) { return { a.v >= b.v }; }
+inline Mask operator&(Mask a, Mask b) { return { a.v && b.v }; }
+inline Mask operator|(Mask a, Mask b) { return { a.v || b.v }; }
+inline Mask operator!(Mask a) { return { !a.v }; }
+inline bool any(Mask a) { return a.v; }
+inline VecF select(Mask m, VecF a, VecF b) { return { m.v ? a.v : b.v }; }
+
+inline VecI operator+(VecI a, VecI b) { return { a.v + b.v }; }
+inline VecI operator*(VecI a, VecI b) { return { a.v * b.v }; }
+inline VecI operator&(VecI a, VecI b) { return { a.v & b.v }; }
+inline Mask operator==(VecI a, VecI b) { return { a.v == b.v }; }
+inline VecI truncate(VecF a) { return { static_cast<int32_t>(a.v) }; }
+inline VecF toFloat(VecI a) { return { static_cast<float>(a.v) }; }
+
+inline VecF gather(const float *base, VecI index, Mask m) {
+    return { m.v ? base[index.v] : 0.0f };
+}
+
+#endif
+
+inline VecF fract(VecF a) { return a - floor(a); }
+
+// Cephes-style sin/cos: reduce to [-pi/4, pi/4] around the nearest multiple
+// of pi/2, evaluate both minimax polynomials and pick by quadrant.
+inline void sincos(VecF x, VecF &sinOut, VecF &cosOut) {
+    VecF j = floor(x * set1(0.63661977236f) + set1(0.5f));
+    VecF r = x - j * set1(1.5703125f);
+    r = r - j * set1(4.837512969970703125e-4f);
+    r = r - j * set1(7.54978995489188216e-8f);
+
+    VecF z = r * r;
+    VecF s = r + r * z * (set1(-1.6666654611e-1f) + z * (set1(8.3321608736e-3f) + z * set1(-1.9515295891e-4f)));
+    VecF c = set1(1.0f) - z * set1(0.5f) +
+        z * z * (set1(4.166664568298827e-2f) + z * (set1(-1.388731625493765e-3f) + z * set1(2.443315711809948e-5f)));
+
+    VecI quadrant = truncate(j - floor(j * set1(0.25f)) * set1(4.0f));
+    Mask q1 = quadrant == set1i(1);
+    Mask q2 = quadrant == set1i(2);
+    Mask q3 = quadrant == set1i(3);
+
+    sinOut = select(q1, c, select(q2, -s, select(q3, -c, s)));
+    cosOut = select(q1, -s, select(q2, -c, select(q3, s, c)));
+}
+
+} // namespace simd
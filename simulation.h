@@ -0,0 +1,470 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "trace.h"
+
+class EnvironmentMaps;
+
+// Largest blur radius; the GPU blur stages its halo in shared memory.
+#define MAX_DIFFUSION_SIZE 64
+// Rows per running-sum segment of the vertical blur pass.
+#define DIFFUSION_SEGMENT_HEIGHT 64
+// Sensors sum a square of (2 * size + 1)^2 pixels; larger sizes cannot fit
+// any grid. The sums are built per step with running sums along segments of
+// this many pixels, so a sensor of any size is a single read.
+#define MAX_SENSOR_SIZE 16384
+#define SENSOR_SEGMENT_WIDTH 64
+// Agents are sorted into square tiles of this many pixels, in Morton order.
+#define SORT_TILE_SIZE 32
+// The trail map is diffused and colorized in square tiles of this many
+// pixels, and only where it is active: tiles that were deposited into or
+// still hold a value of at least the epsilon, plus the ring around them the
+// blur reaches. Tiles further out are zero and skipped. The epsilon is below
+// the 8-bit display step.
+#define ACTIVE_TILE_SIZE 64
+#define ACTIVE_TILE_EPSILON (1.0f / 1024.0f)
+static_assert(MAX_DIFFUSION_SIZE <= ACTIVE_TILE_SIZE, "the blur must not reach past the ring of tiles around an active one");
+// Species per simulation; the GPU keeps one vec4 of weights per species.
+#define MAX_SPECIES 4
+// Deposits are summed as fixed point with this many steps per unit, so the
+// total does not depend on the order agents land in. A pixel can take
+// 2^32 / DEPOSIT_SCALE units per step before it wraps.
+#define DEPOSIT_SCALE 4096
+
+struct FPoint2D {
+    float x;
+    float y;
+};
+
+struct Agent {
+    FPoint2D Position;
+    float Rotation;
+};
+
+// How agents are laid out in memory. AOS is the original Agent record; SOA
+// keeps x, y and rotation in separate arrays; COMPACT stores 16-bit fixed
+// point positions and a 16-bit heading.
+enum class AgentLayout {
+    AOS,
+    SOA,
+    COMPACT
+};
+
+inline const char *agentLayoutName(AgentLayout layout) {
+    switch (layout) {
+        case AgentLayout::SOA: return "soa";
+        case AgentLayout::COMPACT: return "compact";
+        default: return "aos";
+    }
+}
+
+inline size_t agentLayoutBytes(AgentLayout layout) {
+    return layout == AgentLayout::COMPACT ? 3 * sizeof(uint16_t) : 3 * sizeof(float);
+}
+
+// How the GPU backend stores trail values. FP32 is exact; FP16 halves the
+// bandwidth of diffusion, UNORM16 too with fixed steps over [0, range], and
+// UNORM8 quarters it with steps over the same range, which is fixed when the
+// simulation is created, see trailEquilibrium(). The unorm formats round
+// stochastically, so decay below one step still happens on average. The
+// CPU backend always uses FP32, and every backend reads and writes trail
+// maps as floats.
+enum class TrailFormat {
+    FP32,
+    FP16,
+    UNORM16,
+    UNORM8
+};
+
+inline const char *trailFormatName(TrailFormat format) {
+    switch (format) {
+        case TrailFormat::FP16: return "fp16";
+        case TrailFormat::UNORM16: return "unorm16";
+        case TrailFormat::UNORM8: return "unorm8";
+        default: return "fp32";
+    }
+}
+
+inline size_t trailFormatBytes(TrailFormat format) {
+    switch (format) {
+        case TrailFormat::FP16:
+        case TrailFormat::UNORM16: return 2;
+        case TrailFormat::UNORM8: return 1;
+        default: return 4;
+    }
+}
+
+// Size of the agents as the GPU stores them, which is also the checkpoint
+// format: AOS interleaves x, y and rotation; SOA stores all x, then all y,
+// then all rotations; COMPACT stores one position word per agent (x in the
+// low half) followed by one heading word per two agents.
+inline size_t agentDataBytes(AgentLayout layout, uint32_t agentCount) {
+    if (layout == AgentLayout::COMPACT) {
+        return (size_t(agentCount) + (size_t(agentCount) + 1) / 2) * sizeof(uint32_t);
+    }
+    return size_t(agentCount) * 3 * sizeof(float);
+}
+
+// Movement and deposit of one species.
+struct SpeciesParameters {
+    float agentVelocity = 1.0f;
+    float agentTurnSpeed = 0.2f;
+    float agentSensorLength = 10.0f;
+    float agentSensorAngle = 0.0174532925f * 20.0f;
+    float depositAmount = 0.001f;
+};
+
+struct SimulationParameters {
+    float agentVelocity = 1.0f;
+    float agentTurnSpeed = 0.2f;
+    float agentSensorLength = 10.0f;
+    float agentSensorAngle = 0.0174532925f * 20.0f;
+    float agentSensorSize = 0;
+    // Trail added per agent and step where it lands. Deposits accumulate and
+    // settle near depositAmount / (1 - decayRate) per agent that keeps
+    // landing on a pixel, so the default of 1 - decayRate keeps trails around
+    // 1, the top of the display range.
+    float depositAmount = 0.001f;
+
+    float decayRate = 0.999f;
+    float diffusionRate = 0.13f;
+    float diffusionSize = 1;
+
+    // Species 0 moves with the agent fields above, species 1 and up with
+    // these.
+    SpeciesParameters species[MAX_SPECIES - 1];
+
+    // What species s senses is the sum of every trail channel c times
+    // speciesWeights[s][c]: by default it follows its own trail and avoids
+    // the others.
+    float speciesWeights[MAX_SPECIES][MAX_SPECIES] = {
+        { 1.0f, -1.0f, -1.0f, -1.0f },
+        { -1.0f, 1.0f, -1.0f, -1.0f },
+        { -1.0f, -1.0f, 1.0f, -1.0f },
+        { -1.0f, -1.0f, -1.0f, 1.0f }
+    };
+};
+
+inline SpeciesParameters speciesParameters(const SimulationParameters &params, uint32_t species) {
+    if (species == 0) {
+        return { params.agentVelocity, params.agentTurnSpeed, params.agentSensorLength, params.agentSensorAngle,
+                 params.depositAmount };
+    }
+    return params.species[species - 1];
+}
+
+// A deposit amount in DEPOSIT_SCALE fixed point, clamped to [0, 65536].
+inline uint32_t depositUnits(float amount) {
+    return uint32_t(std::min(std::max(amount, 0.0f), 65536.0f) * DEPOSIT_SCALE + 0.5f);
+}
+
+// The unorm trail formats cover this many times trailEquilibrium() unless a
+// range is given, room for the pixels that many agents share.
+#define TRAIL_RANGE_HEADROOM 64.0f
+
+// The value a pixel settles at when one agent of the species depositing most
+// lands on it every step: deposit / (1 - decay), infinite when trails never
+// decay.
+inline float trailEquilibrium(const SimulationParameters &params, uint32_t speciesCount) {
+    float deposit = 0.0f;
+    for (uint32_t species = 0; species < speciesCount; ++species) {
+        deposit = std::max(deposit, float(depositUnits(speciesParameters(params, species).depositAmount)) / DEPOSIT_SCALE);
+    }
+    if (params.decayRate >= 1.0f) {
+        return deposit > 0.0f ? std::numeric_limits<float>::infinity() : 0.0f;
+    }
+    return deposit / (1.0f - params.decayRate);
+}
+
+// The default range of the unorm trail formats for params.
+inline float defaultTrailRange(const SimulationParameters &params, uint32_t speciesCount) {
+    const float equilibrium = trailEquilibrium(params, speciesCount);
+    return equilibrium > 0.0f ? TRAIL_RANGE_HEADROOM * equilibrium : TRAIL_RANGE_HEADROOM;
+}
+
+// Display colour of each species' trail channel; the GPU colorize shader
+// carries the same table.
+const float SpeciesColors[MAX_SPECIES][3] = {
+    { 0.0f, 1.0f, 0.0f },
+    { 1.0f, 0.0f, 1.0f },
+    { 0.0f, 0.5f, 1.0f },
+    { 1.0f, 0.8f, 0.0f }
+};
+
+// PCG hash (Jarzynski and Olano, "Hash Functions for GPU Rendering"); the
+// shaders carry the same function, so both backends draw the same numbers.
+inline uint32_t pcgHash(uint32_t value) {
+    uint32_t state = value * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+    return (word >> 22) ^ word;
+}
+
+// Random numbers are counter based: agent idx draws pcgHash(idx ^ key) in a
+// step, so they depend on the seed, the step and the agent's slot only, not
+// on threads or execution order.
+inline uint32_t stepRandomKey(uint32_t seed, uint64_t step) {
+    return pcgHash(pcgHash(uint32_t(step >> 32) ^ pcgHash(uint32_t(step))) ^ seed);
+}
+
+// [0, 1) from the top 24 bits of a hash, exact in float.
+inline float unitFloat(uint32_t hash) {
+    return float(hash >> 8) * (1.0f / 16777216.0f);
+}
+
+// Agents are split into speciesCount contiguous index ranges of equal size,
+// the last one taking the remainder. Sorting keeps the ranges intact, so no
+// agent has to store its species.
+inline uint32_t agentSpecies(uint32_t idx, uint32_t agentCount, uint32_t speciesCount) {
+    uint32_t rangeSize = (agentCount + speciesCount - 1) / speciesCount;
+    return std::min(idx / rangeSize, speciesCount - 1);
+}
+
+inline int clampDiffusionSize(float diffusionSize) {
+    int size = static_cast<int>(diffusionSize);
+    return size < 0 ? 0 : (size > MAX_DIFFUSION_SIZE ? MAX_DIFFUSION_SIZE : size);
+}
+
+inline int clampSensorSize(float sensorSize) {
+    if (!(sensorSize > 0.0f)) {
+        return 0;
+    }
+    return sensorSize < float(MAX_SENSOR_SIZE) ? static_cast<int>(sensorSize) : MAX_SENSOR_SIZE;
+}
+
+inline uint32_t spreadBits(uint32_t v) {
+    v &= 0xFFFF;
+    v = (v | (v << 8)) & 0x00FF00FF;
+    v = (v | (v << 4)) & 0x0F0F0F0F;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Number of sort bins: the Morton range of the tile grid rounded to a power of two.
+inline uint32_t sortBinCount(uint32_t width, uint32_t height) {
+    uint32_t tiles = (std::max(width, height) + SORT_TILE_SIZE - 1) / SORT_TILE_SIZE;
+    uint32_t side = 1;
+    while (side < tiles) {
+        side <<= 1;
+    }
+    return side * side;
+}
+
+inline uint32_t sortKey(FPoint2D position, uint32_t width, uint32_t height) {
+    float x = position.x < 0 ? 0 : (position.x > width - 1 ? width - 1 : position.x);
+    float y = position.y < 0 ? 0 : (position.y > height - 1 ? height - 1 : position.y);
+    return spreadBits(uint32_t(x) / SORT_TILE_SIZE) | (spreadBits(uint32_t(y) / SORT_TILE_SIZE) << 1);
+}
+
+// Nearest-neighbour resample used when the grid is resized. Pixels hold
+// one value per channel, interleaved.
+inline void resampleTrailMap(const std::vector<float> &source, uint32_t sourceWidth, uint32_t sourceHeight,
+                             std::vector<float> &out, uint32_t width, uint32_t height, uint32_t channels) {
+    out.resize(size_t(width) * height * channels);
+    for (uint32_t y = 0; y < height; ++y) {
+        const float *row = &source[size_t(uint64_t(y) * sourceHeight / height) * sourceWidth * channels];
+        for (uint32_t x = 0; x < width; ++x) {
+            const float *pixel = row + size_t(uint64_t(x) * sourceWidth / width) * channels;
+            std::copy(pixel, pixel + channels, &out[(size_t(y) * width + x) * channels]);
+        }
+    }
+}
+
+enum SimulationStage {
+    STAGE_SORT,
+    STAGE_UPDATE,
+    STAGE_DEPOSIT,
+    STAGE_DIFFUSE,
+    STAGE_COLORIZE,
+    STAGE_PRESENT,
+    STAGE_COUNT
+};
+
+inline const char *stageName(int stage) {
+    static const char *names[STAGE_COUNT] = { "sort", "update", "deposit", "diffuse", "colorize", "present" };
+    return names[stage];
+}
+
+struct StageTimes {
+    double milliseconds[STAGE_COUNT] = {};
+    uint64_t calls[STAGE_COUNT] = {};
+
+    double average(int stage) const {
+        return calls[stage] ? milliseconds[stage] / calls[stage] : 0.0;
+    }
+};
+
+// One implementation per backend. The stages carry the names of the compute
+// shaders they mirror so both backends can be compared stage by stage.
+class Simulation {
+public:
+    Simulation(uint32_t width, uint32_t height, uint32_t agentCount, uint32_t speciesCount)
+        : width(width), height(height), agentCount(agentCount), agentPool(agentCount), speciesCount(speciesCount) {}
+    virtual ~Simulation() = default;
+
+    uint32_t gridWidth() const { return width; }
+    uint32_t gridHeight() const { return height; }
+    uint32_t population() const { return agentCount; }
+    // Agents allocated; the population is the first population() of them.
+    uint32_t poolSize() const { return agentPool; }
+    // Also the number of trail channels.
+    uint32_t species() const { return speciesCount; }
+
+    // Seeds the agents, and the random numbers of every later step.
+    virtual void initAgents(uint32_t seed) = 0;
+    // Senses, steers and moves every agent, and deposits where it lands in
+    // the same pass. Deposits are accumulated apart from the trail map, so
+    // agents never sense trail laid down in the same step. Every step moves
+    // an agent by its velocity, whatever the time between steps.
+    virtual void updateAgents(const SimulationParameters &params) = 0;
+    // Adds the accumulated deposits to the trail map; backends may fold this
+    // into processTrailMap instead.
+    virtual void renderAgents() = 0;
+    // Diffuses and decays the trail map. Inside a step() asked to colorize,
+    // the pass also colorizes what it writes, and renderTrailMap() then only
+    // finishes the parts of the display it did not cover.
+    virtual void processTrailMap(const SimulationParameters &params) = 0;
+    virtual void renderTrailMap() = 0;
+
+    // The trail map holds species() channels per pixel, interleaved, so
+    // width * height * species() values.
+    virtual void readTrailMap(std::vector<float> &out) = 0;
+    virtual void writeTrailMap(const float *trail) = 0;
+    virtual void readDisplay(std::vector<uint32_t> &out) = 0;
+
+    // Agents in the agentDataBytes format of their layout, for checkpoints.
+    virtual AgentLayout agentLayout() const = 0;
+    virtual void readAgentData(std::vector<unsigned char> &out) = 0;
+    virtual void writeAgentData(const unsigned char *data) = 0;
+
+    // Reorders agents by screen tile so neighbours in memory touch
+    // neighbouring trail map cells.
+    virtual void sortAgents() = 0;
+
+    // Changes the grid and the population in place. Surviving agents keep
+    // their position relative to the grid, agents beyond the old count are
+    // seeded like initAgents, and the trail map is resampled. The species
+    // ranges follow the new count, so agents near their ends can change
+    // species.
+    virtual void resize(uint32_t newWidth, uint32_t newHeight, uint32_t newAgentCount, uint32_t seed) = 0;
+
+    // Changes how many agents of the pool are active, up to poolSize(),
+    // without reallocating: only the dispatch sizes change. Agents activated
+    // again are seeded afresh like initAgents, and the species ranges follow
+    // the count as in resize().
+    virtual void setPopulation(uint32_t count) = 0;
+
+    // Blocks until all submitted work has completed.
+    virtual void finish() {}
+
+    // Obstacles and attractors for the agents, see EnvironmentMaps, or
+    // nullptr for none. The maps must outlive the simulation, which
+    // resamples them to its grid, again on every resize.
+    void setEnvironment(const EnvironmentMaps *maps) {
+        environment = maps;
+        environmentChanged();
+    }
+
+    // Steps run so far; a restored checkpoint continues its count.
+    uint64_t currentStep() const { return stepIndex; }
+    void setCurrentStep(uint64_t step) { stepIndex = step; }
+
+    // The seed of the per-step random numbers, for restoring a checkpoint.
+    void setRandomSeed(uint32_t seed) { randomSeed = seed; }
+
+    // 0 disables sorting, otherwise step() sorts every that many steps.
+    void setSortEvery(uint64_t steps) { sortEvery = steps; }
+
+    // Stage timing is opt-in. The GPU backend reads its timer queries one
+    // use late so it never waits on them; finish() collects the rest.
+    void enableStageTiming(bool enabled) { timingEnabled = enabled; }
+    const StageTimes &stageTimes() const { return times; }
+    void resetStageTimes() { times = StageTimes(); }
+
+    // Every timed stage is also added to the recorder, one track per stage.
+    void setTrace(TraceRecorder *recorder) {
+        trace = recorder;
+        if (trace) {
+            for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+                trace->setTrackName(stage, stageName(stage));
+            }
+        }
+    }
+
+    // Brackets a stage. The simulation times its own stages; callers use
+    // this for work it does not see, such as STAGE_PRESENT.
+    virtual void beginStage(SimulationStage stage) {
+        if (timingEnabled) {
+            stageStart[stage] = std::chrono::high_resolution_clock::now();
+        }
+    }
+
+    virtual void endStage(SimulationStage stage) {
+        if (timingEnabled) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - stageStart[stage];
+            addStageTime(stage, stageStart[stage], elapsed.count());
+        }
+    }
+
+    // colorize is for a step whose frame is about to be shown: its
+    // diffusion writes the display colors on the way.
+    void step(const SimulationParameters &params, bool colorize = false) {
+        if (sortEvery && stepIndex % sortEvery == 0) {
+            sortAgents();
+        }
+        updateAgents(params);
+        renderAgents();
+        colorizing = colorize;
+        processTrailMap(params);
+        colorizing = false;
+        ++stepIndex;
+    }
+
+    // Runs several steps back to back with nothing read back or presented in
+    // between, so the GPU backend can submit them as one batch. colorize
+    // applies to the last of them.
+    virtual void advance(const SimulationParameters &params, uint64_t steps, bool colorize = false) {
+        for (uint64_t i = 0; i < steps; ++i) {
+            step(params, colorize && i + 1 == steps);
+        }
+    }
+
+protected:
+    virtual const char *backendName() const = 0;
+
+    // Picks up environment at the current grid size.
+    virtual void environmentChanged() = 0;
+
+    void addStageTime(SimulationStage stage, std::chrono::high_resolution_clock::time_point start, double milliseconds) {
+        times.milliseconds[stage] += milliseconds;
+        ++times.calls[stage];
+        if (trace) {
+            trace->add(stageName(stage), backendName(), stage, trace->microseconds(start), milliseconds * 1000.0);
+        }
+    }
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t agentCount;
+    uint32_t agentPool;
+    uint32_t speciesCount;
+
+    bool timingEnabled = false;
+    // Set by step() while the diffusion should colorize too
+    bool colorizing = false;
+    uint64_t stepIndex = 0;
+    uint32_t randomSeed = 0;
+    const EnvironmentMaps *environment = nullptr;
+
+private:
+    uint64_t sortEvery = 0;
+    StageTimes times;
+    TraceRecorder *trace = nullptr;
+    std::chrono::high_resolution_clock::time_point stageStart[STAGE_COUNT];
+};
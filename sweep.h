@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cpu_backend.h"
+#include "environment.h"
+#include "image_io.h"
+#include "options.h"
+#include "simulation.h"
+#include "thread_pool.h"
+
+// Figures a sweep keeps of each variant's final trail map.
+struct TrailSummary {
+    // Mean and largest value over every pixel and channel
+    double mean;
+    float peak;
+    // Share of pixels bright enough to show on the display in any channel
+    double coverage;
+};
+
+inline TrailSummary summarizeTrailMap(const std::vector<float> &trail, uint32_t channels) {
+    TrailSummary summary = { 0.0, 0.0f, 0.0 };
+    const size_t pixels = trail.size() / channels;
+    size_t covered = 0;
+    for (size_t pixel = 0; pixel < pixels; ++pixel) {
+        bool visible = false;
+        for (uint32_t channel = 0; channel < channels; ++channel) {
+            float value = trail[pixel * channels + channel];
+            summary.mean += value;
+            summary.peak = std::max(summary.peak, value);
+            visible = visible || value >= 1.0f / 255.0f;
+        }
+        covered += visible;
+    }
+    summary.mean /= std::max<size_t>(trail.size(), 1);
+    summary.coverage = double(covered) / std::max<size_t>(pixels, 1);
+    return summary;
+}
+
+// The parameter sets of a sweep: every combination of the values of its
+// axes, the first axis varying slowest.
+inline size_t sweepVariantCount(const std::vector<SweepAxis> &axes) {
+    size_t count = 1;
+    for (const SweepAxis &axis : axes) {
+        count *= axis.values.size();
+    }
+    return count;
+}
+
+// Applies the values of variant to params; values receives one per axis.
+inline void sweepVariant(const std::vector<SweepAxis> &axes, size_t variant, SimulationParameters &params, std::vector<float> &values) {
+    values.assign(axes.size(), 0.0f);
+    for (size_t i = axes.size(); i-- > 0;) {
+        const SweepAxis &axis = axes[i];
+        values[i] = axis.values[variant % axis.values.size()];
+        variant /= axis.values.size();
+        float scale = 1.0f;
+        float *target = parameterOption(params, "--" + axis.name, scale);
+        *target = values[i] * scale;
+    }
+}
+
+// Runs every variant of a sweep to completion as a simulation of its own,
+// all of them from the same seed. Small grids leave a single simulation
+// little to split between threads, so rather than spreading each step over
+// the pool, every worker takes whole variants from a shared counter and
+// runs them on one thread; throughput then grows with the number of
+// variants up to the number of threads. Frames are written as
+// PREFIX_VVVV_SSSSSS.ppm at every --output-every step and the last one, and
+// the summary of each variant as a line of PREFIX.csv.
+class ParameterSweep {
+public:
+    struct Result {
+        std::vector<float> values;
+        double stepsPerSecond;
+        TrailSummary summary;
+        bool written;
+    };
+
+    // environment, when given, applies to every variant.
+    ParameterSweep(const Options &options, const EnvironmentMaps *environment = nullptr)
+        : options(options), environment(environment), pool(static_cast<unsigned>(options.threads)) {}
+
+    unsigned threadCount() const { return pool.size(); }
+    size_t variantCount() const { return sweepVariantCount(options.sweep); }
+
+    // Returns false when a frame could not be written.
+    bool run(uint32_t seed, std::vector<Result> &results) {
+        results.assign(variantCount(), Result());
+        std::atomic<size_t> next{ 0 };
+        pool.parallelFor(pool.size(), [&](size_t, size_t, unsigned) {
+            for (size_t variant; (variant = next.fetch_add(1)) < results.size();) {
+                results[variant] = runVariant(variant, seed);
+            }
+        });
+        return std::all_of(results.begin(), results.end(), [](const Result &result) { return result.written; });
+    }
+
+    bool writeSummary(const std::string &path, const std::vector<Result> &results) const {
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file) {
+            return false;
+        }
+        fprintf(file, "variant");
+        for (const SweepAxis &axis : options.sweep) {
+            fprintf(file, ",%s", axis.name.c_str());
+        }
+        fprintf(file, ",steps_per_second,mean_trail,peak_trail,coverage\n");
+        for (size_t variant = 0; variant < results.size(); ++variant) {
+            const Result &result = results[variant];
+            fprintf(file, "%zu", variant);
+            for (float value : result.values) {
+                fprintf(file, ",%g", value);
+            }
+            fprintf(file, ",%.2f,%.6g,%.6g,%.6f\n", result.stepsPerSecond, result.summary.mean, result.summary.peak,
+                result.summary.coverage);
+        }
+        return fclose(file) == 0;
+    }
+
+private:
+    Result runVariant(size_t variant, uint32_t seed) {
+        Result result = {};
+        SimulationParameters params = options.params;
+        sweepVariant(options.sweep, variant, params, result.values);
+
+        std::unique_ptr<CpuSimulation> simulation = CpuSimulation::create(options.layout, uint32_t(options.width),
+            uint32_t(options.height), uint32_t(options.agents), 1, uint32_t(options.species));
+        simulation->setSortEvery(options.sortEvery);
+        if (environment) {
+            simulation->setEnvironment(environment);
+        }
+        simulation->initAgents(seed);
+
+        result.written = true;
+        std::vector<uint32_t> display;
+        std::vector<float> trail;
+        char path[1024];
+        auto startTime = std::chrono::high_resolution_clock::now();
+        for (uint64_t step = 0; step < options.steps;) {
+            uint64_t batch = options.steps - step;
+            if (options.outputEvery) {
+                batch = std::min(batch, options.outputEvery - step % options.outputEvery);
+            }
+            const bool frame = step + batch == options.steps || (options.outputEvery && (step + batch) % options.outputEvery == 0);
+            simulation->advance(params, batch, frame);
+            step += batch;
+            if (frame) {
+                simulation->renderTrailMap();
+                simulation->readDisplay(display);
+                snprintf(path, sizeof(path), "%s_%04zu_%06llu.ppm", options.outputPrefix.c_str(), variant,
+                    static_cast<unsigned long long>(step));
+                if (!writeDisplayPPM(path, simulation->gridWidth(), simulation->gridHeight(), display.data())) {
+                    std::cerr << "Failed to write " << path << std::endl;
+                    result.written = false;
+                }
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+        result.stepsPerSecond = options.steps / std::max(elapsed.count(), 1e-9);
+
+        simulation->readTrailMap(trail);
+        result.summary = summarizeTrailMap(trail, simulation->species());
+        return result;
+    }
+
+    const Options &options;
+    const EnvironmentMaps *environment;
+    ThreadPool pool;
+};
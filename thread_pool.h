@@ -0,0 +1,114 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads for the CPU backend. Every parallelFor splits the
+// range into one contiguous chunk per thread, so the same thread keeps
+// touching the same slice of the agent and trail arrays from step to step.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threadCount) {
+        if (threadCount == 0) {
+            threadCount = std::thread::hardware_concurrency();
+        }
+        if (threadCount == 0) {
+            threadCount = 1;
+        }
+        for (unsigned i = 1; i < threadCount; ++i) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+    // Calls fn(begin, end, threadIndex) over [0, count). Large chunks are
+    // rounded to 64 elements so neighbouring threads do not share cache lines.
+    template <typename Fn>
+    void parallelFor(size_t count, Fn &&fn) {
+        const unsigned threadCount = size();
+        size_t chunk = (count + threadCount - 1) / threadCount;
+        if (chunk >= 4096) {
+            chunk = (chunk + 63) & ~size_t(63);
+        }
+
+        auto run = [&](unsigned threadIndex) {
+            size_t begin = threadIndex * chunk;
+            size_t end = begin + chunk < count ? begin + chunk : count;
+            if (begin < end) {
+                fn(begin, end, threadIndex);
+            }
+        };
+
+        if (threadCount == 1 || count <= 1) {
+            fn(size_t(0), count, 0u);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = run;
+            pending = threadCount - 1;
+            ++generation;
+        }
+        wake.notify_all();
+
+        run(0);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+        task = nullptr;
+    }
+
+private:
+    void workerLoop(unsigned threadIndex) {
+        uint64_t seen = 0;
+        while (true) {
+            std::function<void(unsigned)> current;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+                current = task;
+            }
+
+            current(threadIndex);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--pending == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(unsigned)> task;
+    uint64_t generation = 0;
+    unsigned pending = 0;
+    bool stopping = false;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Collects complete ("X") events in the Chrome trace event format, which
+// chrome://tracing and Perfetto both open. Every track is a thread id with a
+// name, so each stage gets its own row.
+//
+// Events are kept in memory until write(), so a long windowed run stops
+// recording after MAX_TRACE_EVENTS of them, about 40 MB.
+constexpr size_t MAX_TRACE_EVENTS = 1000000;
+
+class TraceRecorder {
+public:
+    TraceRecorder() : epoch(std::chrono::high_resolution_clock::now()) {}
+
+    double microseconds(std::chrono::high_resolution_clock::time_point time) const {
+        return std::chrono::duration<double, std::micro>(time - epoch).count();
+    }
+
+    void setTrackName(int track, const std::string &name) {
+        if (track >= int(trackNames.size())) {
+            trackNames.resize(track + 1);
+        }
+        trackNames[track] = name;
+    }
+
+    // name and category must outlive the recorder, e.g. string literals.
+    // Stages run on the batch thread and presents on the window thread
+    // add their events side by side.
+    void add(const char *name, const char *category, int track, double start, double duration) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (events.size() >= MAX_TRACE_EVENTS) {
+            if (!full) {
+                full = true;
+                std::cerr << "Trace reached " << MAX_TRACE_EVENTS << " events, later stages are not recorded" << std::endl;
+            }
+            return;
+        }
+        events.push_back({ name, category, track, start, duration });
+    }
+
+    bool write(const std::string &path) const {
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file) {
+            return false;
+        }
+
+        fprintf(file, "{\"traceEvents\":[\n");
+        bool first = true;
+        for (size_t track = 0; track < trackNames.size(); ++track) {
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", track, trackNames[track].c_str());
+            fprintf(file, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"sort_index\":%zu}}",
+                track, track);
+            first = false;
+        }
+        for (const Event &event : events) {
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                first ? "" : ",\n", event.name, event.category, event.track, event.start, event.duration);
+            first = false;
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+        bool ok = ferror(file) == 0;
+        fclose(file);
+        return ok;
+    }
+
+private:
+    struct Event {
+        const char *name;
+        const char *category;
+        int track;
+        double start;
+        double duration;
+    };
+
+    std::chrono::high_resolution_clock::time_point epoch;
+    std::vector<std::string> trackNames;
+    std::vector<Event> events;
+    bool full = false;
+    std::mutex mutex;
+};
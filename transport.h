@@ -0,0 +1,282 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Point-to-point messages between the processes of a distributed run, one
+// rank each. send() and receive() block and keep their order per peer; the
+// helpers below frame variable-sized messages on top of them.
+class Transport {
+public:
+    Transport(int rank, int size) : selfRank(rank), rankCount(size) {}
+    virtual ~Transport() = default;
+
+    int rank() const { return selfRank; }
+    int size() const { return rankCount; }
+
+    virtual bool send(int peer, const void *data, size_t bytes) = 0;
+    virtual bool receive(int peer, void *data, size_t bytes) = 0;
+
+    // A message is its length followed by its bytes.
+    bool sendMessage(int peer, const std::vector<unsigned char> &data) {
+        uint64_t bytes = data.size();
+        return send(peer, &bytes, sizeof(bytes)) && send(peer, data.data(), data.size());
+    }
+
+    bool receiveMessage(int peer, std::vector<unsigned char> &data) {
+        uint64_t bytes = 0;
+        if (!receive(peer, &bytes, sizeof(bytes))) {
+            return false;
+        }
+        data.resize(size_t(bytes));
+        return receive(peer, data.data(), data.size());
+    }
+
+    // Swaps a message with peer. The lower rank sends first, so two ranks
+    // blocked on each other always make progress.
+    bool exchange(int peer, const std::vector<unsigned char> &out, std::vector<unsigned char> &in) {
+        if (selfRank < peer) {
+            return sendMessage(peer, out) && receiveMessage(peer, in);
+        }
+        return receiveMessage(peer, in) && sendMessage(peer, out);
+    }
+
+private:
+    int selfRank;
+    int rankCount;
+};
+
+// Stream sockets between ranks: Unix domain sockets for processes on one
+// machine, TCP across machines. Only the links a banded run uses are
+// opened, to each neighbour and between rank 0 and everyone else.
+class SocketTransport : public Transport {
+public:
+    // addresses[i] is where rank i listens: a path (anything with a '/') for
+    // a Unix socket, or host:port. Every rank listens, connects to the
+    // lower ranks it links with, then accepts the higher ones. Gives up
+    // after timeoutSeconds.
+    static std::unique_ptr<SocketTransport> connect(const std::vector<std::string> &addresses, int rank,
+                                                    int timeoutSeconds = 60) {
+        std::unique_ptr<SocketTransport> transport(new SocketTransport(rank, int(addresses.size())));
+        if (!transport->open(addresses, timeoutSeconds)) {
+            return nullptr;
+        }
+        return transport;
+    }
+
+    ~SocketTransport() override {
+        for (int socket : sockets) {
+            if (socket >= 0) {
+                ::close(socket);
+            }
+        }
+    }
+
+    SocketTransport(const SocketTransport &) = delete;
+    SocketTransport &operator=(const SocketTransport &) = delete;
+
+    static bool linked(int a, int b) { return a == 0 || b == 0 || a - b == 1 || b - a == 1; }
+
+    bool send(int peer, const void *data, size_t bytes) override {
+        const char *next = static_cast<const char *>(data);
+        while (bytes) {
+            ssize_t sent = ::send(sockets[peer], next, bytes, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return fail(peer);
+            }
+            next += sent;
+            bytes -= size_t(sent);
+        }
+        return true;
+    }
+
+    bool receive(int peer, void *data, size_t bytes) override {
+        char *next = static_cast<char *>(data);
+        while (bytes) {
+            ssize_t received = ::recv(sockets[peer], next, bytes, 0);
+            if (received <= 0) {
+                return fail(peer);
+            }
+            next += received;
+            bytes -= size_t(received);
+        }
+        return true;
+    }
+
+private:
+    SocketTransport(int rank, int size) : Transport(rank, size), sockets(size_t(size), -1) {}
+
+    static bool isUnixAddress(const std::string &address) { return address.find('/') != std::string::npos; }
+
+    // Splits host:port; an empty host means every interface when listening.
+    static bool splitAddress(const std::string &address, std::string &host, std::string &port) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos || colon + 1 == address.size()) {
+            return false;
+        }
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+        return true;
+    }
+
+    static bool unixAddress(const std::string &path, sockaddr_un &out) {
+        std::memset(&out, 0, sizeof(out));
+        out.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(out.sun_path)) {
+            return false;
+        }
+        std::memcpy(out.sun_path, path.c_str(), path.size());
+        return true;
+    }
+
+    int listenOn(const std::string &address) {
+        int socket = -1;
+        if (isUnixAddress(address)) {
+            sockaddr_un local;
+            if (!unixAddress(address, local)) {
+                return -1;
+            }
+            unlink(address.c_str());
+            socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (socket >= 0 && bind(socket, reinterpret_cast<sockaddr *>(&local), sizeof(local)) != 0) {
+                ::close(socket);
+                return -1;
+            }
+        } else {
+            std::string host, port;
+            addrinfo hints = {}, *found = nullptr;
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_PASSIVE;
+            if (!splitAddress(address, host, port) || getaddrinfo(nullptr, port.c_str(), &hints, &found) != 0) {
+                return -1;
+            }
+            socket = ::socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+            int reuse = 1;
+            if (socket >= 0 && (setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+                                bind(socket, found->ai_addr, found->ai_addrlen) != 0)) {
+                ::close(socket);
+                socket = -1;
+            }
+            freeaddrinfo(found);
+        }
+        if (socket >= 0 && listen(socket, SOMAXCONN) != 0) {
+            ::close(socket);
+            return -1;
+        }
+        return socket;
+    }
+
+    // One attempt; the peer may not be listening yet.
+    static int connectTo(const std::string &address) {
+        if (isUnixAddress(address)) {
+            sockaddr_un remote;
+            if (!unixAddress(address, remote)) {
+                return -1;
+            }
+            int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (socket >= 0 && ::connect(socket, reinterpret_cast<sockaddr *>(&remote), sizeof(remote)) != 0) {
+                ::close(socket);
+                return -1;
+            }
+            return socket;
+        }
+        std::string host, port;
+        addrinfo hints = {}, *found = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (!splitAddress(address, host, port) || getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) {
+            return -1;
+        }
+        int socket = -1;
+        for (addrinfo *candidate = found; candidate && socket < 0; candidate = candidate->ai_next) {
+            socket = ::socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+            if (socket >= 0 && ::connect(socket, candidate->ai_addr, candidate->ai_addrlen) != 0) {
+                ::close(socket);
+                socket = -1;
+            }
+        }
+        freeaddrinfo(found);
+        // Halo messages are small and latency bound
+        int noDelay = 1;
+        if (socket >= 0) {
+            setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        }
+        return socket;
+    }
+
+    bool open(const std::vector<std::string> &addresses, int timeoutSeconds) {
+        const int self = rank();
+        int listener = listenOn(addresses[self]);
+        if (listener < 0) {
+            std::cerr << "Rank " << self << " failed to listen on " << addresses[self] << std::endl;
+            return false;
+        }
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeoutSeconds);
+        bool ok = true;
+        for (int peer = 0; peer < self && ok; ++peer) {
+            if (!linked(self, peer)) {
+                continue;
+            }
+            while ((sockets[peer] = connectTo(addresses[peer])) < 0 && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            int32_t hello = self;
+            ok = sockets[peer] >= 0 && send(peer, &hello, sizeof(hello));
+            if (!ok) {
+                std::cerr << "Rank " << self << " failed to connect to rank " << peer << " at " << addresses[peer] << std::endl;
+            }
+        }
+
+        // accept() gives up at the deadline too
+        timeval timeout = { timeoutSeconds, 0 };
+        setsockopt(listener, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int expected = 0;
+        for (int peer = self + 1; peer < size(); ++peer) {
+            expected += linked(self, peer);
+        }
+        for (int accepted = 0; accepted < expected && ok; ++accepted) {
+            int socket = accept(listener, nullptr, nullptr);
+            int32_t peer = -1;
+            ok = socket >= 0 && recv(socket, &peer, sizeof(peer), MSG_WAITALL) == sizeof(peer)
+                && peer > self && peer < size() && sockets[peer] < 0;
+            if (ok) {
+                sockets[peer] = socket;
+                int noDelay = 1;
+                setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            } else {
+                std::cerr << "Rank " << self << " got an invalid connection on " << addresses[self] << std::endl;
+                if (socket >= 0) {
+                    ::close(socket);
+                }
+            }
+        }
+
+        ::close(listener);
+        if (isUnixAddress(addresses[self])) {
+            unlink(addresses[self].c_str());
+        }
+        return ok;
+    }
+
+    bool fail(int peer) {
+        std::cerr << "Rank " << rank() << " lost the connection to rank " << peer << std::endl;
+        return false;
+    }
+
+    std::vector<int> sockets;
+};